@@ -73,6 +73,7 @@ extern void *array_cursor;
 extern void *struct_cursor;
 extern void *member_cursor;
 extern void *mem_cursor;
+extern void *region_cursor;
 extern void *type_cursor;
 extern void *ref_cursor;
 extern void *ref_insert;
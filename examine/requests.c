@@ -63,12 +63,15 @@ static void event_terminated(int fd);
 static void send_event(JSON_OBJ *evt, const char *type, int fd);
 static int set_first_step(const char **error);
 static int set_last_step(const char **error);
+static int select_thread(const JSON_OBJ *request, const char **error);
 
 // current execution context
 char        *cur_file;
 uint64_t    cur_step;
+static uint64_t first_step;     // may be other than 1 if recorded in black box mode
 uint64_t    cur_line;
 int         cur_depth;
+int         cur_thread;     // thread of current step, steps move within the thread
 int         signum; // non-zero if process ended with signal
 uint64_t    program_base_addr;
 int         stop_on_entry;
@@ -106,6 +109,7 @@ int process_init(const JSON_OBJ *request, int fd) {
     cur_step = 0;
     cur_line = 0;
     cur_depth = 0;
+    cur_thread = 0;
     signum = 0;
     program_base_addr = 0;
     stop_on_entry = 0;
@@ -299,15 +303,41 @@ cleanup:
  **************************************************************************/
 int process_threads(const JSON_OBJ *request, int fd) {
     JSON_OBJ *rsp = JSON_NEW_OBJ();
+    int ret = SUCCESS;
+    const char *error = NULL;
+    const char *response;
+    void *cursor;
+
+    if (DAB_OK != DAB_CURSOR_OPEN(&cursor, "SELECT "
+                "id, "
+                "name "
+            "FROM "
+                "thread "
+            "ORDER BY "
+                "id")) {
+        error = "Cannot query threads";
+        RETCLEAN(FAILURE);
+    }
 
-    // TODO: add real support for threads
     JSON_OBJ *threads = JSON_NEW_ARRAY_FIELD(JSON_NEW_OBJ_FIELD(rsp, "body"), "threads");
-    JSON_OBJ *item = JSON_NEW_OBJ();
-    JSON_NEW_STRING_FIELD(item, "name", "thread 1");
-    JSON_NEW_INT32_FIELD(item, "id", 1);
-    JSON_ADD_OBJ_ITEM(threads, item);
+    int id, db_err;
+    char *name;
+    while (DAB_OK == (db_err = DAB_CURSOR_FETCH(cursor, &id, &name))) {
+        char text[64];
+        snprintf(text, sizeof(text), "thread %d (%s)", id, name);
+        JSON_OBJ *item = JSON_ADD_NEW_ITEM(threads);
+        JSON_NEW_STRING_FIELD(item, "name", text);
+        JSON_NEW_INT32_FIELD(item, "id", id);
+    }
+    DAB_CURSOR_FREE(cursor);
+    if (DAB_NO_DATA != db_err) {
+        error = "Error fetching threads";
+        ERR(error);     // detailed error logged by FETCH
+        RETCLEAN(FAILURE);
+    }
 
-    const char *response = build_response(request, rsp, SUCCESS, NULL);
+cleanup:
+    response = build_response(request, rsp, ret, SUCCESS == ret ? NULL : error);
     int err = send_message(fd, response);
     if (SUCCESS != err) {
         ERR("Cannot send response");
@@ -315,7 +345,7 @@ int process_threads(const JSON_OBJ *request, int fd) {
     }
     JSON_RELEASE(rsp);
 
-    return SUCCESS;
+    return ret;
 }
 
 
@@ -356,6 +386,9 @@ int process_stack(const JSON_OBJ *request, int fd) {
         ERR(error);
         RETCLEAN(FAILURE);
     }
+    if (SUCCESS != select_thread(request, &error)) {
+        RETCLEAN(FAILURE);
+    }
 
     if (!stack_cursor) {
         // TODO: Probably recursive query is faster, but I didn't figure it out yet
@@ -379,17 +412,17 @@ int process_stack(const JSON_OBJ *request, int fd) {
             "WHERE "
                 "s.id IN ("
                     // TODO: may benefit from index by id + depth
-                    "SELECT MAX(id) FROM step WHERE id <= ? AND depth <= ? GROUP BY depth"
+                    "SELECT MAX(id) FROM step WHERE thread_id = ? AND id <= ? AND depth <= ? GROUP BY depth"
                 ")"
             "ORDER BY "
                 "s.depth DESC",
-            cur_step, cur_depth
+            cur_thread, cur_step, cur_depth
         )) {
             error = "Cannot prepare statement";
             RETCLEAN(FAILURE);
         }
     } else if ( DAB_OK != DAB_CURSOR_RESET(stack_cursor) ||
-                DAB_OK != DAB_CURSOR_BIND(stack_cursor, cur_step, cur_depth)) {
+                DAB_OK != DAB_CURSOR_BIND(stack_cursor, cur_thread, cur_step, cur_depth)) {
         error = "Cannot query stack trace";
         RETCLEAN(FAILURE);
     }
@@ -481,6 +514,9 @@ int process_next(const JSON_OBJ *request, int fd) {
     int term = 0;
     int stop_reason;
 
+    if (SUCCESS != select_thread(request, &error)) {
+        RETCLEAN(FAILURE);
+    }
     if (!next_cursor) {
         if (DAB_OK != DAB_CURSOR_OPEN(&next_cursor,
             "SELECT "
@@ -495,19 +531,20 @@ int process_next(const JSON_OBJ *request, int fd) {
                 "JOIN file f ON "
                     "f.id = st.file_id "
             "WHERE "
+                "s.thread_id = ? AND "
                 "s.id > ? AND "
                 "s.depth <= ? AND "
 		"NOT (f.name = ? AND st.line = ?) "
             "ORDER BY "
                 "s.id "
             "LIMIT 1",
-            cur_step, cur_depth, cur_file, cur_line
+            cur_thread, cur_step, cur_depth, cur_file, cur_line
         )) {
             error = "Cannot prepare statement";
             RETCLEAN(FAILURE);
         }
-    } else if (DAB_OK != DAB_CURSOR_RESET(next_cursor) || DAB_OK != DAB_CURSOR_BIND(next_cursor, cur_step,
-                cur_depth, cur_file, cur_line)) {
+    } else if (DAB_OK != DAB_CURSOR_RESET(next_cursor) || DAB_OK != DAB_CURSOR_BIND(next_cursor, cur_thread,
+                cur_step, cur_depth, cur_file, cur_line)) {
         error = "Cannot query next step";
         RETCLEAN(FAILURE);
     }
@@ -569,6 +606,9 @@ int process_stepin(const JSON_OBJ *request, int fd) {
     int term = 0;
     int stop_reason;
 
+    if (SUCCESS != select_thread(request, &error)) {
+        RETCLEAN(FAILURE);
+    }
     if (!stepin_cursor) {
         if (DAB_OK != DAB_CURSOR_OPEN(&stepin_cursor,
             "SELECT "
@@ -583,13 +623,17 @@ int process_stepin(const JSON_OBJ *request, int fd) {
                 "JOIN file f ON "
                     "f.id = st.file_id "
             "WHERE "
-                "s.id = ? + 1",
-            cur_step
+                "s.thread_id = ? AND "
+                "s.id > ? "
+            "ORDER BY "
+                "s.id "
+            "LIMIT 1",
+            cur_thread, cur_step
         )) {
             error = "Cannot prepare statement";
             RETCLEAN(FAILURE);
         }
-    } else if (DAB_OK != DAB_CURSOR_RESET(stepin_cursor) || DAB_OK != DAB_CURSOR_BIND(stepin_cursor, cur_step)) {
+    } else if (DAB_OK != DAB_CURSOR_RESET(stepin_cursor) || DAB_OK != DAB_CURSOR_BIND(stepin_cursor, cur_thread, cur_step)) {
         error = "Cannot query next step";
         RETCLEAN(FAILURE);
     }
@@ -651,6 +695,9 @@ int process_stepout(const JSON_OBJ *request, int fd) {
     int term = 0;
     int stop_reason = 0;
 
+    if (SUCCESS != select_thread(request, &error)) {
+        RETCLEAN(FAILURE);
+    }
     if (cur_depth <= 1) {   // do nothing - already at top level
         RETCLEAN(SUCCESS);
     }
@@ -669,18 +716,19 @@ int process_stepout(const JSON_OBJ *request, int fd) {
                 "JOIN file f ON "
                     "f.id = st.file_id "
             "WHERE "
+                "s.thread_id = ? AND "
                 "s.id > ? AND "
                 "s.depth < ?"
             "ORDER BY "
                 "s.id "
             "LIMIT 1",
-            cur_step, cur_depth
+            cur_thread, cur_step, cur_depth
         )) {
             error = "Cannot prepare statement";
             RETCLEAN(FAILURE);
         }
     } else if ( DAB_OK != DAB_CURSOR_RESET(stepout_cursor) ||
-                DAB_OK != DAB_CURSOR_BIND(stepout_cursor, cur_step, cur_depth)) {
+                DAB_OK != DAB_CURSOR_BIND(stepout_cursor, cur_thread, cur_step, cur_depth)) {
         error = "Cannot query next step";
         RETCLEAN(FAILURE);
     }
@@ -744,7 +792,10 @@ int process_stepback(const JSON_OBJ *request, int fd) {
     const char *response;
     int term = 0;
 
-    if (cur_step <= 1) {
+    if (SUCCESS != select_thread(request, &error)) {
+        RETCLEAN(FAILURE);
+    }
+    if (cur_step <= first_step) {
         term = 1;
         RETCLEAN(SUCCESS);  // already at first step - nothing to do
     }
@@ -763,25 +814,28 @@ int process_stepback(const JSON_OBJ *request, int fd) {
                 "JOIN file f ON "
                     "f.id = st.file_id "
             "WHERE "
+                "s.thread_id = ? AND "
                 "s.id < ? AND "
                 "s.depth <= ? AND "
 		        "NOT (f.name = ? AND st.line = ?) "
             "ORDER BY "
                 "s.id DESC "
             "LIMIT 1",
-            cur_step, cur_depth, cur_file, cur_line
+            cur_thread, cur_step, cur_depth, cur_file, cur_line
         )) {
             error = "Cannot prepare statement";
             RETCLEAN(FAILURE);
         }
     } else if ( DAB_OK != DAB_CURSOR_RESET(stepback_cursor) ||
-                DAB_OK != DAB_CURSOR_BIND(stepback_cursor, cur_step, cur_depth, cur_file, cur_line)) {
+                DAB_OK != DAB_CURSOR_BIND(stepback_cursor, cur_thread, cur_step, cur_depth, cur_file, cur_line)) {
         error = "Cannot query next step";
         RETCLEAN(FAILURE);
     }
 
     ret = DAB_CURSOR_FETCH(stepback_cursor, &cur_file, &cur_line, &cur_step, &cur_depth);
-    if (DAB_OK != ret) {
+    if (DAB_NO_DATA == ret) {
+        ret = SUCCESS;      // already at first step of the thread - stay there
+    } else if (DAB_OK != ret) {
         ERR("Cannot get next step");
         RETCLEAN(FAILURE);
     } else {
@@ -969,7 +1023,9 @@ int process_continue(const JSON_OBJ *request, int fd) {
                 "f.name, "
                 "st.line, "
                 "s.id, "
-                "s.depth "
+                "s.depth, "
+                "s.thread_id, "
+                "(SELECT MAX(id) FROM step WHERE thread_id = s.thread_id AND id < s.id) "
             "FROM "
                 "step s "
                 "JOIN statement st ON "
@@ -993,10 +1049,13 @@ int process_continue(const JSON_OBJ *request, int fd) {
         RETCLEAN(FAILURE);
     }
 
-    uint64_t new_line, new_step;
+    uint64_t new_line, new_step, prev_step;
+    int new_depth, new_thread;
     char *new_file;
-    while (DAB_OK == (ret = DAB_CURSOR_FETCH(continue_cursor, &new_file, &new_line, &new_step, &cur_depth))) {
-        if (new_step == cur_step+1 && new_line == cur_line && !strcmp(cur_file, new_file)) {
+    while (DAB_OK == (ret = DAB_CURSOR_FETCH(continue_cursor, &new_file, &new_line, &new_step, &new_depth,
+                &new_thread, &prev_step))) {
+        /* step ids are shared by all threads, so the same line is the next step of the same thread */
+        if (new_thread == cur_thread && prev_step == cur_step && new_line == cur_line && !strcmp(cur_file, new_file)) {
             /* hit the next statement on the same line - repeat */
             cur_step = new_step;
             continue;
@@ -1004,6 +1063,8 @@ int process_continue(const JSON_OBJ *request, int fd) {
         cur_step = new_step;
         cur_line = new_line;
         cur_file = new_file;
+        cur_depth = new_depth;
+        cur_thread = new_thread;
         break;
     }
     
@@ -1065,7 +1126,9 @@ int process_revcontinue(const JSON_OBJ *request, int fd) {
                 "f.name, "
                 "st.line, "
                 "s.id, "
-                "s.depth "
+                "s.depth, "
+                "s.thread_id, "
+                "(SELECT MIN(id) FROM step WHERE thread_id = s.thread_id AND id > s.id) "
             "FROM "
                 "step s "
                 "JOIN statement st ON "
@@ -1090,10 +1153,13 @@ int process_revcontinue(const JSON_OBJ *request, int fd) {
         RETCLEAN(FAILURE);
     }
 
-    uint64_t new_line, new_step;
+    uint64_t new_line, new_step, next_step;
+    int new_depth, new_thread;
     char *new_file;
-    while (DAB_OK == (ret = DAB_CURSOR_FETCH(revcontinue_cursor, &new_file, &new_line, &new_step, &cur_depth))) {
-        if (new_step == cur_step-1 && new_line == cur_line && !strcmp(cur_file, new_file)) {
+    while (DAB_OK == (ret = DAB_CURSOR_FETCH(revcontinue_cursor, &new_file, &new_line, &new_step, &new_depth,
+                &new_thread, &next_step))) {
+        /* step ids are shared by all threads, so the same line is the prev step of the same thread */
+        if (new_thread == cur_thread && next_step == cur_step && new_line == cur_line && !strcmp(cur_file, new_file)) {
             /* hit the prev statement on the same line - repeat */
             cur_step = new_step;
             continue;
@@ -1101,6 +1167,8 @@ int process_revcontinue(const JSON_OBJ *request, int fd) {
         cur_step = new_step;
         cur_line = new_line;
         cur_file = new_file;
+        cur_depth = new_depth;
+        cur_thread = new_thread;
         break;
     }
 
@@ -1590,7 +1658,8 @@ void event_stopped(int fd, int reason) {
             JSON_NEW_STRING_FIELD(body, "reason", "step");
             break;
     }
-    JSON_NEW_INT32_FIELD(body, "threadId", 1);
+    JSON_NEW_INT32_FIELD(body, "threadId", cur_thread);
+    JSON_NEW_TRUE_FIELD(body, "allThreadsStopped");
     if (STOP_REASON_SIGNAL == reason && signum) {
         char text[64];
         snprintf(text, sizeof(text), "Caught signal %s (%d)", strsignal(signum), signum);
@@ -1700,6 +1769,7 @@ void release_cursors(void) {
     DAB_CURSOR_FREE(struct_cursor);
     DAB_CURSOR_FREE(member_cursor);
     DAB_CURSOR_FREE(mem_cursor);
+    DAB_CURSOR_FREE(region_cursor);
     DAB_CURSOR_FREE(type_cursor);
     DAB_CURSOR_FREE(ref_cursor);
     DAB_CURSOR_FREE(ref_insert);
@@ -1727,9 +1797,13 @@ void release_cursors(void) {
 int set_first_step(const char **error) {
     // get first step from DB and set it as current step
     void *cursor;
+    /* in black box mode older steps are dropped, so first step isn't necessarily step 1 */
     int db_err = DAB_CURSOR_OPEN(&cursor, "SELECT "
                 "f.name, "
-                "st.line "
+                "st.line, "
+                "s.id, "
+                "s.depth, "
+                "s.thread_id "
             "FROM "
                 "step s "
                 "JOIN statement st ON "
@@ -1737,13 +1811,13 @@ int set_first_step(const char **error) {
                 "JOIN file f ON "
                     "f.id = st.file_id "
             "WHERE "
-                "s.id = 1");
+                "s.id = (SELECT MIN(id) FROM step)");
     if (DAB_OK != db_err) {
         *error = "Cannot query database";    // error is logged by DAB_CURSOR_OPEN()
         return FAILURE;
     }
 
-    db_err = DAB_CURSOR_FETCH(cursor, &cur_file, &cur_line);
+    db_err = DAB_CURSOR_FETCH(cursor, &cur_file, &cur_line, &first_step, &cur_depth, &cur_thread);
     DAB_CURSOR_FREE(cursor);
     if (DAB_NO_DATA == db_err) {
         *error = "DB doesn't contain execution info";
@@ -1753,8 +1827,7 @@ int set_first_step(const char **error) {
         *error = "Cannot get step info from DB";     // error logged by FETCH
         return FAILURE;
     }
-    cur_step = 1;
-    cur_depth = 1;
+    cur_step = first_step;
 
     return SUCCESS;
 }
@@ -1777,7 +1850,8 @@ int set_last_step(const char **error) {
     int db_err = DAB_CURSOR_OPEN(&cursor, "SELECT "
                 "f.name, "
                 "st.line, "
-                "s.id "
+                "s.id, "
+                "s.thread_id "
             "FROM "
                 "step s "
                 "JOIN statement st ON "
@@ -1791,7 +1865,7 @@ int set_last_step(const char **error) {
         return FAILURE;
     }
 
-    db_err = DAB_CURSOR_FETCH(cursor, &cur_file, &cur_line, &cur_step);
+    db_err = DAB_CURSOR_FETCH(cursor, &cur_file, &cur_line, &cur_step, &cur_thread);
     DAB_CURSOR_FREE(cursor);
     if (DAB_NO_DATA == db_err) {
         *error = "DB doesn't contain execution info";
@@ -1805,3 +1879,62 @@ int set_last_step(const char **error) {
 
     return SUCCESS;
 }
+
+
+/**************************************************************************
+ *
+ *  Function:   select_thread
+ *
+ *  Params:     request - JSON request
+ *              error - where to store error message
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      If request is for thread other than current one, make
+ *              the last step of that thread, done before current step,
+ *              the current step. If thread hasn't started yet, use its
+ *              first step
+ *
+ **************************************************************************/
+int select_thread(const JSON_OBJ *request, const char **error) {
+    int thread = JSON_GET_INT32_FIELD(JSON_GET_OBJ(request, "arguments"), "threadId");
+    if (JSON_OK != json_err || thread == cur_thread) {
+        return SUCCESS;     // nothing to switch to
+    }
+
+    void *cursor;
+    int db_err = DAB_CURSOR_OPEN(&cursor, "SELECT "
+                "f.name, "
+                "st.line, "
+                "s.id, "
+                "s.depth "
+            "FROM "
+                "step s "
+                "JOIN statement st ON "
+                    "st.address = s.address "
+                "JOIN file f ON "
+                    "f.id = st.file_id "
+            "WHERE "
+                "s.id = COALESCE("
+                    "(SELECT MAX(id) FROM step WHERE thread_id = ? AND id <= ?), "
+                    "(SELECT MIN(id) FROM step WHERE thread_id = ?))",
+            thread, cur_step, thread);
+    if (DAB_OK != db_err) {
+        *error = "Cannot query database";    // error is logged by DAB_CURSOR_OPEN()
+        return FAILURE;
+    }
+
+    db_err = DAB_CURSOR_FETCH(cursor, &cur_file, &cur_line, &cur_step, &cur_depth);
+    DAB_CURSOR_FREE(cursor);
+    if (DAB_NO_DATA == db_err) {
+        *error = "Unknown thread";
+        ERR(*error);
+        return FAILURE;
+    } else if (DAB_OK != db_err) {
+        *error = "Cannot get step info from DB";     // error logged by FETCH
+        return FAILURE;
+    }
+    cur_thread = thread;
+
+    return SUCCESS;
+}
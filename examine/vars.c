@@ -41,6 +41,7 @@
 #include "flightrec.h"
 #include "examine.h"
 #include "mem.h"
+#include "regs.h"
 #include "jsonapi.h"
 
 static Dwarf_Debug dbg;
@@ -51,6 +52,7 @@ void *array_cursor;
 void *struct_cursor;
 void *member_cursor;
 void *mem_cursor;
+void *region_cursor;
 void *type_cursor;
 void *ref_cursor;
 void *ref_insert;
@@ -86,6 +88,9 @@ static int get_location(Dwarf_Attribute attrib, REG_TYPE pc, LLONG base_addr, st
 static int add_var_entry(JSON_OBJ *container, int parent_type, ULONG parent, char *name, ULONG addr,
                         ULONG type, int indirect);
 static int func_name(ULONG address, char **name);
+static int get_step_regs(uint64_t step, struct user_regs_struct *regs);
+static int open_mem_cursor(ULONG addr, size_t size, uint64_t step);
+static int open_region_cursor(ULONG addr, size_t size, uint64_t step);
 
 
 /**************************************************************************
@@ -205,30 +210,11 @@ int get_var_address(uint64_t var_id, uint64_t step, char **name, uint64_t *addre
     }
 
     /* get registers (especially PC) for the step */
-    if (!step_cursor) {
-        if (DAB_OK != DAB_CURSOR_OPEN(&step_cursor,
-            "SELECT "
-                "regs "
-            "FROM "
-                "step "
-            "WHERE "
-                "id = ?", step
-        )) {
-            return FAILURE;
-        }
-    } else if (DAB_OK != DAB_CURSOR_RESET(step_cursor) || DAB_OK != DAB_CURSOR_BIND(step_cursor, step)) {
+    struct user_regs_struct regs;
+    if (SUCCESS != get_step_regs(step, &regs)) {
         return FAILURE;
     }
 
-    /* manualy assemble Stingray string to be used as BLOB */
-    struct sr *registers = sr_new("", sizeof(struct user_regs_struct) + 1);
-    if (DAB_OK != DAB_CURSOR_FETCH(step_cursor, registers)) {
-        ERR("Cannot find registers for step %" PRIu64, step);
-        RETCLEAN(FAILURE);
-    }
-    struct user_regs_struct regs;
-    memcpy(&regs, CSTR(registers), sizeof(regs));
-
     /* find variable location information */
     int dwarf_ret = dwarf_offdie_b(dbg, var_offset, 1, &die, &err);
     if (DW_DLV_ERROR == dwarf_ret) {
@@ -272,7 +258,6 @@ int get_var_address(uint64_t var_id, uint64_t step, char **name, uint64_t *addre
     *address = (uint64_t)addr;
 
 cleanup:
-    STRFREE(registers);
     if (err) {
         dwarf_dealloc(dbg, err, DW_DLA_ERROR);
     }
@@ -284,6 +269,81 @@ cleanup:
 }
 
 
+/**************************************************************************
+ *
+ *  Function:   get_step_regs
+ *
+ *  Params:     step - step to get registers for
+ *              regs - where to store registers
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Steps store only changed registers, so start from the
+ *              nearest preceding step of the same thread with full
+ *              register set and apply the changes
+ *
+ **************************************************************************/
+int get_step_regs(uint64_t step, struct user_regs_struct *regs) {
+    int ret = SUCCESS;
+
+    if (!step_cursor) {
+        if (DAB_OK != DAB_CURSOR_OPEN(&step_cursor,
+            "SELECT "
+                "id, "
+                "regs "
+            "FROM "
+                "step "
+            "WHERE "
+                "thread_id = (SELECT thread_id FROM step WHERE id = ?) AND "
+                "id <= ? "
+            "ORDER BY "
+                "id DESC "
+            "LIMIT ?", step, step, REGS_KEYFRAME_FREQ
+        )) {
+            return FAILURE;
+        }
+    } else if (DAB_OK != DAB_CURSOR_RESET(step_cursor) ||
+            DAB_OK != DAB_CURSOR_BIND(step_cursor, step, step, REGS_KEYFRAME_FREQ)) {
+        return FAILURE;
+    }
+
+    /* rows go from the requested step backwards, until full register set */
+    struct {
+        size_t  size;
+        char    blob[sizeof(struct user_regs_struct)];
+    } rows[REGS_KEYFRAME_FREQ];
+    int count = 0;
+    uint64_t id;
+    struct sr *registers = sr_new("", sizeof(struct user_regs_struct) + 1);
+    while (count < REGS_KEYFRAME_FREQ && DAB_OK == DAB_CURSOR_FETCH(step_cursor, &id, registers)) {
+        if ((!count && id != step) || (size_t)STRLEN(registers) > sizeof(rows[count].blob)) {
+            break;
+        }
+        rows[count].size = STRLEN(registers);
+        memcpy(rows[count].blob, CSTR(registers), rows[count].size);
+        if (sizeof(*regs) == rows[count++].size) {
+            break;
+        }
+    }
+    if (!count || sizeof(*regs) != rows[count - 1].size) {
+        ERR("Cannot find registers for step %" PRIu64, step);
+        RETCLEAN(FAILURE);
+    }
+
+    while (count--) {
+        if (SUCCESS != regs_apply(regs, rows[count].blob, rows[count].size)) {
+            ERR("Invalid registers for step %" PRIu64, step);
+            RETCLEAN(FAILURE);
+        }
+    }
+
+cleanup:
+    STRFREE(registers);
+
+    return ret;
+}
+
+
 /**************************************************************************
  *
  *  Function:   add_var_items
@@ -541,62 +601,160 @@ cleanup:
  *
  *  Return:     allocated buffer (need to be freed) / NULL on error
  *
- *  Descr:      Get memory content for the specified address
+ *  Descr:      Get memory content for the specified address. Zero memory
+ *              isn't recorded, so bytes without content, recorded since
+ *              the memory was snapshotted, are zero
  *
  **************************************************************************/
 char *get_var_value(ULONG addr, size_t size, uint64_t step) {
-    /* find memory content */
+    if (SUCCESS != open_region_cursor(addr, size, step)) {
+        return NULL;
+    }
+
+    /* find when every byte was snapshotted last time, content recorded before it is stale */
+    ULONG region_start, region_size, region_step;
+    ULONG *since = calloc(size, sizeof(*since));    // 0 - memory wasn't snapshotted
+    int ret;
+    while (DAB_OK == (ret = DAB_CURSOR_FETCH(region_cursor, &region_start, &region_size, &region_step))) {
+        ULONG from = region_start > addr ? region_start : addr;
+        ULONG to = region_start + region_size < addr + size ? region_start + region_size : addr + size;
+        for (ULONG cur = from; cur < to; cur++) {
+            if (!since[cur - addr]) {
+                since[cur - addr] = region_step;
+            }
+        }
+    }
+    if (DAB_NO_DATA != ret || SUCCESS != open_mem_cursor(addr, size, step)) {
+        free(since);
+        return NULL;
+    }
+    /* once runs get older than the oldest snapshot, remaining bytes are zero */
+    ULONG oldest = since[0];
+    for (size_t i = 1; i < size; i++) {
+        if (since[i] < oldest) {
+            oldest = since[i];
+        }
+    }
+
+    /* runs may overlap, so go from the latest one back, and fill only bytes not filled by later runs */
+    ULONG chunk_start, chunk_step;
+    struct sr *content = sr_new("", MEM_RUN_MAX + 1);
+    char *buffer = calloc(size + 1, 1);     // extra byte for 0 termination, if needed
+    char *filled = calloc(size, 1);
+    size_t remaining = size;
+    while (remaining && DAB_OK == (ret = DAB_CURSOR_FETCH(mem_cursor, &chunk_start, &chunk_step, content))) {
+        if (chunk_step < oldest) {
+            ret = DAB_NO_DATA;
+            break;
+        }
+        ULONG from = chunk_start > addr ? chunk_start : addr;
+        ULONG to = chunk_start + STRLEN(content) < addr + size ? chunk_start + STRLEN(content) : addr + size;
+        for (ULONG cur = from; cur < to; cur++) {
+            if (!filled[cur - addr] && chunk_step >= since[cur - addr]) {
+                buffer[cur - addr] = CSTR(content)[cur - chunk_start];
+                filled[cur - addr] = 1;
+                remaining--;
+            }
+        }
+    }
+    STRFREE(content);
+    free(filled);
+    free(since);
+    if (remaining && DAB_NO_DATA != ret) {
+        free(buffer);
+        return NULL;
+    }
+
+    return buffer;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   open_mem_cursor
+ *
+ *  Params:     addr - start address
+ *              size - memory size
+ *              step - program step
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Open or re-bind cursor to get memory runs, overlapping
+ *              with memory, recorded up to the step, the latest first
+ *
+ **************************************************************************/
+int open_mem_cursor(ULONG addr, size_t size, uint64_t step) {
+    /* run cannot be longer than MEM_RUN_MAX, so it is enough to look that far back */
     if (!mem_cursor) {
         if (DAB_OK != DAB_CURSOR_OPEN(&mem_cursor,
             "SELECT "
                 "address, "
+                "step_id, "
                 "content "
             "FROM "
                 "mem "
             "WHERE "
                 "step_id <= ? AND "
-                "address <= ? AND "
-                "address >= ? "
-            "GROUP BY "
-                "address "
-            "HAVING "
-                "step_id = MAX(step_id)",
+                "address < ? AND "
+                "address > ? "
+            "ORDER BY "
+                "step_id DESC",
                 step,
                 addr + size,
-                addr - MEM_SEGMENT_SIZE
+                addr - MEM_RUN_MAX
         )) {
-            return NULL;
+            return FAILURE;
         }
     } else if ( DAB_OK != DAB_CURSOR_RESET(mem_cursor) ||
-                DAB_OK != DAB_CURSOR_BIND(mem_cursor, step, addr+size, addr-MEM_SEGMENT_SIZE)) {
-        return NULL;
+                DAB_OK != DAB_CURSOR_BIND(mem_cursor, step, addr + size, addr - MEM_RUN_MAX)) {
+        return FAILURE;
     }
 
-    ULONG chunk_start;
-    struct sr *content = sr_new("", MEM_SEGMENT_SIZE + 1);
-    int ret = SUCCESS;
-    char *buffer = calloc(size + 1, 1);     // extra byte for 0 termination, if needed
-    char *cur = buffer;
-    while (DAB_OK == (ret = DAB_CURSOR_FETCH(mem_cursor, &chunk_start, content))) {
-        size_t to_copy = MEM_SEGMENT_SIZE;
-        char *from = CSTR(content);
-        if (chunk_start + MEM_SEGMENT_SIZE > addr + size) {
-            to_copy -= (chunk_start + MEM_SEGMENT_SIZE) - (addr + size);
-        }
-        if (chunk_start < addr) {
-            to_copy -= addr - chunk_start;
-            from += addr - chunk_start;
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   open_region_cursor
+ *
+ *  Params:     addr - start address
+ *              size - memory size
+ *              step - program step
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Open or re-bind cursor to get memory snapshots, overlapping
+ *              with memory, taken up to the step, the latest first
+ *
+ **************************************************************************/
+int open_region_cursor(ULONG addr, size_t size, uint64_t step) {
+    if (!region_cursor) {
+        if (DAB_OK != DAB_CURSOR_OPEN(&region_cursor,
+            "SELECT "
+                "address, "
+                "size, "
+                "step_id "
+            "FROM "
+                "region "
+            "WHERE "
+                "step_id <= ? AND "
+                "address < ? AND "
+                "address + size > ? "
+            "ORDER BY "
+                "step_id DESC",
+                step,
+                addr + size,
+                addr
+        )) {
+            return FAILURE;
         }
-        memcpy(cur, from, to_copy);
-        cur += to_copy;
-    }
-    STRFREE(content);
-    if (DAB_NO_DATA != ret) {
-        free(buffer);
-        return NULL;
+    } else if ( DAB_OK != DAB_CURSOR_RESET(region_cursor) ||
+                DAB_OK != DAB_CURSOR_BIND(region_cursor, step, addr + size, addr)) {
+        return FAILURE;
     }
 
-    return buffer;
+    return SUCCESS;
 }
 
 
@@ -1050,13 +1208,16 @@ int get_pointer_size(ULONG address, ULONG *size) {
             return MEM_RELEASED;    // memory was released, address doesn't point to allocated memory
         }
     } else {
-        /* check if memory really belongs to the process */
-        if (    DAB_OK != DAB_CURSOR_RESET(mem_cursor) ||
-                DAB_OK != DAB_CURSOR_BIND(mem_cursor, cur_step, address+MEM_SEGMENT_SIZE, address)) {
+        /* check if memory really belongs to the process - zero memory has no runs, so look for the snapshot */
+        if (SUCCESS != open_region_cursor(address, 1, cur_step)) {
             return FAILURE;
         }
-        if (DAB_NO_DATA == DAB_CURSOR_FETCH(mem_cursor)) {
+        ULONG region_start, region_size, region_step;
+        ret = DAB_CURSOR_FETCH(region_cursor, &region_start, &region_size, &region_step);
+        if (DAB_NO_DATA == ret) {
             return MEM_NOTFOUND;
+        } else if (DAB_OK != ret) {
+            return FAILURE;
         }
         *size = 0;       // address points to some valid location, but underlying var size isn't known
     }
@@ -35,6 +35,8 @@
 
 // 32 is optimal for AVX2 instruction set - requires just one instruction to compare buffers
 #define MEM_SEGMENT_SIZE    32
+// changed adjacent segments are stored as single run, up to this size, so readers know how far back to look
+#define MEM_RUN_MAX         4096
 
 #define HEAP_EVENT_ALLOC    1
 #define HEAP_EVENT_FREE     2
@@ -48,6 +50,10 @@ struct heap_event {
 
 /* function returns pointer to function with fastest implementation based on instruction set and buffer size */
 int (* best_memdiff(size_t count))(const char *, const char *, size_t);
+/* same for function that compares buffers segment by segment and sets bit in mask for every changed segment */
+void (* best_pagediff(void))(const char *, const char *, size_t, uint64_t *);
+/* same for function that hashes buffer segments, updates stored hashes and sets bit in mask for every changed segment */
+void (* best_hashdiff(void))(const char *, size_t, uint64_t *, uint64_t *);
 
 #endif
 
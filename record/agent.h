@@ -0,0 +1,87 @@
+/**************************************************************************
+ *
+ *  File:       agent.h
+ *
+ *  Project:    Flight recorder (https://github.com/qrdl/flightrec)
+ *
+ *  Descr:      Shared memory layout for in-process tracing agent
+ *
+ *  Notes:      Agent lives in fr_preload.so, it handles breakpoints
+ *              inside the tracee and passes steps to tracer via ring
+ *              buffer in shared memory
+ *
+ **************************************************************************
+ *
+ *  Copyright (C) 2017-2020 Ilya Caramishev (flightrec@qrdl.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+#ifndef _AGENT_H
+#define _AGENT_H
+
+#include <stdint.h>
+#include <stdalign.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/user.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define AGENT_SHM_PREFIX    "/fr_agent_"    // followed by tracee pid in hex, same as FIFO name
+#define AGENT_MAGIC         0x544E454741524FULL
+#define AGENT_STACK_SIZE    65536           // signal stack for agent's SIGTRAP handler
+
+/* breakpoint address to displaced instruction mapping, sorted by address */
+struct agent_slot {
+    uint64_t    address;
+    uint64_t    slot;
+};
+
+/* single step, written by agent */
+struct agent_step {
+    uint64_t                seq;        // agent's step number, starting from 1
+    uint64_t                address;    // breakpoint address
+    struct user_regs_struct regs;       // registers as reported by PTRACE_GETREGS
+};
+
+/* header of shared memory area, followed by slot table, step ring and signal stack. Agent writes 'batch' steps
+   and then waits for tracer to release it, so memory can be examined while tracee is still */
+struct agent_ring {
+    uint64_t    magic;
+    uint32_t    ready;                          // set by agent when SIGTRAP handler is installed
+    uint32_t    batch;                          // ring capacity and number of steps between syncs
+    uint64_t    slot_count;
+    uint64_t    slots_offset;                   // offsets are from the start of the header
+    uint64_t    steps_offset;
+    uint64_t    stack_offset;
+    uint64_t    seq;                            // number of steps written, updated by agent only
+    alignas(64) volatile uint32_t head;         // lower 32 bits of seq, futex for tracer to wait on
+    volatile uint32_t waiting;                  // set by tracer when it is going to sleep on head
+    alignas(64) volatile uint32_t release;      // number of batches processed by tracer, futex for agent
+    alignas(64) volatile uint32_t flush;        // set by agent when client exits or crashes, cleared by tracer
+                                                // after it has read the memory, futex for agent
+};
+
+#define AGENT_SLOTS(A)  ((struct agent_slot *)((char *)(A) + (A)->slots_offset))
+#define AGENT_STEPS(A)  ((struct agent_step *)((char *)(A) + (A)->steps_offset))
+#define AGENT_STACK(A)  ((char *)(A) + (A)->stack_offset)
+
+/* glibc doesn't provide futex wrapper. Futexes are shared between processes, so cannot be private */
+static inline long agent_futex(volatile uint32_t *addr, int op, uint32_t val, const struct timespec *timeout) {
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+#endif
+
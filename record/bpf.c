@@ -62,7 +62,8 @@ typedef int   (*three_args)(int, const char*, const char*);
     three_args:     ({ three_args tmp = (void *)&bpf_attach_tracepoint; tmp((FD),(CAT),(NAME)); }) \
 )
 
-static struct bpf_insn *get_bpf_program(int pid, int map_fd, int event_type, int payload_offset, int *size);
+static struct bpf_insn *get_bpf_program(int pid, int map_fd, int event_type, int payload_offset, int extra_offset1,
+        int extra_offset2, int *size);
 static void *bpf_poller(void *);
 #ifndef LOST_CB_ARGS
 #define LOST_CB_ARGS	unsigned long count
@@ -82,6 +83,7 @@ static pthread_t worker_thread;
  *
  *  Params:     pid - pid of program to trace
  *              callback - function to call on receipt of 
+ *              page_faults - report page faults
  *
  *  Return:     SUCCESS / FAILURE
  *
@@ -90,7 +92,7 @@ static pthread_t worker_thread;
  *              events from BPF programs
  *
  **************************************************************************/
-int bpf_start(pid_t pid, void (* callback)(void *, void *, int)) {
+int bpf_start(pid_t pid, void (* callback)(void *, void *, int), int page_faults) {
     int map_fd = bpf_create_map(
             BPF_MAP_TYPE_PERF_EVENT_ARRAY,
             "perf_map",
@@ -108,8 +110,8 @@ int bpf_start(pid_t pid, void (* callback)(void *, void *, int)) {
     struct bpf_insn *program;
     char log[4096];
 
-#define BPF_PROG_LOAD(EVT, CATEGORY, TRACEPOINT, OFFSET) do { \
-    program = get_bpf_program(pid, map_fd, EVT, OFFSET, &prog_size); \
+#define BPF_PROG_LOAD(EVT, CATEGORY, TRACEPOINT, OFFSET, EXTRA1, EXTRA2) do { \
+    program = get_bpf_program(pid, map_fd, EVT, OFFSET, EXTRA1, EXTRA2, &prog_size); \
     int fd = bpf_prog_load( \
             BPF_PROG_TYPE_TRACEPOINT, \
             TRACEPOINT, \
@@ -137,12 +139,16 @@ int bpf_start(pid_t pid, void (* callback)(void *, void *, int)) {
 } while (0)
 
     /* load BPF programs */
-    BPF_PROG_LOAD(BPF_EVT_PAGEFAULT, "exceptions", "page_fault_user", 8);
-    BPF_PROG_LOAD(BPF_EVT_MMAPENTRY, "syscalls", "sys_enter_mmap", 24);
-    BPF_PROG_LOAD(BPF_EVT_MMAPEXIT, "syscalls", "sys_exit_mmap", 16);
-    BPF_PROG_LOAD(BPF_EVT_MUNMAP, "syscalls", "sys_enter_munmap", 16);
-    BPF_PROG_LOAD(BPF_EVT_BRK, "syscalls", "sys_exit_brk", 16);
-    BPF_PROG_LOAD(BPF_EVT_SIGNAL, "signal", "signal_generate", 8);
+    if (page_faults) {
+        BPF_PROG_LOAD(BPF_EVT_PAGEFAULT, "exceptions", "page_fault_user", 8, 0, 0);
+    }
+    BPF_PROG_LOAD(BPF_EVT_MMAPENTRY, "syscalls", "sys_enter_mmap", 24, 0, 0);
+    BPF_PROG_LOAD(BPF_EVT_MMAPEXIT, "syscalls", "sys_exit_mmap", 16, 0, 0);
+    BPF_PROG_LOAD(BPF_EVT_MUNMAP, "syscalls", "sys_enter_munmap", 16, 24, 0);            // address and size
+    BPF_PROG_LOAD(BPF_EVT_MREMAPENTRY, "syscalls", "sys_enter_mremap", 16, 24, 32);     // address, old and new size
+    BPF_PROG_LOAD(BPF_EVT_MREMAPEXIT, "syscalls", "sys_exit_mremap", 16, 0, 0);
+    BPF_PROG_LOAD(BPF_EVT_BRK, "syscalls", "sys_exit_brk", 16, 0, 0);
+    BPF_PROG_LOAD(BPF_EVT_SIGNAL, "signal", "signal_generate", 8, 0, 0);
 
     /* specifying any CPU (value -1) doesn't work, so need to create a reader for every CPU */
     cpu_count = get_nprocs();
@@ -251,6 +257,9 @@ void *bpf_poller(void *unused) {
  *              event_type - on of BPF_EVT_XXX contants
  *              payload_offset - offset of 8-byte trace event element to
  *                               send as payload
+ *              extra_offset1, extra_offset2 - offsets of 8-byte trace
+ *                               event elements to send as extra data,
+ *                               0 if not needed
  *              size - where to store program szie (in bytes)
  *
  *  Return:     SUCCESS / FAILURE
@@ -258,7 +267,8 @@ void *bpf_poller(void *unused) {
  *  Descr:      Get BPF program to process specified event
  *
  **************************************************************************/
-struct bpf_insn *get_bpf_program(int pid, int map_fd, int event_type, int payload_offset, int *size) {
+struct bpf_insn *get_bpf_program(int pid, int map_fd, int event_type, int payload_offset, int extra_offset1,
+        int extra_offset2, int *size) {
     /* skeleton BPF program, values for PID, event type, map fd and payload offset must be specified */
     static struct bpf_insn prog[] = {
         /* save context */
@@ -269,21 +279,25 @@ struct bpf_insn *get_bpf_program(int pid, int map_fd, int event_type, int payloa
         BPF_LD_IMM64_RAW(BPF_REG_1, BPF_REG_0, 0xFFFFFFFF00000000),
         BPF_BITWISE32_REG(BPF_AND, BPF_REG_0, BPF_REG_1),   // r0 &= r1
         BPF_LD_IMM64_RAW(BPF_REG_1, BPF_REG_0, 0),          // r1 = pid (0 is a placeholder)
-        BPF_JMP_REG(BPF_JNE, BPF_REG_0, BPF_REG_1, 13),     // if (r1 != r0) goto exit (13 is nr of instr to skip)
+        BPF_JMP_REG(BPF_JNE, BPF_REG_0, BPF_REG_1, 17),     // if (r1 != r0) goto exit (17 is nr of instr to skip)
 
-        /* get address from event context (offset 8) and store it into the send buffer */
+        /* get payload and extra data from event context and store it into the send buffer */
         BPF_MOV64_IMM(BPF_REG_1, 0),                        // r1 = event_type (0 is a placeholder)
-        BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_1, -16),    // *(r10-16) = r1
+        BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_1, -32),    // *(r10-32) = r1
         BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_6, 0),       // r1 = *(r6+offset) (0 is a placeholder)
+        BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_1, -24),    // *(r10-24) = r1
+        BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_6, 0),       // r1 = *(r6+extra_offset1) (0 is a placeholder)
+        BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_1, -16),    // *(r10-16) = r1
+        BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_6, 0),       // r1 = *(r6+extra_offset2) (0 is a placeholder)
         BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_1, -8),     // *(r10-8) = r1
 
         /* prepare call params - context (r1), map fd (r2), key (r3), buffer address (r4), buffer size (r5) */
         BPF_LD_MAP_FD(BPF_REG_2, 0),                        // r2 = map_fd (0 is a placeholder)
         BPF_MOV64_REG(BPF_REG_4, BPF_REG_10),               // r4 = r10
-        BPF_ALU64_IMM(BPF_ADD, BPF_REG_4, -16),             // r4 -= 16
+        BPF_ALU64_IMM(BPF_ADD, BPF_REG_4, -32),             // r4 -= 32
         BPF_MOV64_REG(BPF_REG_1, BPF_REG_6),                // r1 = r6
         BPF_LD_IMM64_RAW(BPF_REG_3, BPF_REG_0, 0x00000000FFFFFFFF), // r3 = -1
-        BPF_MOV64_IMM(BPF_REG_5, 16),                        // r5 = 16
+        BPF_MOV64_IMM(BPF_REG_5, 32),                        // r5 = 32
         BPF_CALL_FUNC(BPF_FUNC_perf_event_output),
 
         /* set exitcode and exit */
@@ -294,7 +308,10 @@ struct bpf_insn *get_bpf_program(int pid, int map_fd, int event_type, int payloa
     prog[6].imm = pid;
     prog[8].imm = event_type;
     prog[10].off = payload_offset;
-    prog[12].imm = map_fd;
+    /* unused extra elements are filled with payload, offset is known to be valid */
+    prog[12].off = extra_offset1 ? extra_offset1 : payload_offset;
+    prog[14].off = extra_offset2 ? extra_offset2 : payload_offset;
+    prog[16].imm = map_fd;
     *size = sizeof(prog);
     return prog;
 }
@@ -350,7 +367,7 @@ int main(int argc, char *argv[]) {
     printf("Child PID is %d\n", pid);
 
     // do "echo 4 >/proc/<pid>/clear_refs" in parallel to force page faults
-    if (SUCCESS != bpf_start(pid, process_event)) {
+    if (SUCCESS != bpf_start(pid, process_event, 1)) {
         fprintf(stderr, "Failed\n");
         return EXIT_FAILURE;
     }
@@ -37,13 +37,16 @@
 #define BPF_EVT_MUNMAP      4
 #define BPF_EVT_BRK         5
 #define BPF_EVT_SIGNAL      6
+#define BPF_EVT_MREMAPENTRY 7
+#define BPF_EVT_MREMAPEXIT  8
 
 struct bpf_event {
     uint64_t    type;
     uint64_t    payload;
+    uint64_t    extra[2];   // more elements of trace event, for events that need them
 };
 
-int bpf_start(pid_t pid, void (* callback)(void *, void *, int));
+int bpf_start(pid_t pid, void (* callback)(void *, void *, int), int page_faults);
 void bpf_stop(void);
 
 #endif
@@ -6,10 +6,11 @@
  *
  *  Descr:      Inter-thread channels
  *
- *  Notes:      Reading from and writing to channel are synchronised so
- *              simultaneous reading and writing is possible (even from
- *              multiple readers and writers). Reading blocks until there
- *              something to read from channel
+ *  Notes:      Channel is a bounded ring of message slots with single
+ *              reader. Reader and writer don't take any locks, they only
+ *              sleep on futex when ring is empty (reader) or full
+ *              (writer). Channel with multiple writers serialises writers
+ *              with mutex, reader is still lock-free
  *
  **************************************************************************
  *
@@ -30,48 +31,71 @@
  *
  **************************************************************************/
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <limits.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
+#include "flightrec.h"
 #include "eel.h"
 #include "channel.h"
 
-struct message {
+#define CHANNEL_SLOTS   65536   // must be power of 2
+
+struct slot {
     void            *payload;
     size_t          size;
-    struct message  *next;
 };
 
+/* head and tail are free-running counters, updated by reader and writer only, and placed in different cache lines
+   to avoid false sharing. Counters are also futexes for reader and writer to sleep on */
 struct channel {
-    sem_t           sem;
-    pthread_mutex_t mutex;
-    struct message  *head;
-    struct message  *tail;
+    alignas(64) uint32_t    head;           // number of messages read
+    uint32_t                reader_waiting; // set by reader when it is going to sleep on tail
+    alignas(64) uint32_t    tail;           // number of messages written
+    uint32_t                writer_waiting; // set by writer when it is going to sleep on head
+    alignas(64) int         flags;
+    pthread_mutex_t         write_lock;     // used only by channel with multiple writers
+    struct slot             *slots;
 };
 
+static int ch_wait(uint32_t *counter, uint32_t *waiting, uint32_t value);
+static void ch_wake(uint32_t *counter, uint32_t *waiting);
+
 
 /**************************************************************************
  *
  *  Function:   ch_create
  *
- *  Params:     N/A
+ *  Params:     flags - CH_XXX flags
  *
  *  Return:     newely-created channel / NULL
  *
  *  Descr:      Create a new channel
  *
  **************************************************************************/
-struct channel *ch_create(void) {
-    struct channel *ch = malloc(sizeof(*ch));
-    ch->head = ch->tail = NULL;
-    if (0 != sem_init(&ch->sem, 0, 0)) {
+struct channel *ch_create(int flags) {
+    struct channel *ch;
+    if (posix_memalign((void **)&ch, alignof(struct channel), sizeof(*ch))) {
+        ERR("Cannot allocate memory for channel");
+        return NULL;
+    }
+    ch->head = ch->tail = 0;
+    ch->reader_waiting = ch->writer_waiting = 0;
+    ch->flags = flags;
+    /* big allocation is mmap()ed by libc, so pages of the ring are only taken when used */
+    ch->slots = malloc(CHANNEL_SLOTS * sizeof(*ch->slots));
+    if (!ch->slots) {
         free(ch);
-        ERR("Cannot initialise the semaphore: %s", strerror(errno));
+        ERR("Cannot allocate memory for channel slots");
         return NULL;
     }
-    if (0 != pthread_mutex_init(&ch->mutex, NULL)) {
-        sem_destroy(&ch->sem);
+    if ((flags & CH_MULTI_WRITER) && 0 != pthread_mutex_init(&ch->write_lock, NULL)) {
+        free(ch->slots);
         free(ch);
         ERR("Cannot initialise the mutex: %s", strerror(errno));
         return NULL;
@@ -89,41 +113,50 @@ struct channel *ch_create(void) {
  *              buf - message buffer
  *              bufsize - message size
  *
- *  Return:     CHANNEL_OK / CHANNEL_FAIL
+ *  Return:     CHANNEL_OK / CHANNEL_FAIL / CHANNEL_FULL
  *
  *  Descr:      Write to channel
  *
  *  Note:       Message is not copied, it means that writer cannot destroy
  *              the message after calling ch_write(). It is responsibility
  *              of the reader to destroy message after use!
+ *              When channel is full writer waits for reader, unless
+ *              channel is created with CH_NOWAIT - then message isn't
+ *              written and CHANNEL_FULL is returned
  *
  **************************************************************************/
 int ch_write(struct channel *ch, char *buf, size_t bufsize) {
-    if (0 != pthread_mutex_lock(&ch->mutex)) {
+    if ((ch->flags & CH_MULTI_WRITER) && 0 != pthread_mutex_lock(&ch->write_lock)) {
         ERR("Cannot lock the mutex: %s", strerror(errno));
         return CHANNEL_FAIL;
     }
-    struct message *msg = malloc(sizeof(*msg));
-    msg->payload = buf;
-    msg->size = bufsize;
-    msg->next = NULL;
-    if (ch->tail) {
-        ch->tail->next = msg;
-        ch->tail = msg;
-    } else {
-        ch->tail = ch->head = msg;
-    }
-    if (0 != pthread_mutex_unlock(&ch->mutex)) {
-        ERR("Cannot unlock the mutex: %s", strerror(errno));
-        return CHANNEL_FAIL;
+
+    int ret = CHANNEL_OK;
+    uint32_t tail = ch->tail;       // only writer changes tail
+    uint32_t head;
+    while (CHANNEL_SLOTS == tail - (head = __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE))) {
+        if (ch->flags & CH_NOWAIT) {
+            ret = CHANNEL_FULL;
+            goto unlock;
+        }
+        if (SUCCESS != ch_wait(&ch->head, &ch->writer_waiting, head)) {
+            ret = CHANNEL_FAIL;
+            goto unlock;
+        }
     }
 
-    if (sem_post(&ch->sem)) {       // signal the reader
-        ERR("Cannot increment the semaphore: %s", strerror(errno));
+    ch->slots[tail % CHANNEL_SLOTS].payload = buf;
+    ch->slots[tail % CHANNEL_SLOTS].size = bufsize;
+    __atomic_store_n(&ch->tail, tail + 1, __ATOMIC_SEQ_CST);     // must be visible before check for sleeping reader
+    ch_wake(&ch->tail, &ch->reader_waiting);
+
+unlock:
+    if ((ch->flags & CH_MULTI_WRITER) && 0 != pthread_mutex_unlock(&ch->write_lock)) {
+        ERR("Cannot unlock the mutex: %s", strerror(errno));
         return CHANNEL_FAIL;
     }
 
-    return CHANNEL_OK;
+    return ret;
 }
 
 
@@ -146,39 +179,20 @@ int ch_write(struct channel *ch, char *buf, size_t bufsize) {
  *
  **************************************************************************/
 int ch_read(struct channel *ch, char **buf, size_t *bufsize, int flag) {
-    int ret;
-    if (READ_BLOCK == flag) {
-        ret = sem_wait(&ch->sem);
-    } else {
-        ret = sem_trywait(&ch->sem);
-    }  
-    if (0 != ret) {      // wait for data
-        if (EAGAIN == errno) {
+    uint32_t head = ch->head;       // only reader changes head
+    while (head == __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE)) {
+        if (READ_BLOCK != flag) {
             return CHANNEL_NODATA;
         }
-        ERR("Cannot decrement the semaphore: %s", strerror(errno));
-        return CHANNEL_FAIL;
-    }
-
-    if (0 != pthread_mutex_lock(&ch->mutex)) {
-        ERR("Cannot lock the mutex: %s", strerror(errno));
-        return CHANNEL_FAIL;
-    }
-
-    struct message *msg = ch->head;
-
-    *buf = msg->payload;
-    size_t size = msg->size;
-    ch->head = msg->next;
-    if (!ch->head) {
-        ch->tail = NULL;
+        if (SUCCESS != ch_wait(&ch->tail, &ch->reader_waiting, head)) {
+            return CHANNEL_FAIL;
+        }
     }
-    free(msg);
 
-    if (0 != pthread_mutex_unlock(&ch->mutex)) {
-        ERR("Cannot unlock the mutex: %s", strerror(errno));
-        return CHANNEL_FAIL;
-    }
+    *buf = ch->slots[head % CHANNEL_SLOTS].payload;
+    size_t size = ch->slots[head % CHANNEL_SLOTS].size;
+    __atomic_store_n(&ch->head, head + 1, __ATOMIC_SEQ_CST);     // must be visible before check for sleeping writer
+    ch_wake(&ch->head, &ch->writer_waiting);
 
     if (!*buf) {
         *bufsize = 0;
@@ -206,7 +220,7 @@ int ch_read(struct channel *ch, char **buf, size_t *bufsize, int flag) {
  *
  *  Params:     ch - channel
  *
- *  Return:     CHANNEL_OK / CHANNEL_FAIL
+ *  Return:     CHANNEL_OK / CHANNEL_FAIL / CHANNEL_FULL
  *
  *  Descr:      signal the reader the end of communications
  *
@@ -229,13 +243,211 @@ int ch_finish(struct channel *ch) {
  *
  **************************************************************************/
 void ch_destroy(struct channel *ch) {
-    pthread_mutex_destroy(&ch->mutex);
-    sem_destroy(&ch->sem);
-    for (struct message *msg = ch->head; msg; msg = ch->head) {
-        ch->head = msg->next;
-        free(msg->payload);
-        free(msg);
+    if (ch->flags & CH_MULTI_WRITER) {
+        pthread_mutex_destroy(&ch->write_lock);
+    }
+    for (uint32_t i = ch->head; i != ch->tail; i++) {
+        free(ch->slots[i % CHANNEL_SLOTS].payload);
     }
+    free(ch->slots);
     free(ch);
 }
 
+
+/**************************************************************************
+ *
+ *  Function:   ch_wait
+ *
+ *  Params:     counter - counter, updated by other side
+ *              waiting - flag to set for other side to wake us up
+ *              value - current value of counter
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Sleep until other side changes the counter
+ *
+ *  Notes:      Flag is set before counter is re-checked, and other side
+ *              updates the counter before checking the flag, so at least
+ *              one side sees the change of the other. Futex doesn't put
+ *              thread to sleep if counter has already changed
+ *
+ **************************************************************************/
+int ch_wait(uint32_t *counter, uint32_t *waiting, uint32_t value) {
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(counter, __ATOMIC_SEQ_CST) != value) {
+        return SUCCESS;
+    }
+    if (syscall(SYS_futex, counter, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0) && EAGAIN != errno && EINTR != errno) {
+        ERR("Cannot wait on futex: %s", strerror(errno));
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   ch_wake
+ *
+ *  Params:     counter - counter, just updated by this side
+ *              waiting - flag, set by other side if it sleeps on counter
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Wake up other side if it sleeps. System call is made only
+ *              when ring is empty or full, and other side has to wait
+ *
+ **************************************************************************/
+void ch_wake(uint32_t *counter, uint32_t *waiting) {
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, counter, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+
+#ifdef UNITTEST
+/* Benchmark of ring channel against linked list, protected by mutex and semaphore. Writers send 8-byte messages, as
+   written page addresses are sent, reader reads and frees them. Build with
+   gcc -DUNITTEST -D_GNU_SOURCE -O2 -I.. channel.c -o channel_test -pthread */
+
+#include <stdio.h>
+#include <time.h>
+#include <semaphore.h>
+
+#define MESSAGES    (4 * 1024 * 1024)
+#define WRITERS     4
+
+FILE *logfd;
+
+/* channel implementation, used before ring */
+struct message {
+    void            *payload;
+    size_t          size;
+    struct message  *next;
+};
+
+struct queue {
+    sem_t           sem;
+    pthread_mutex_t mutex;
+    struct message  *head;
+    struct message  *tail;
+};
+
+static void queue_write(struct queue *q, char *buf, size_t bufsize) {
+    pthread_mutex_lock(&q->mutex);
+    struct message *msg = malloc(sizeof(*msg));
+    msg->payload = buf;
+    msg->size = bufsize;
+    msg->next = NULL;
+    if (q->tail) {
+        q->tail->next = msg;
+        q->tail = msg;
+    } else {
+        q->tail = q->head = msg;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    sem_post(&q->sem);
+}
+
+static char *queue_read(struct queue *q) {
+    while (sem_wait(&q->sem));
+    pthread_mutex_lock(&q->mutex);
+    struct message *msg = q->head;
+    char *buf = msg->payload;
+    q->head = msg->next;
+    if (!q->head) {
+        q->tail = NULL;
+    }
+    free(msg);
+    pthread_mutex_unlock(&q->mutex);
+    return buf;
+}
+
+struct writer {
+    struct channel  *ch;
+    struct queue    *q;
+    uint64_t        count;
+};
+
+static void *write_messages(void *arg) {
+    struct writer *w = arg;
+    for (uint64_t i = 0; i < w->count; i++) {
+        uint64_t *msg = malloc(sizeof(*msg));
+        *msg = i;
+        if (w->ch) {
+            ch_write(w->ch, (char *)msg, sizeof(*msg));
+        } else {
+            queue_write(w->q, (char *)msg, sizeof(*msg));
+        }
+    }
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* returns millions of messages per second */
+static double run(int ring, int writers) {
+    struct channel *ch = NULL;
+    struct queue q = { .head = NULL, .tail = NULL };
+    if (ring) {
+        ch = ch_create(writers > 1 ? CH_MULTI_WRITER : CH_SINGLE_WRITER);
+    } else {
+        sem_init(&q.sem, 0, 0);
+        pthread_mutex_init(&q.mutex, NULL);
+    }
+
+    struct writer w = { .ch = ch, .q = &q, .count = MESSAGES / writers };
+    pthread_t threads[WRITERS];
+    double start = now();
+    for (int i = 0; i < writers; i++) {
+        pthread_create(threads + i, NULL, write_messages, &w);
+    }
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < w.count * writers; i++) {
+        uint64_t *msg;
+        if (ring) {
+            size_t size = sizeof(*msg);
+            ch_read(ch, (char **)&msg, &size, READ_BLOCK);
+        } else {
+            msg = (uint64_t *)queue_read(&q);
+        }
+        sum += *msg;
+        free(msg);
+    }
+    double elapsed = now() - start;
+    for (int i = 0; i < writers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (sum != writers * w.count * (w.count - 1) / 2) {
+        printf("Messages are lost or corrupted\n");
+        exit(EXIT_FAILURE);
+    }
+    if (ring) {
+        ch_destroy(ch);
+    } else {
+        sem_destroy(&q.sem);
+        pthread_mutex_destroy(&q.mutex);
+    }
+
+    return MESSAGES / elapsed / 1000000;
+}
+
+int main(void) {
+    logfd = stderr;
+
+    printf("%d messages\n", MESSAGES);
+    for (int writers = 1; writers <= WRITERS; writers *= WRITERS) {
+        double queue = run(0, writers);
+        double ring = run(1, writers);
+        printf("%d writer(s): mutex queue %.1f M/s, ring %.1f M/s, %.1fx\n", writers, queue, ring, ring / queue);
+    }
+
+    return EXIT_SUCCESS;
+}
+#endif
@@ -6,7 +6,9 @@
  *
  *  Descr:      Inter-thread channels
  *
- *  Notes:
+ *  Notes:      Channels are bounded rings with single reader. Writers
+ *              are serialised only if channel is created for multiple
+ *              writers
  *
  **************************************************************************
  *
@@ -36,13 +38,19 @@
 #define CHANNEL_MISREAD 3
 #define CHANNEL_END     4
 #define CHANNEL_NODATA  5
+#define CHANNEL_FULL    6
 
 #define READ_NONBLOCK   0
 #define READ_BLOCK      1
 
+/* channel flags */
+#define CH_SINGLE_WRITER    0x00
+#define CH_MULTI_WRITER     0x01    // channel is written by several threads
+#define CH_NOWAIT           0x02    // writer doesn't wait for reader when channel is full, gets CHANNEL_FULL
+
 struct channel;
 
-struct channel *ch_create(void);
+struct channel *ch_create(int flags);
 int ch_write(struct channel *ch, char *buf, size_t bufsize);
 int ch_read(struct channel *ch, char **buf, size_t *bufsize, int flag);
 int ch_finish(struct channel *ch);
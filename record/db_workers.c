@@ -40,6 +40,7 @@
 #include "dab.h"
 
 #include "flightrec.h"
+#include "regs.h"
 #include "record.h"
 #include "channel.h"
 #include "db_workers.h"
@@ -50,6 +51,16 @@
 
 extern char *db_name;
 
+/* register deltas are calculated for each client thread separately */
+struct thread_regs {
+    ULONG                       thread_id;
+    ULONG                       since_full;     // steps since the last full register set
+    struct user_regs_struct     prev;
+};
+
+static int prune(void *cursor, ULONG *pruned);
+static struct thread_regs *get_thread_regs(struct thread_regs **list, size_t *count, ULONG thread_id);
+
 
 /**************************************************************************
  *
@@ -64,7 +75,7 @@ extern char *db_name;
  **************************************************************************/
 void *wrk_insert_step(void *arg) {
     struct channel *ch = (struct channel *)arg;
-    void *insert;
+    void *insert, *delete;
     size_t counter = 0;
 
     if (DAB_OK != DAB_OPEN(db_name, DAB_FLAG_CREATE)) {
@@ -78,11 +89,12 @@ void *wrk_insert_step(void *arg) {
     }
 
     if (DAB_OK != DAB_EXEC("CREATE TABLE step ("
-                                "id             INTEGER PRIMARY KEY AUTOINCREMENT, "
+                                "id             INTEGER PRIMARY KEY AUTOINCREMENT, "   // global order of steps
+                                "thread_id      INTEGER NOT NULL, "    // ref thread.id
                                 "address        INTEGER NOT NULL, "
                                 "depth          INTEGER, "
                                 "function_id    INTEGER, "     // ref function.id
-                                "regs           BLOB"
+                                "regs           BLOB"      // full register set or delta, see regs.h
                             ")")) {
         return NULL;
     }
@@ -90,8 +102,16 @@ void *wrk_insert_step(void *arg) {
     /* file_id and line are filled later, from address */
     if (DAB_OK != DAB_CURSOR_PREPARE(&insert, "INSERT "
                     "INTO step "
-                    "(id, address, depth, function_id, regs) VALUES "
-                    "(?,  ?,       ?,     ?,           ?)")) {
+                    "(id, thread_id, address, depth, function_id, regs) VALUES "
+                    "(?,  ?,         ?,       ?,     ?,           ?)")) {
+        return NULL;
+    }
+    /* in black box mode steps before the oldest needed keyframe are dropped */
+    ULONG pruned = 0;
+    if (DAB_OK != DAB_CURSOR_PREPARE(&delete, "DELETE "
+                    "FROM step "
+                    "WHERE "
+                        "id < ?")) {
         return NULL;
     }
 
@@ -101,16 +121,36 @@ void *wrk_insert_step(void *arg) {
         return NULL;
     }
     struct sr registers;
+    struct regs_delta delta;
+    size_t delta_size;
+    struct thread_regs *threads = NULL;
+    size_t thread_count = 0;
     while (CHANNEL_OK == ch_read(ch, (char **)&msg, &size, READ_BLOCK)) {
         if (DAB_OK != DAB_CURSOR_RESET(insert)) {
             DAB_ROLLBACK;
             return NULL;
         }
+        if (msg->keyframe) {
+            /* history before keyframe may be dropped, so every thread needs full register set after it */
+            for (size_t i = 0; i < thread_count; i++) {
+                threads[i].since_full = REGS_KEYFRAME_FREQ;
+            }
+        }
+        struct thread_regs *thread = get_thread_regs(&threads, &thread_count, msg->thread_id);
         /* manualy assemble Stingray string to be used as BLOB */
-        registers.val = (char *)&msg->regs;
-        registers.size = registers.len = sizeof(msg->regs);
+        if (++thread->since_full >= REGS_KEYFRAME_FREQ ||
+                !(delta_size = regs_encode(&thread->prev, &msg->regs, &delta))) {
+            registers.val = (char *)&msg->regs;
+            registers.size = registers.len = sizeof(msg->regs);
+            thread->since_full = 0;
+        } else {
+            registers.val = (char *)&delta;
+            registers.size = registers.len = delta_size;
+        }
+        thread->prev = msg->regs;
         if (DAB_OK != DAB_CURSOR_BIND(insert,
                 msg->step_id,
+                msg->thread_id,
                 msg->address,
                 msg->depth,
                 msg->func_id,
@@ -125,6 +165,10 @@ void *wrk_insert_step(void *arg) {
         free(msg);
         counter++;
         if (counter >= COMMIT_FREQ) {
+            if (SUCCESS != prune(delete, &pruned)) {
+                DAB_ROLLBACK;
+                return NULL;
+            }
             if (DAB_OK != DAB_COMMIT) {
                 DAB_ROLLBACK;
                 return NULL;
@@ -135,11 +179,22 @@ void *wrk_insert_step(void *arg) {
             counter = 0;
         }
     }
+    if (SUCCESS != prune(delete, &pruned)) {
+        DAB_ROLLBACK;
+        return NULL;
+    }
     if (DAB_OK != DAB_COMMIT) {
         DAB_ROLLBACK;
         return NULL;
     }
     DAB_CURSOR_FREE(insert);
+    DAB_CURSOR_FREE(delete);
+    free(threads);
+
+    /* Examine moves within the thread */
+    if (DAB_OK != DAB_EXEC("CREATE INDEX step_thread ON step (thread_id, id)")) {
+        return NULL;
+    }
 
     DAB_CLOSE(DAB_FLAG_NONE);
 
@@ -147,6 +202,42 @@ void *wrk_insert_step(void *arg) {
 }
 
 
+/**************************************************************************
+ *
+ *  Function:   get_thread_regs
+ *
+ *  Params:     list - list of threads, can be reallocated
+ *              count - number of threads in the list
+ *              thread_id - thread to find
+ *
+ *  Return:     register state of the thread
+ *
+ *  Descr:      Find register state of the thread, add new thread to the
+ *              list if needed
+ *
+ **************************************************************************/
+struct thread_regs *get_thread_regs(struct thread_regs **list, size_t *count, ULONG thread_id) {
+    static size_t last = 0;     // steps of the same thread usually come in a row
+    if (last < *count && (*list)[last].thread_id == thread_id) {
+        return *list + last;
+    }
+    for (last = 0; last < *count; last++) {
+        if ((*list)[last].thread_id == thread_id) {
+            return *list + last;
+        }
+    }
+
+    if (!(*count % 16)) {
+        *list = realloc(*list, sizeof(**list) * (*count + 16));
+    }
+    struct thread_regs *thread = *list + (*count)++;
+    thread->thread_id = thread_id;
+    thread->since_full = REGS_KEYFRAME_FREQ;   // first step gets full register set
+
+    return thread;
+}
+
+
 /**************************************************************************
  *
  *  Function:   wrk_insert_heap
@@ -160,7 +251,7 @@ void *wrk_insert_step(void *arg) {
  **************************************************************************/
 void *wrk_insert_heap(void *arg) {
     struct channel *ch = (struct channel *)arg;
-    void *insert, *update;
+    void *insert, *update, *delete;
     size_t counter = 0;
 
     char *local_db_name = malloc(strlen(db_name) + sizeof("_heap"));
@@ -205,6 +296,15 @@ void *wrk_insert_heap(void *arg) {
                 "freed_at = 0")) {
         return NULL;
     }
+    /* in black box mode chunks freed before the oldest needed keyframe are dropped */
+    ULONG pruned = 0;
+    if (DAB_OK != DAB_CURSOR_PREPARE(&delete, "DELETE "
+            "FROM heap "
+            "WHERE "
+                "freed_at > 0 AND "
+                "freed_at < ?")) {
+        return NULL;
+    }
 
     struct insert_heap_msg *msg;
     size_t size = sizeof(*msg);     // specify expected payload size
@@ -245,6 +345,10 @@ void *wrk_insert_heap(void *arg) {
         free(msg);
         counter++;
         if (counter >= COMMIT_FREQ) {
+            if (SUCCESS != prune(delete, &pruned)) {
+                DAB_ROLLBACK;
+                return NULL;
+            }
             if (DAB_OK != DAB_COMMIT) {
                 DAB_ROLLBACK;
                 return NULL;
@@ -255,6 +359,10 @@ void *wrk_insert_heap(void *arg) {
             counter = 0;
         }
     }
+    if (SUCCESS != prune(delete, &pruned)) {
+        DAB_ROLLBACK;
+        return NULL;
+    }
     if (DAB_OK != DAB_COMMIT) {
         DAB_ROLLBACK;
         return NULL;
@@ -262,6 +370,7 @@ void *wrk_insert_heap(void *arg) {
 
     DAB_CURSOR_FREE(insert);
     DAB_CURSOR_FREE(update);
+    DAB_CURSOR_FREE(delete);
 
     char tmp[256];
     sprintf(tmp, "ATTACH '%s' AS fr", db_name);
@@ -294,7 +403,7 @@ void *wrk_insert_heap(void *arg) {
  **************************************************************************/
 void *wrk_insert_mem(void *arg) {
     struct channel *ch = (struct channel *)arg;
-    void *insert;
+    void *insert, *delete, *insert_region, *delete_region;
     size_t counter = 0;
 
     char *local_db_name = malloc(strlen(db_name) + sizeof("_mem"));
@@ -322,6 +431,15 @@ void *wrk_insert_mem(void *arg) {
                             ")")) {
         return NULL;
     }
+    /* region snapshot hides older content of its memory, memory of the region that isn't stored with the same
+       or later step is zero */
+    if (DAB_OK != DAB_EXEC("CREATE TABLE region ("
+                                "address        INTEGER NOT NULL, "
+                                "size           INTEGER NOT NULL, "
+                                "step_id        INTEGER NOT NULL "     // ref step.id
+                            ")")) {
+        return NULL;
+    }
 
     if (DAB_OK != DAB_CURSOR_PREPARE(&insert, "INSERT "
             "INTO mem "
@@ -329,21 +447,62 @@ void *wrk_insert_mem(void *arg) {
             "(?,       ?,       ?)")) {
         return NULL ;
     }
+    if (DAB_OK != DAB_CURSOR_PREPARE(&insert_region, "INSERT "
+            "INTO region "
+            "(address, size, step_id) VALUES "
+            "(?,       ?,    ?)")) {
+        return NULL ;
+    }
+    /* in black box mode changes before the oldest needed keyframe are dropped */
+    ULONG pruned = 0;
+    if (DAB_OK != DAB_CURSOR_PREPARE(&delete, "DELETE "
+            "FROM mem "
+            "WHERE "
+                "step_id < ?")) {
+        return NULL;
+    }
+    ULONG pruned_regions = 0;
+    if (DAB_OK != DAB_CURSOR_PREPARE(&delete_region, "DELETE "
+            "FROM region "
+            "WHERE "
+                "step_id < ?")) {
+        return NULL;
+    }
 
     struct insert_mem_msg *msg;
-    size_t size = sizeof(*msg);     // specify expected payload size
+    size_t size = 0;                // messages are variable size
     if (DAB_OK != DAB_BEGIN) {
         return NULL;
     }
     struct sr content;
     while (CHANNEL_OK == ch_read(ch, (char **)&msg, &size, READ_BLOCK)) {
+        size = 0;
+        if (msg->region) {
+            if (DAB_OK != DAB_CURSOR_RESET(insert_region)) {
+                DAB_ROLLBACK;
+                return NULL;
+            }
+            if (DAB_OK != DAB_CURSOR_BIND(insert_region,
+                    msg->address,
+                    msg->size,
+                    msg->step_id)) {
+                DAB_ROLLBACK;
+                return NULL;
+            }
+            if (DAB_NO_DATA != DAB_CURSOR_FETCH(insert_region)) {
+                DAB_ROLLBACK;
+                return NULL;
+            }
+            free(msg);
+            continue;
+        }
         if (DAB_OK != DAB_CURSOR_RESET(insert)) {
             DAB_ROLLBACK;
             return NULL;
         }
         /* manualy assemble Stingray string to be used as BLOB */
         content.val = msg->content;
-        content.size = content.len = sizeof(msg->content);
+        content.size = content.len = msg->size;
         if (DAB_OK != DAB_CURSOR_BIND(insert,
                 msg->address,
                 msg->step_id,
@@ -358,6 +517,10 @@ void *wrk_insert_mem(void *arg) {
         free(msg);
         counter++;
         if (counter >= COMMIT_FREQ) {
+            if (SUCCESS != prune(delete, &pruned) || SUCCESS != prune(delete_region, &pruned_regions)) {
+                DAB_ROLLBACK;
+                return NULL;
+            }
             if (DAB_OK != DAB_COMMIT) {
                 DAB_ROLLBACK;
                 return NULL;
@@ -368,25 +531,46 @@ void *wrk_insert_mem(void *arg) {
             counter = 0;
         }
     }
+    if (SUCCESS != prune(delete, &pruned) || SUCCESS != prune(delete_region, &pruned_regions)) {
+        DAB_ROLLBACK;
+        return NULL;
+    }
     if (DAB_OK != DAB_COMMIT) {
         DAB_ROLLBACK;
         return NULL;
     }
 
     DAB_CURSOR_FREE(insert);
+    DAB_CURSOR_FREE(delete);
+    DAB_CURSOR_FREE(insert_region);
+    DAB_CURSOR_FREE(delete_region);
 
     char tmp[256];
     sprintf(tmp, "ATTACH '%s' AS fr", db_name);
     if (DAB_OK != DAB_EXEC(tmp)) {
         return NULL;
     }
-    if (DAB_OK != DAB_EXEC("CREATE TABLE fr.mem AS SELECT * FROM main.mem")) {
+    if (window_steps || window_bytes) {
+        /* keyframe may duplicate change stored for the same step, keep the latest record */
+        if (DAB_OK != DAB_EXEC("CREATE TABLE fr.mem AS "
+                "SELECT address, step_id, content FROM main.mem WHERE rowid IN ("
+                    "SELECT MAX(rowid) FROM main.mem GROUP BY address, step_id)")) {
+            return NULL;
+        }
+    } else if (DAB_OK != DAB_EXEC("CREATE TABLE fr.mem AS SELECT * FROM main.mem")) {
         return NULL;
     }
     if (DAB_OK != DAB_EXEC("CREATE UNIQUE INDEX fr.mem_by_address_and_step ON mem ("
                                 "address, step_id)")) {
         return NULL;
     }
+    /* keyframe may snapshot region, created at the same step */
+    if (DAB_OK != DAB_EXEC("CREATE TABLE fr.region AS SELECT DISTINCT * FROM main.region")) {
+        return NULL;
+    }
+    if (DAB_OK != DAB_EXEC("CREATE INDEX fr.region_by_address ON region (address, step_id)")) {
+        return NULL;
+    }
 
     DAB_CLOSE(DAB_FLAG_NONE);
     if (remove(local_db_name)) {
@@ -396,3 +580,33 @@ void *wrk_insert_mem(void *arg) {
     return (void*)1;    // non-NULL means success
 }
 
+
+/**************************************************************************
+ *
+ *  Function:   prune
+ *
+ *  Params:     cursor - prepared DELETE statement with single parameter
+ *              pruned - step the records were pruned before last time
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Delete records that are older than the black box window
+ *              if window has moved since last call
+ *
+ **************************************************************************/
+int prune(void *cursor, ULONG *pruned) {
+    ULONG before = __atomic_load_n(&prune_before, __ATOMIC_RELAXED);
+    if (before <= *pruned) {
+        return SUCCESS;
+    }
+    if (DAB_OK != DAB_CURSOR_RESET(cursor) || DAB_OK != DAB_CURSOR_BIND(cursor, before)) {
+        return FAILURE;
+    }
+    if (DAB_NO_DATA != DAB_CURSOR_FETCH(cursor)) {
+        return FAILURE;
+    }
+    *pruned = before;
+
+    return SUCCESS;
+}
+
@@ -33,11 +33,11 @@
 
 #include "flightrec.h"
 #include "stingray.h"
-#include "mem.h"        // for MEM_SEGMENT_SIZE
+#include "mem.h"        // for MEM_RUN_MAX
 
 // cannot wrap into do {...} while(0) because have to declare some variables
-#define START_DB_WORKER(A) \
-        insert_ ## A ## _ch = ch_create(); \
+#define START_DB_WORKER(A, F) \
+        insert_ ## A ## _ch = ch_create(F); \
         if (!insert_ ## A ## _ch) { \
             return FAILURE; \
         } \
@@ -64,10 +64,12 @@
 
 struct insert_step_msg {
     ULONG                       step_id;
+    ULONG                       thread_id;
     ULONG                       depth;
     ULONG                       func_id;
     ULONG                       address;
     struct user_regs_struct     regs;
+    int                         keyframe;   // store full register set
 };
 
 struct insert_heap_msg {
@@ -76,10 +78,13 @@ struct insert_heap_msg {
     ULONG   size;
 };
 
+/* run of changed memory segments, variable size */
 struct insert_mem_msg {
     ULONG   step_id;
     ULONG   address;
-    char    content[MEM_SEGMENT_SIZE];
+    ULONG   size;           // content size, multiple of MEM_SEGMENT_SIZE, up to MEM_RUN_MAX
+    int     region;         // 1 - memory [address, address+size) has been snapshotted, no content follows
+    char    content[];
 };
 
 void *wrk_insert_step(void *arg);
@@ -87,5 +92,7 @@ void *wrk_insert_heap(void *arg);
 void *wrk_insert_mem(void *arg);
 
 extern struct channel *insert_mem_ch;      // defined in run.c
+extern uint64_t recorded_bytes;            // defined in run.c
+extern uint64_t prune_before;              // defined in run.c
 
 #endif
@@ -0,0 +1,857 @@
+/**************************************************************************
+ *
+ *  File:       decoder.c
+ *
+ *  Project:    Flight recorder (https://github.com/qrdl/flightrec)
+ *
+ *  Descr:      x86-64 instruction decoder
+ *
+ *  Notes:      Decoder finds instruction boundaries and locations of
+ *              instruction parts (ModRM, displacement, immediate), it
+ *              doesn't try to validate the instruction. It covers integer,
+ *              x87, SSE and VEX-encoded instructions, EVEX-encoded
+ *              instructions aren't supported. Effects of instruction
+ *              (written memory operand and changed registers) are known
+ *              for general purpose, x87 and SSE/AVX instructions that
+ *              compilers use in user code. See Intel SDM vol. 2,
+ *              appendix A for opcode maps
+ *
+ **************************************************************************
+ *
+ *  Copyright (C) 2017-2020 Ilya Caramishev (flightrec@qrdl.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+#include <string.h>
+
+#include "flightrec.h"
+#include "decoder.h"
+
+/* opcode attributes */
+#define N       0x0000      // no operands encoded after opcode
+#define M       0x0001      // ModRM follows
+#define I8      0x0002      // 8-bit immediate
+#define I16     0x0004      // 16-bit immediate
+#define IZ      0x0008      // 16- or 32-bit immediate, depending on operand size
+#define IV      0x0010      // 16-, 32- or 64-bit immediate, depending on operand size
+#define MO      0x0020      // memory offset, size depends on address size
+#define R8      0x0040      // 8-bit relative branch target
+#define R32     0x0080      // 32-bit relative branch target
+#define CC      0x0100      // conditional branch
+#define CL      0x0200      // call
+#define G3      0x0400      // group 3 (TEST has immediate, others don't)
+#define EN      0x0800      // ENTER - 16-bit and 8-bit immediates
+#define VX      0x1000      // VEX prefix
+#define X       0x8000      // invalid in 64-bit mode, prefix or escape (processed separately)
+
+static const uint16_t primary_map[256] = {
+/*        0       1       2       3       4       5       6       7       8       9       A       B       C       D       E       F */
+/* 0 */   M,      M,      M,      M,      I8,     IZ,     X,      X,      M,      M,      M,      M,      I8,     IZ,     X,      X,
+/* 1 */   M,      M,      M,      M,      I8,     IZ,     X,      X,      M,      M,      M,      M,      I8,     IZ,     X,      X,
+/* 2 */   M,      M,      M,      M,      I8,     IZ,     X,      X,      M,      M,      M,      M,      I8,     IZ,     X,      X,
+/* 3 */   M,      M,      M,      M,      I8,     IZ,     X,      X,      M,      M,      M,      M,      I8,     IZ,     X,      X,
+/* 4 */   X,      X,      X,      X,      X,      X,      X,      X,      X,      X,      X,      X,      X,      X,      X,      X,
+/* 5 */   N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      N,
+/* 6 */   X,      X,      X,      M,      X,      X,      X,      X,      IZ,     M|IZ,   I8,     M|I8,   N,      N,      N,      N,
+/* 7 */   R8|CC,  R8|CC,  R8|CC,  R8|CC,  R8|CC,  R8|CC,  R8|CC,  R8|CC,  R8|CC,  R8|CC,  R8|CC,  R8|CC,  R8|CC,  R8|CC,  R8|CC,  R8|CC,
+/* 8 */   M|I8,   M|IZ,   X,      M|I8,   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+/* 9 */   N,      N,      N,      N,      N,      N,      N,      N,      N,      N,      X,      N,      N,      N,      N,      N,
+/* A */   MO,     MO,     MO,     MO,     N,      N,      N,      N,      I8,     IZ,     N,      N,      N,      N,      N,      N,
+/* B */   I8,     I8,     I8,     I8,     I8,     I8,     I8,     I8,     IV,     IV,     IV,     IV,     IV,     IV,     IV,     IV,
+/* C */   M|I8,   M|I8,   I16,    N,      VX,     VX,     M|I8,   M|IZ,   EN,     N,      I16,    N,      N,      I8,     X,      N,
+/* D */   M,      M,      M,      M,      X,      X,      X,      N,      M,      M,      M,      M,      M,      M,      M,      M,
+/* E */   R8|CC,  R8|CC,  R8|CC,  R8|CC,  I8,     I8,     I8,     I8,     R32|CL, R32,    X,      R8,     N,      N,      N,      N,
+/* F */   X,      N,      X,      X,      N,      N,      M|G3,   M|G3,   N,      N,      N,      N,      N,      N,      M,      M
+};
+
+static const uint16_t map_0f[256] = {
+/*        0       1       2       3       4       5       6       7       8       9       A       B       C       D       E       F */
+/* 0 */   M,      M,      M,      M,      X,      N,      N,      N,      N,      N,      X,      N,      X,      M,      N,      M|I8,
+/* 1 */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+/* 2 */   M,      M,      M,      M,      X,      X,      X,      X,      M,      M,      M,      M,      M,      M,      M,      M,
+/* 3 */   N,      N,      N,      N,      N,      N,      X,      N,      X,      X,      X,      X,      X,      X,      X,      X,
+/* 4 */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+/* 5 */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+/* 6 */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+/* 7 */   M|I8,   M|I8,   M|I8,   M|I8,   M,      M,      M,      N,      M,      M,      X,      X,      M,      M,      M,      M,
+/* 8 */   R32|CC, R32|CC, R32|CC, R32|CC, R32|CC, R32|CC, R32|CC, R32|CC, R32|CC, R32|CC, R32|CC, R32|CC, R32|CC, R32|CC, R32|CC, R32|CC,
+/* 9 */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+/* A */   N,      N,      N,      M,      M|I8,   M,      X,      X,      N,      N,      N,      M,      M|I8,   M,      M,      M,
+/* B */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M|I8,   M,      M,      M,      M,      M,
+/* C */   M,      M,      M|I8,   M,      M|I8,   M|I8,   M|I8,   M,      N,      N,      N,      N,      N,      N,      N,      N,
+/* D */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+/* E */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,
+/* F */   M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M,      M
+};
+
+static int64_t read_signed(const uint8_t *code, int size);
+static int primary_effects(const struct x86_instr *instr, int mem, uint16_t *clobbers);
+static int map_0f_effects(const struct x86_instr *instr, int mem, uint16_t *clobbers);
+static int escape_effects(const struct x86_instr *instr, int mem, uint16_t *clobbers);
+static int opcode_extension(const struct x86_instr *instr);
+static int operand_size(const struct x86_instr *instr);
+static int vector_size(const struct x86_instr *instr);
+
+
+/**************************************************************************
+ *
+ *  Function:   x86_decode
+ *
+ *  Params:     code - instruction bytes
+ *              size - number of available bytes
+ *              instr - where to store decoded instruction
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Decode single x86-64 instruction
+ *
+ **************************************************************************/
+int x86_decode(const uint8_t *code, size_t size, struct x86_instr *instr) {
+    size_t pos = 0;
+
+    memset(instr, 0, sizeof(*instr));
+    if (size > X86_MAX_INSTR_LEN) {
+        size = X86_MAX_INSTR_LEN;
+    }
+
+    /* legacy prefixes */
+    for (; pos < size; pos++) {
+        switch (code[pos]) {
+            case 0xF0:
+                instr->flags |= X86_FLAG_LOCK;
+                continue;
+            case 0xF2:
+                instr->flags |= X86_FLAG_REPNE;
+                continue;
+            case 0xF3:
+                instr->flags |= X86_FLAG_REP;
+                continue;
+            case 0x66:
+                instr->flags |= X86_FLAG_OPSIZE;
+                continue;
+            case 0x67:
+                instr->flags |= X86_FLAG_ADSIZE;
+                continue;
+            case 0x64:
+            case 0x65:
+                instr->flags |= X86_FLAG_SEGMENT;
+                continue;
+            case 0x26:
+            case 0x2E:
+            case 0x36:
+            case 0x3E:
+                continue;   // segment overrides are ignored in 64-bit mode
+        }
+        break;
+    }
+    /* REX prefix must immediately precede the opcode */
+    if (pos < size && 0x40 == (code[pos] & 0xF0)) {
+        instr->rex = code[pos++];
+    }
+    instr->prefix_len = pos;
+    if (pos >= size) {
+        return FAILURE;
+    }
+
+    uint16_t attrs;
+    if (0x0F == code[pos]) {
+        if (++pos >= size) {
+            return FAILURE;
+        }
+        if (0x38 == code[pos]) {
+            instr->map = X86_MAP_0F38;
+            pos++;
+        } else if (0x3A == code[pos]) {
+            instr->map = X86_MAP_0F3A;
+            pos++;
+        } else {
+            instr->map = X86_MAP_0F;
+        }
+    } else if (VX == primary_map[code[pos]]) {
+        /* VEX prefix, in 64-bit mode C4 and C5 are always VEX, REX bits are stored inverted */
+        instr->flags |= X86_FLAG_VEX;
+        uint8_t last;   // last VEX byte has vector length and implied prefix
+        if (0xC5 == code[pos]) {
+            if (pos + 1 >= size) {
+                return FAILURE;
+            }
+            last = code[pos + 1];
+            instr->rex = 0x40 | (last & 0x80 ? 0 : X86_REX_R);
+            instr->map = X86_MAP_0F;
+            pos += 2;
+        } else {
+            if (pos + 2 >= size) {
+                return FAILURE;
+            }
+            uint8_t byte1 = code[pos + 1];
+            last = code[pos + 2];
+            instr->rex = 0x40 |
+                    (byte1 & 0x80 ? 0 : X86_REX_R) |
+                    (byte1 & 0x40 ? 0 : X86_REX_X) |
+                    (byte1 & 0x20 ? 0 : X86_REX_B) |
+                    (last & 0x80 ? X86_REX_W : 0);
+            instr->map = byte1 & 0x1F;
+            if (instr->map < X86_MAP_0F || instr->map > X86_MAP_0F3A) {
+                return FAILURE;
+            }
+            pos += 3;
+        }
+        if (last & 0x04) {
+            instr->flags |= X86_FLAG_VEX_L;
+        }
+        static const uint16_t implied[4] = {0, X86_FLAG_OPSIZE, X86_FLAG_REP, X86_FLAG_REPNE};
+        instr->flags |= implied[last & 0x03];
+    }
+    if (pos >= size) {
+        return FAILURE;
+    }
+    instr->opcode = code[pos];
+    instr->opcode_offset = pos++;
+
+    switch (instr->map) {
+        case X86_MAP_PRIMARY:
+            attrs = primary_map[instr->opcode];
+            break;
+        case X86_MAP_0F:
+            attrs = map_0f[instr->opcode];
+            break;
+        case X86_MAP_0F38:
+            attrs = M;
+            break;
+        default:
+            attrs = M | I8;
+    }
+    if (attrs & X) {
+        return FAILURE;     // invalid opcode, EVEX or unexpected prefix
+    }
+
+    /* ModRM, SIB and displacement */
+    if (attrs & M) {
+        if (pos >= size) {
+            return FAILURE;
+        }
+        instr->flags |= X86_FLAG_MODRM;
+        instr->modrm = code[pos++];
+        int mod = instr->modrm >> 6;
+        int rm = instr->modrm & 7;
+        if (3 != mod) {
+            if (4 == rm) {
+                if (pos >= size) {
+                    return FAILURE;
+                }
+                instr->sib = code[pos++];
+                if (0 == mod && 5 == (instr->sib & 7)) {
+                    instr->disp_size = 4;   // no base, disp32 only
+                }
+            } else if (0 == mod && 5 == rm) {
+                instr->disp_size = 4;
+                instr->flags |= X86_FLAG_RIPREL;
+            }
+            if (1 == mod) {
+                instr->disp_size = 1;
+            } else if (2 == mod) {
+                instr->disp_size = 4;
+            }
+            if (instr->disp_size) {
+                instr->disp_offset = pos;
+                pos += instr->disp_size;
+            }
+        }
+        if (attrs & G3) {
+            /* only TEST (/0 and /1) has an immediate operand */
+            if (((instr->modrm >> 3) & 7) < 2) {
+                attrs |= 0xF6 == instr->opcode ? I8 : IZ;
+            }
+        }
+    }
+
+    /* immediate or relative branch target */
+    if (attrs & (I8 | R8)) {
+        instr->imm_size = 1;
+    } else if (attrs & I16) {
+        instr->imm_size = 2;
+    } else if (attrs & EN) {
+        instr->imm_size = 3;
+    } else if (attrs & IZ) {
+        instr->imm_size = (instr->flags & X86_FLAG_OPSIZE) && !(instr->rex & X86_REX_W) ? 2 : 4;
+    } else if (attrs & IV) {
+        if (instr->rex & X86_REX_W) {
+            instr->imm_size = 8;
+        } else {
+            instr->imm_size = instr->flags & X86_FLAG_OPSIZE ? 2 : 4;
+        }
+    } else if (attrs & MO) {
+        instr->imm_size = instr->flags & X86_FLAG_ADSIZE ? 4 : 8;
+    } else if (attrs & R32) {
+        instr->imm_size = 4;
+    }
+    if (instr->imm_size) {
+        instr->imm_offset = pos;
+        pos += instr->imm_size;
+    }
+    if (attrs & (R8 | R32)) {
+        instr->flags |= X86_FLAG_BRANCH;
+    }
+    if (attrs & CC) {
+        instr->flags |= X86_FLAG_COND;
+    }
+    if (attrs & CL) {
+        instr->flags |= X86_FLAG_CALL;
+    }
+
+    if (pos > size) {
+        return FAILURE;     // instruction is longer than available bytes
+    }
+    instr->length = pos;
+    if (instr->disp_size) {
+        instr->disp = read_signed(code + instr->disp_offset, instr->disp_size);
+    }
+    if (instr->imm_size && 3 != instr->imm_size) {
+        instr->imm = read_signed(code + instr->imm_offset, instr->imm_size);
+    }
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   read_signed
+ *
+ *  Params:     code - pointer to little-endian value
+ *              size - value size (1, 2, 4 or 8)
+ *
+ *  Return:     sign-extended value
+ *
+ *  Descr:      Read signed little-endian value of specified size
+ *
+ **************************************************************************/
+int64_t read_signed(const uint8_t *code, int size) {
+    switch (size) {
+        case 1:
+            return (int8_t)code[0];
+        case 2: {
+            int16_t val;
+            memcpy(&val, code, sizeof(val));
+            return val;
+        }
+        case 4: {
+            int32_t val;
+            memcpy(&val, code, sizeof(val));
+            return val;
+        }
+        default: {
+            int64_t val;
+            memcpy(&val, code, sizeof(val));
+            return val;
+        }
+    }
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   x86_effects
+ *
+ *  Params:     instr - decoded instruction
+ *              mem - where to store written memory operand
+ *              clobbers - where to store bitmask of general purpose
+ *                         registers (in ModRM numbering) instruction may
+ *                         change
+ *
+ *  Return:     X86_WRITE_NONE / X86_WRITE_MEM / X86_WRITE_UNKNOWN
+ *
+ *  Descr:      Find what memory instruction writes and what registers it
+ *              changes. Registers, encoded in ModRM, are considered
+ *              changed even if they are only read. Relative jumps are
+ *              reported as X86_WRITE_NONE, caller has to check the
+ *              target
+ *
+ **************************************************************************/
+int x86_effects(const struct x86_instr *instr, struct x86_mem *mem, uint16_t *clobbers) {
+    int has_mem = (instr->flags & X86_FLAG_MODRM) && 3 != instr->modrm >> 6;
+    int reg = (instr->modrm >> 3 & 7) | (instr->rex & X86_REX_R ? 8 : 0);
+    int rm = (instr->modrm & 7) | (instr->rex & X86_REX_B ? 8 : 0);
+
+    *clobbers = 0;
+    if (instr->flags & X86_FLAG_MODRM) {
+        if (!opcode_extension(instr)) {
+            *clobbers = 1 << reg;
+        }
+        if (!has_mem) {
+            *clobbers |= 1 << rm;
+        }
+    }
+
+    int size;   // size of written memory, 0 if memory isn't written, -1 if effects are unknown
+    switch (instr->map) {
+        case X86_MAP_PRIMARY:
+            size = primary_effects(instr, has_mem, clobbers);
+            break;
+        case X86_MAP_0F:
+            size = map_0f_effects(instr, has_mem, clobbers);
+            break;
+        default:
+            size = escape_effects(instr, has_mem, clobbers);
+    }
+    if (size < 0) {
+        return X86_WRITE_UNKNOWN;
+    }
+    if (!size || !has_mem) {
+        return X86_WRITE_NONE;
+    }
+    if (instr->flags & (X86_FLAG_ADSIZE | X86_FLAG_SEGMENT)) {
+        return X86_WRITE_UNKNOWN;       // 32-bit addresses and FS/GS-based (TLS) operands aren't supported
+    }
+
+    mem->size = size;
+    mem->disp = instr->disp;
+    mem->scale = 1;
+    mem->index = X86_REG_NONE;
+    if (4 == (instr->modrm & 7)) {
+        /* SIB, index 4 without REX.X means no index */
+        int index = (instr->sib >> 3 & 7) | (instr->rex & X86_REX_X ? 8 : 0);
+        if (X86_REG_RSP != index) {
+            mem->index = index;
+            mem->scale = 1 << (instr->sib >> 6);
+        }
+        if (0 == instr->modrm >> 6 && 5 == (instr->sib & 7)) {
+            mem->base = X86_REG_NONE;
+        } else {
+            mem->base = (instr->sib & 7) | (instr->rex & X86_REX_B ? 8 : 0);
+        }
+    } else if (instr->flags & X86_FLAG_RIPREL) {
+        mem->base = X86_REG_RIP;
+    } else {
+        mem->base = rm;
+    }
+
+    return X86_WRITE_MEM;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   primary_effects
+ *
+ *  Params:     instr - decoded instruction from primary opcode map
+ *              mem - whether instruction has memory operand
+ *              clobbers - bitmask of changed registers to update
+ *
+ *  Return:     size of written memory / 0 if memory isn't written / -1
+ *              if effects are unknown
+ *
+ *  Descr:      Find effects of primary map instruction
+ *
+ **************************************************************************/
+int primary_effects(const struct x86_instr *instr, int mem, uint16_t *clobbers) {
+    uint8_t op = instr->opcode;
+    int ext = instr->modrm >> 3 & 7;    // opcode extension for group opcodes
+    int embedded = (op & 7) | (instr->rex & X86_REX_B ? 8 : 0);    // register, encoded in opcode
+
+    if (!(instr->flags & X86_FLAG_MODRM)) {
+        if (op < 0x40) {
+            if (4 == (op & 7) || 5 == (op & 7)) {
+                if (0x3C != op && 0x3D != op) {     // everything except CMP changes accumulator
+                    *clobbers |= 1 << X86_REG_RAX;
+                }
+                return 0;
+            }
+            return -1;
+        }
+        if (op >= 0x58 && op <= 0x5F) {             // POP reg
+            *clobbers |= 1 << embedded | 1 << X86_REG_RSP;
+            return 0;
+        }
+        if (op >= 0x70 && op <= 0x7F) {             // Jcc
+            return 0;
+        }
+        if (op >= 0x90 && op <= 0x97) {             // XCHG reg, rAX
+            *clobbers |= 1 << embedded | 1 << X86_REG_RAX;
+            return 0;
+        }
+        if (op >= 0xB0 && op <= 0xBF) {             // MOV reg, imm
+            *clobbers |= 1 << embedded;
+            return 0;
+        }
+        switch (op) {
+            case 0x98:  // CBW/CWDE/CDQE
+            case 0x9F:  // LAHF
+            case 0xA0:  // MOV rAX, moffs
+            case 0xA1:
+                *clobbers |= 1 << X86_REG_RAX;
+                return 0;
+            case 0x99:  // CWD/CDQ/CQO
+                *clobbers |= 1 << X86_REG_RDX;
+                return 0;
+            case 0x9D:  // POPF
+                *clobbers |= 1 << X86_REG_RSP;
+                return 0;
+            case 0xA6:  // CMPS, LODS, SCAS
+            case 0xA7:
+            case 0xAC:
+            case 0xAD:
+            case 0xAE:
+            case 0xAF:
+                *clobbers |= 1 << X86_REG_RAX | 1 << X86_REG_RCX | 1 << X86_REG_RSI | 1 << X86_REG_RDI;
+                return 0;
+            case 0xC9:  // LEAVE
+                *clobbers |= 1 << X86_REG_RSP | 1 << X86_REG_RBP;
+                return 0;
+            case 0xE0:  // LOOPNE, LOOPE, LOOP
+            case 0xE1:
+            case 0xE2:
+                *clobbers |= 1 << X86_REG_RCX;
+                return 0;
+            case 0x9B:  // FWAIT
+            case 0xA8:  // TEST rAX, imm
+            case 0xA9:
+            case 0xE3:  // JrCXZ
+            case 0xE9:  // JMP
+            case 0xEB:
+            case 0xF5:  // CMC, CLC, STC, CLI, STI, CLD, STD
+            case 0xF8:
+            case 0xF9:
+            case 0xFA:
+            case 0xFB:
+            case 0xFC:
+            case 0xFD:
+            case 0x9E:  // SAHF
+                return 0;
+        }
+        return -1;      // PUSH, CALL, RET, string stores, I/O, interrupts etc.
+    }
+
+    /* ALU ops - ADD, OR, ADC, SBB, AND, SUB, XOR, CMP */
+    if (op < 0x40) {
+        if ((op & 7) > 1) {
+            return 0;   // register is destination
+        }
+        if (0x38 == (op & 0x38)) {
+            return 0;   // CMP
+        }
+        return op & 1 ? operand_size(instr) : 1;
+    }
+
+    switch (op) {
+        case 0x80:      // group 1 ALU op with immediate
+            return 7 == ext ? 0 : 1;
+        case 0x81:
+        case 0x83:
+            return 7 == ext ? 0 : operand_size(instr);
+        case 0x86:      // XCHG
+        case 0x88:      // MOV
+        case 0xC0:      // group 2 shifts
+        case 0xD0:
+        case 0xD2:
+            return 1;
+        case 0x87:
+        case 0x89:
+        case 0xC1:
+        case 0xD1:
+        case 0xD3:
+            return operand_size(instr);
+        case 0x8C:      // MOV r/m16, Sreg
+            return 2;
+        case 0xC6:      // MOV r/m, imm, other extensions are XABORT/XBEGIN
+            return 0 == ext ? 1 : -1;
+        case 0xC7:
+            return 0 == ext ? operand_size(instr) : -1;
+        case 0xF6:      // group 3
+        case 0xF7:
+            if (2 == ext || 3 == ext) {     // NOT, NEG
+                return 0xF6 == op ? 1 : operand_size(instr);
+            }
+            if (ext >= 4) {                 // MUL, IMUL, DIV, IDIV
+                *clobbers |= 1 << X86_REG_RAX | 1 << X86_REG_RDX;
+            }
+            return 0;
+        case 0xFE:      // group 4 - INC, DEC
+            return ext < 2 ? 1 : -1;
+        case 0xFF:      // group 5 - INC, DEC, indirect CALL, JMP, PUSH
+            return ext < 2 ? operand_size(instr) : -1;
+        case 0x63:      // MOVSXD
+        case 0x69:      // IMUL reg, r/m, imm
+        case 0x6B:
+        case 0x84:      // TEST
+        case 0x85:
+        case 0x8A:      // MOV reg, r/m
+        case 0x8B:
+        case 0x8D:      // LEA
+        case 0x8E:      // MOV Sreg, r/m16
+        case 0xD8:      // x87 arithmetic
+        case 0xDA:
+        case 0xDC:
+        case 0xDE:
+            return 0;
+        case 0xD9:      // x87 stores
+            if (!mem) {
+                return 0;
+            }
+            return 2 == ext || 3 == ext ? 4 : 7 == ext ? 2 : 6 == ext ? -1 : 0;
+        case 0xDB:
+            if (!mem) {
+                return 0;
+            }
+            return ext >= 1 && ext <= 3 ? 4 : 7 == ext ? 10 : 0;
+        case 0xDD:
+            if (!mem) {
+                return 0;
+            }
+            return ext >= 1 && ext <= 3 ? 8 : 7 == ext ? 2 : 6 == ext ? -1 : 0;
+        case 0xDF:
+            if (!mem) {
+                return 0;
+            }
+            return ext >= 1 && ext <= 3 ? 2 : 6 == ext ? 10 : 7 == ext ? 8 : 0;
+    }
+
+    return -1;      // POP r/m and unsupported instructions
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   map_0f_effects
+ *
+ *  Params:     instr - decoded instruction from 0F opcode map
+ *              mem - whether instruction has memory operand
+ *              clobbers - bitmask of changed registers to update
+ *
+ *  Return:     size of written memory / 0 if memory isn't written / -1
+ *              if effects are unknown
+ *
+ *  Descr:      Find effects of two-byte opcode instruction, legacy or
+ *              VEX-encoded
+ *
+ **************************************************************************/
+int map_0f_effects(const struct x86_instr *instr, int mem, uint16_t *clobbers) {
+    uint8_t op = instr->opcode;
+    int ext = instr->modrm >> 3 & 7;
+
+    if (!(instr->flags & X86_FLAG_MODRM)) {
+        if (op >= 0x80 && op <= 0x8F) {             // Jcc
+            return 0;
+        }
+        if (op >= 0xC8) {                           // BSWAP
+            *clobbers |= 1 << ((op & 7) | (instr->rex & X86_REX_B ? 8 : 0));
+            return 0;
+        }
+        switch (op) {
+            case 0x31:  // RDTSC
+                *clobbers |= 1 << X86_REG_RAX | 1 << X86_REG_RDX;
+                return 0;
+            case 0xA2:  // CPUID
+                *clobbers |= 1 << X86_REG_RAX | 1 << X86_REG_RCX | 1 << X86_REG_RDX | 1 << X86_REG_RBX;
+                return 0;
+            case 0x77:  // EMMS, VZEROUPPER, VZEROALL
+                return 0;
+        }
+        return -1;      // SYSCALL, UD2, PUSH/POP FS/GS etc.
+    }
+
+    if (op >= 0x90 && op <= 0x9F) {                 // SETcc
+        return 1;
+    }
+    switch (op) {
+        case 0x11:      // MOVUPS, MOVUPD, MOVSS, MOVSD store
+            return instr->flags & X86_FLAG_REP ? 4 : instr->flags & X86_FLAG_REPNE ? 8 : vector_size(instr);
+        case 0x13:      // MOVLPS/MOVLPD, MOVHPS/MOVHPD store
+        case 0x17:
+        case 0xD6:      // MOVQ xmm/m64, xmm
+            return 8;
+        case 0x29:      // MOVAPS/MOVAPD store
+        case 0x2B:      // MOVNTPS/MOVNTPD
+            return vector_size(instr);
+        case 0x7E:      // MOVD/MOVQ r/m, xmm or mm, with F3 it is MOVQ load
+            return instr->flags & X86_FLAG_REP ? 0 : instr->rex & X86_REX_W ? 8 : 4;
+        case 0x7F:      // MOVDQA/MOVDQU store, MOVQ mm/m64, mm
+        case 0xE7:      // MOVNTDQ, MOVNTQ
+            return instr->flags & (X86_FLAG_OPSIZE | X86_FLAG_REP) ? vector_size(instr) : 8;
+        case 0xA4:      // SHLD, SHRD
+        case 0xA5:
+        case 0xAC:
+        case 0xAD:
+            return operand_size(instr);
+        case 0xB0:      // CMPXCHG
+            *clobbers |= 1 << X86_REG_RAX;
+            return 1;
+        case 0xB1:
+            *clobbers |= 1 << X86_REG_RAX;
+            return operand_size(instr);
+        case 0xC0:      // XADD
+            return 1;
+        case 0xC1:
+            return operand_size(instr);
+        case 0xC3:      // MOVNTI
+            return instr->rex & X86_REX_W ? 8 : 4;
+        case 0xBA:      // group 8 - BT, BTS, BTR, BTC with immediate bit offset
+            return 4 == ext ? 0 : ext > 4 ? operand_size(instr) : -1;
+        case 0xAE:      // group 15
+            if (!mem) {
+                return 0;       // fences, RDFSBASE etc. change register encoded in ModRM only
+            }
+            return 3 == ext ? 4 : 0 == ext || 4 == ext || 6 == ext ? -1 : 0;   // STMXCSR, FXSAVE, XSAVE
+        case 0xC7:      // group 9
+            if (mem) {
+                if (1 != ext) {
+                    return -1;
+                }
+                *clobbers |= 1 << X86_REG_RAX | 1 << X86_REG_RDX;
+                return instr->rex & X86_REX_W ? 16 : 8;     // CMPXCHG8B/CMPXCHG16B
+            }
+            return ext >= 6 ? 0 : -1;      // RDRAND, RDSEED
+        case 0x00:      // system instructions
+        case 0x01:
+        case 0x0F:      // 3DNow!
+        case 0xAB:      // BTS, BTR, BTC with register bit offset can write outside of operand
+        case 0xB3:
+        case 0xBB:
+        case 0xF7:      // MASKMOVQ, MASKMOVDQU write at RDI
+            return mem ? -1 : 0;
+    }
+
+    return 0;       // SIMD and other instructions with register destination
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   escape_effects
+ *
+ *  Params:     instr - decoded instruction from 0F38 or 0F3A opcode map
+ *              mem - whether instruction has memory operand
+ *              clobbers - bitmask of changed registers to update
+ *
+ *  Return:     size of written memory / 0 if memory isn't written / -1
+ *              if effects are unknown
+ *
+ *  Descr:      Find effects of three-byte opcode instruction, legacy or
+ *              VEX-encoded
+ *
+ **************************************************************************/
+int escape_effects(const struct x86_instr *instr, int mem, uint16_t *clobbers) {
+    (void)clobbers;
+    uint8_t op = instr->opcode;
+
+    if (X86_MAP_0F38 == instr->map) {
+        if (instr->flags & X86_FLAG_VEX) {
+            switch (op) {
+                case 0x2E:      // VMASKMOVPS, VMASKMOVPD, VPMASKMOVD/Q store
+                case 0x2F:
+                case 0x8E:
+                    return vector_size(instr);
+                case 0xF3:      // BMI instructions that change register encoded in VEX
+                case 0xF5:
+                case 0xF6:
+                case 0xF7:
+                    return -1;
+            }
+            return 0;
+        }
+        /* MOVBE store, with F2 it is CRC32 */
+        return 0xF1 == op && !(instr->flags & X86_FLAG_REPNE) ? operand_size(instr) : 0;
+    }
+
+    if (!mem) {
+        return 0;
+    }
+    switch (op) {
+        case 0x14:      // PEXTRB
+            return 1;
+        case 0x15:      // PEXTRW
+            return 2;
+        case 0x16:      // PEXTRD/PEXTRQ
+            return instr->rex & X86_REX_W ? 8 : 4;
+        case 0x17:      // EXTRACTPS
+            return 4;
+        case 0x19:      // VEXTRACTF128, VEXTRACTI128
+        case 0x39:
+            return 16;
+        case 0x1D:      // VCVTPS2PH
+            return instr->flags & X86_FLAG_VEX_L ? 16 : 8;
+    }
+
+    return 0;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   opcode_extension
+ *
+ *  Params:     instr - decoded instruction with ModRM
+ *
+ *  Return:     1 if reg field of ModRM is opcode extension / 0 if it is
+ *              register
+ *
+ *  Descr:      Check if instruction belongs to opcode group
+ *
+ **************************************************************************/
+int opcode_extension(const struct x86_instr *instr) {
+    uint8_t op = instr->opcode;
+
+    switch (instr->map) {
+        case X86_MAP_PRIMARY:
+            return  0x80 == op || 0x81 == op || 0x83 == op || 0x8F == op ||
+                    0xC0 == op || 0xC1 == op || 0xC6 == op || 0xC7 == op ||
+                    (op >= 0xD0 && op <= 0xD3) || (op >= 0xD8 && op <= 0xDF) ||
+                    0xF6 == op || 0xF7 == op || 0xFE == op || 0xFF == op;
+        case X86_MAP_0F:
+            return  0x00 == op || 0x01 == op || (op >= 0x18 && op <= 0x1F) || (op >= 0x71 && op <= 0x73) ||
+                    0xAE == op || 0xBA == op || 0xC7 == op;
+        case X86_MAP_0F38:
+            return (instr->flags & X86_FLAG_VEX) && 0xF3 == op;
+    }
+
+    return 0;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   operand_size
+ *
+ *  Params:     instr - decoded instruction
+ *
+ *  Return:     operand size in bytes
+ *
+ *  Descr:      Get size of integer operand of instruction that supports
+ *              16-, 32- and 64-bit operands
+ *
+ **************************************************************************/
+int operand_size(const struct x86_instr *instr) {
+    if (instr->rex & X86_REX_W) {
+        return 8;
+    }
+    return instr->flags & X86_FLAG_OPSIZE ? 2 : 4;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   vector_size
+ *
+ *  Params:     instr - decoded instruction
+ *
+ *  Return:     operand size in bytes
+ *
+ *  Descr:      Get size of full vector operand of SSE/AVX instruction
+ *
+ **************************************************************************/
+int vector_size(const struct x86_instr *instr) {
+    return instr->flags & X86_FLAG_VEX_L ? 32 : 16;
+}
+
@@ -0,0 +1,113 @@
+/**************************************************************************
+ *
+ *  File:       decoder.h
+ *
+ *  Project:    Flight recorder (https://github.com/qrdl/flightrec)
+ *
+ *  Descr:      x86-64 instruction decoder
+ *
+ *  Notes:
+ *
+ **************************************************************************
+ *
+ *  Copyright (C) 2017-2020 Ilya Caramishev (flightrec@qrdl.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+#ifndef _DECODER_H
+#define _DECODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define X86_MAX_INSTR_LEN   15
+
+/* opcode maps */
+#define X86_MAP_PRIMARY     0
+#define X86_MAP_0F          1
+#define X86_MAP_0F38        2
+#define X86_MAP_0F3A        3
+
+/* instruction flags */
+#define X86_FLAG_MODRM      0x0001  // instruction has ModRM byte
+#define X86_FLAG_RIPREL     0x0002  // memory operand is RIP-relative
+#define X86_FLAG_BRANCH     0x0004  // relative jump
+#define X86_FLAG_COND       0x0008  // conditional relative jump (jcc, loop, jrcxz)
+#define X86_FLAG_CALL       0x0010  // relative call
+#define X86_FLAG_VEX        0x0020  // VEX-encoded instruction
+#define X86_FLAG_OPSIZE     0x0040  // operand size prefix (0x66) present
+#define X86_FLAG_ADSIZE     0x0080  // address size prefix (0x67) present
+#define X86_FLAG_REP        0x0100  // REP/REPE prefix (0xF3) present
+#define X86_FLAG_REPNE      0x0200  // REPNE prefix (0xF2) present
+#define X86_FLAG_LOCK       0x0400  // LOCK prefix present
+#define X86_FLAG_SEGMENT    0x0800  // FS/GS segment override present
+#define X86_FLAG_VEX_L      0x1000  // 256-bit VEX-encoded instruction
+
+/* REX bits */
+#define X86_REX_W           0x08
+#define X86_REX_R           0x04
+#define X86_REX_X           0x02
+#define X86_REX_B           0x01
+
+/* registers in ModRM numbering, 8-15 are R8-R15 */
+#define X86_REG_RAX         0
+#define X86_REG_RCX         1
+#define X86_REG_RDX         2
+#define X86_REG_RBX         3
+#define X86_REG_RSP         4
+#define X86_REG_RBP         5
+#define X86_REG_RSI         6
+#define X86_REG_RDI         7
+#define X86_REG_RIP         16      // base of RIP-relative operand
+#define X86_REG_NONE        17
+
+/* instruction effect on memory */
+#define X86_WRITE_NONE      0       // instruction doesn't write memory
+#define X86_WRITE_MEM       1       // instruction writes its memory operand
+#define X86_WRITE_UNKNOWN   2       // written memory cannot be found from operands, instruction leaves the code
+                                    // (call, return, system call) or it isn't known to decoder
+
+struct x86_instr {
+    uint8_t     length;         // total length in bytes
+    uint8_t     prefix_len;     // number of legacy prefix + REX bytes
+    uint8_t     map;            // one of X86_MAP_XXX
+    uint8_t     opcode;         // last opcode byte
+    uint8_t     opcode_offset;  // offset of last opcode byte
+    uint8_t     rex;            // REX (or REX-equivalent bits of VEX) prefix, 0 if not present
+    uint8_t     modrm;
+    uint8_t     sib;
+    uint8_t     disp_offset;    // offset of displacement, 0 if there isn't one
+    uint8_t     disp_size;
+    uint8_t     imm_offset;     // offset of immediate (or relative branch target), 0 if there isn't one
+    uint8_t     imm_size;
+    uint16_t    flags;          // X86_FLAG_XXX
+    int64_t     disp;           // sign-extended displacement
+    int64_t     imm;            // sign-extended immediate / relative branch offset
+};
+
+/* memory operand, address is base + index * scale + disp */
+struct x86_mem {
+    uint8_t     base;           // one of X86_REG_XXX
+    uint8_t     index;          // one of X86_REG_XXX, X86_REG_RIP isn't used
+    uint8_t     scale;
+    uint8_t     size;           // operand size in bytes
+    int64_t     disp;
+};
+
+int x86_decode(const uint8_t *code, size_t size, struct x86_instr *instr);
+int x86_effects(const struct x86_instr *instr, struct x86_mem *mem, uint16_t *clobbers);
+
+#endif
+
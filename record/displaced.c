@@ -0,0 +1,313 @@
+/**************************************************************************
+ *
+ *  File:       displaced.c
+ *
+ *  Project:    Flight recorder (https://github.com/qrdl/flightrec)
+ *
+ *  Descr:      Displaced stepping over breakpoints
+ *
+ *  Notes:      Instead of restoring original instruction, single-stepping
+ *              it and re-inserting the breakpoint, original instruction is
+ *              copied into the slot in scratch memory, mapped inside
+ *              the tracee, and followed by the jump back to the next
+ *              instruction, so breakpoint is never removed and the tracee
+ *              can be continued straight from the slot. Instructions that
+ *              depend on their location (IP-relative data references and
+ *              branches) are relocated. Technique is the same as used by
+ *              GDB and uprobes
+ *
+ **************************************************************************
+ *
+ *  Copyright (C) 2017-2020 Ilya Caramishev (flightrec@qrdl.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+
+#include "flightrec.h"
+#include "eel.h"
+#include "decoder.h"
+#include "inject.h"
+#include "displaced.h"
+
+#define JMP_ABS_SIZE    14      // jmp *0(%rip) followed by 8-byte target address
+
+static size_t emit_jump(uint8_t *buf, uint64_t target);
+static size_t emit_push(uint8_t *buf, uint64_t value);
+static int relocate(uint8_t *buf, const struct x86_instr *instr, uint64_t from, uint64_t to);
+
+static int mem_fd = -1;
+static uint64_t scratch;            // address of scratch area in tracee
+static uint8_t *slots;              // local copy of scratch area
+static uint64_t slot_count;
+static uint64_t used_slots;
+static uint64_t dirty_start, dirty_end;     // range of slots not yet written into tracee
+
+
+/**************************************************************************
+ *
+ *  Function:   dsp_init
+ *
+ *  Params:     pid - pid of stopped tracee
+ *              count - number of slots to reserve
+ *              near - preferred location of scratch area. IP-relative
+ *                     instructions can be relocated only within 2GB range
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Map scratch area inside the tracee
+ *
+ **************************************************************************/
+int dsp_init(pid_t pid, uint64_t count, uint64_t near) {
+    uint64_t size = (count * DSP_SLOT_SIZE + PAGE_SIZE - 1) & PAGE_MASK;
+    uint64_t hint = near > size + PAGE_SIZE ? (near - size) & PAGE_MASK : 0;
+
+    /* area is executable but not writable for the tracee, tracer writes to it via /proc/<pid>/mem */
+    uint64_t args[6] = { hint, size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, (uint64_t)-1, 0 };
+    if (SUCCESS != inject_syscall(pid, SYS_mmap, args, &scratch)) {
+        return FAILURE;
+    }
+    if ((int64_t)scratch < 0 && (int64_t)scratch > -4096) {
+        ERR("Cannot map scratch memory in child: %s", strerror(-(int64_t)scratch));
+        return FAILURE;
+    }
+
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "/proc/%d/mem", pid);
+    mem_fd = open(tmp, O_RDWR);
+    if (mem_fd < 0) {
+        ERR("Cannot open file '%s': %s", tmp, strerror(errno));
+        return FAILURE;
+    }
+
+    /* fill unused slots with INT3 to catch stray jumps */
+    slots = malloc(size);
+    memset(slots, 0xCC, size);
+    slot_count = count;
+    used_slots = dirty_start = dirty_end = 0;
+    INFO("Mapped %" PRIu64 " bytes of scratch memory at 0x%" PRIx64, size, scratch);
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   dsp_add_line
+ *
+ *  Params:     address - address of the breakpoint in tracee
+ *              code - original code at the address
+ *              size - number of bytes in code
+ *
+ *  Return:     address of slot in tracee / 0 if instruction cannot be
+ *              displaced
+ *
+ *  Descr:      Build displaced instruction slot for the breakpoint
+ *
+ **************************************************************************/
+uint64_t dsp_add_line(uint64_t address, const uint8_t *code, size_t size) {
+    struct x86_instr instr;
+
+    if (used_slots >= slot_count) {
+        return 0;
+    }
+    if (SUCCESS != x86_decode(code, size, &instr)) {
+        DBG("Cannot decode instruction at 0x%" PRIx64, address);
+        return 0;
+    }
+
+    uint64_t slot = scratch + used_slots * DSP_SLOT_SIZE;
+    uint8_t *buf = slots + used_slots * DSP_SLOT_SIZE;
+    uint8_t *cur = buf;
+    uint64_t next = address + instr.length;
+
+    if (instr.flags & X86_FLAG_BRANCH) {
+        uint64_t target = next + instr.imm;
+        if (instr.flags & X86_FLAG_CALL) {
+            /* push return address and jump */
+            cur += emit_push(cur, next);
+            cur += emit_jump(cur, target);
+        } else if (instr.flags & X86_FLAG_COND) {
+            /* short conditional jump over the jump to next instruction, straight to jump to target */
+            if (X86_MAP_PRIMARY == instr.map) {
+                /* jcc rel8, loop, jrcxz - keep prefixes as they may change counter size */
+                memcpy(cur, code, instr.imm_offset);
+                cur += instr.imm_offset;
+            } else {
+                *cur++ = 0x70 | (instr.opcode & 0x0F);    // jcc rel32 -> jcc rel8
+            }
+            *cur++ = JMP_ABS_SIZE;
+            cur += emit_jump(cur, next);
+            cur += emit_jump(cur, target);
+        } else {
+            cur += emit_jump(cur, target);
+        }
+    } else if (X86_MAP_PRIMARY == instr.map && 0xFF == instr.opcode && 2 == ((instr.modrm >> 3) & 7)) {
+        /* indirect call - push return address and turn it into indirect jump (FF /4), so return address
+           on the stack is the original one. Stack-based operands are affected by the push so leave them */
+        int mod = instr.modrm >> 6, rm = instr.modrm & 7;
+        if (3 != mod && 4 == rm && 4 == (instr.sib & 7) && !(instr.rex & X86_REX_B)) {
+            return 0;
+        }
+        cur += emit_push(cur, next);
+        memcpy(cur, code, instr.length);
+        cur[instr.opcode_offset + 1] = (instr.modrm & 0xC7) | (4 << 3);
+        if (SUCCESS != relocate(cur, &instr, address, slot + (cur - buf))) {
+            return 0;
+        }
+        cur += instr.length;
+    } else if (X86_MAP_PRIMARY == instr.map && 0xCC == instr.opcode) {
+        return 0;       // already a breakpoint
+    } else {
+        memcpy(cur, code, instr.length);
+        if (SUCCESS != relocate(cur, &instr, address, slot)) {
+            return 0;
+        }
+        cur += instr.length;
+        cur += emit_jump(cur, next);
+    }
+
+    if (dirty_start == dirty_end) {
+        dirty_start = used_slots;
+    }
+    used_slots++;
+    dirty_end = used_slots;
+
+    return slot;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   dsp_commit
+ *
+ *  Params:     N/A
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Write slots, added since last commit, into tracee
+ *
+ **************************************************************************/
+int dsp_commit(void) {
+    if (dirty_start == dirty_end) {
+        return SUCCESS;
+    }
+    size_t offset = dirty_start * DSP_SLOT_SIZE;
+    size_t size = (dirty_end - dirty_start) * DSP_SLOT_SIZE;
+    if (pwrite(mem_fd, slots + offset, size, scratch + offset) != (ssize_t)size) {
+        ERR("Cannot write scratch memory in child: %s", strerror(errno));
+        return FAILURE;
+    }
+    dirty_start = dirty_end = used_slots;
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   relocate
+ *
+ *  Params:     buf - copy of instruction
+ *              instr - decoded instruction
+ *              from - original instruction address
+ *              to - new instruction address
+ *
+ *  Return:     SUCCESS / FAILURE if displacement doesn't fit into 32 bits
+ *
+ *  Descr:      Adjust IP-relative displacement, if any, for new location
+ *
+ **************************************************************************/
+int relocate(uint8_t *buf, const struct x86_instr *instr, uint64_t from, uint64_t to) {
+    if (!(instr->flags & X86_FLAG_RIPREL)) {
+        return SUCCESS;
+    }
+    int64_t disp = instr->disp + (int64_t)(from - to);
+    if (disp < INT32_MIN || disp > INT32_MAX) {
+        DBG("Cannot relocate instruction at 0x%" PRIx64 " to 0x%" PRIx64, from, to);
+        return FAILURE;
+    }
+    int32_t disp32 = disp;
+    memcpy(buf + instr->disp_offset, &disp32, sizeof(disp32));
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   emit_jump
+ *
+ *  Params:     buf - where to write the code
+ *              target - jump target
+ *
+ *  Return:     number of bytes written
+ *
+ *  Descr:      Write absolute jump, that doesn't change any register
+ *
+ **************************************************************************/
+size_t emit_jump(uint8_t *buf, uint64_t target) {
+    static const uint8_t jmp[] = { 0xFF, 0x25, 0x00, 0x00, 0x00, 0x00 };     // jmp *0(%rip)
+    memcpy(buf, jmp, sizeof(jmp));
+    memcpy(buf + sizeof(jmp), &target, sizeof(target));
+
+    return JMP_ABS_SIZE;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   emit_push
+ *
+ *  Params:     buf - where to write the code
+ *              value - value to push
+ *
+ *  Return:     number of bytes written
+ *
+ *  Descr:      Write code to push 64-bit value without changing flags
+ *              or other registers
+ *
+ **************************************************************************/
+size_t emit_push(uint8_t *buf, uint64_t value) {
+    static const uint8_t lea[] = { 0x48, 0x8D, 0x64, 0x24, 0xF8 };     // lea -0x8(%rsp),%rsp
+    static const uint8_t mov_lo[] = { 0xC7, 0x04, 0x24 };               // movl $imm32,(%rsp)
+    static const uint8_t mov_hi[] = { 0xC7, 0x44, 0x24, 0x04 };         // movl $imm32,0x4(%rsp)
+    uint32_t lo = value & 0xFFFFFFFF, hi = value >> 32;
+    uint8_t *cur = buf;
+
+    memcpy(cur, lea, sizeof(lea));
+    cur += sizeof(lea);
+    memcpy(cur, mov_lo, sizeof(mov_lo));
+    cur += sizeof(mov_lo);
+    memcpy(cur, &lo, sizeof(lo));
+    cur += sizeof(lo);
+    memcpy(cur, mov_hi, sizeof(mov_hi));
+    cur += sizeof(mov_hi);
+    memcpy(cur, &hi, sizeof(hi));
+    cur += sizeof(hi);
+
+    return cur - buf;
+}
+
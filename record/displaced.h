@@ -0,0 +1,43 @@
+/**************************************************************************
+ *
+ *  File:       displaced.h
+ *
+ *  Project:    Flight recorder (https://github.com/qrdl/flightrec)
+ *
+ *  Descr:      Displaced stepping over breakpoints
+ *
+ *  Notes:
+ *
+ **************************************************************************
+ *
+ *  Copyright (C) 2017-2020 Ilya Caramishev (flightrec@qrdl.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+#ifndef _DISPLACED_H
+#define _DISPLACED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* each slot contains relocated original instruction, followed by jump back */
+#define DSP_SLOT_SIZE   64
+
+int dsp_init(pid_t pid, uint64_t slot_count, uint64_t near);
+uint64_t dsp_add_line(uint64_t address, const uint8_t *code, size_t size);
+int dsp_commit(void);
+
+#endif
@@ -0,0 +1,124 @@
+/**************************************************************************
+ *
+ *  File:       inject.c
+ *
+ *  Project:    Flight recorder (https://github.com/qrdl/flightrec)
+ *
+ *  Descr:      Execute system calls on behalf of the tracee
+ *
+ *  Notes:      Tracee must be in ptrace-stop. SYSCALL instruction is
+ *              temporarily written at current IP and executed by
+ *              single-stepping, after that original code and registers
+ *              are restored
+ *
+ **************************************************************************
+ *
+ *  Copyright (C) 2017-2020 Ilya Caramishev (flightrec@qrdl.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/user.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "flightrec.h"
+#include "eel.h"
+#include "inject.h"
+
+#define SYSCALL_INSTR   0x050F      // 0F 05 in little-endian
+
+
+/**************************************************************************
+ *
+ *  Function:   inject_syscall
+ *
+ *  Params:     pid - pid of stopped tracee
+ *              nr - syscall number
+ *              args - syscall arguments
+ *              result - where to store syscall return value
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Make the tracee execute the system call
+ *
+ **************************************************************************/
+int inject_syscall(pid_t pid, uint64_t nr, const uint64_t args[6], uint64_t *result) {
+    struct user_regs_struct saved, regs;
+    if (-1 == ptrace(PTRACE_GETREGS, pid, NULL, &saved)) {
+        ERR("Cannot read process registers - %s", strerror(errno));
+        return FAILURE;
+    }
+
+    errno = 0;  // PTRACE_PEEKDATA can return anything, even -1, so use only errno for diag
+    REG_TYPE instr = ptrace(PTRACE_PEEKDATA, pid, (void *)saved.rip, NULL);
+    if (errno) {
+        ERR("Cannot peek at child code - %s", strerror(errno));
+        return FAILURE;
+    }
+    if (-1 == ptrace(PTRACE_POKEDATA, pid, (void *)saved.rip, (void *)((instr & ~0xFFFFULL) | SYSCALL_INSTR))) {
+        ERR("Cannot update child code - %s", strerror(errno));
+        return FAILURE;
+    }
+
+    regs = saved;
+    regs.rax = nr;
+    regs.rdi = args[0];
+    regs.rsi = args[1];
+    regs.rdx = args[2];
+    regs.r10 = args[3];
+    regs.r8  = args[4];
+    regs.r9  = args[5];
+    /* tracee may be stopped inside interrupted syscall, prevent the kernel from restarting it */
+    regs.orig_rax = -1;
+    int ret = SUCCESS;
+    if (-1 == ptrace(PTRACE_SETREGS, pid, NULL, &regs)) {
+        ERR("Cannot set process registers - %s", strerror(errno));
+        RETCLEAN(FAILURE);
+    }
+    if (-1 == ptrace(PTRACE_SINGLESTEP, pid, NULL, NULL)) {
+        ERR("Cannot execute syscall in child - %s", strerror(errno));
+        RETCLEAN(FAILURE);
+    }
+    int wait_status;
+    if (-1 == waitpid(pid, &wait_status, __WALL)) {
+        ERR("Cannot wait for child - %s", strerror(errno));
+        RETCLEAN(FAILURE);
+    }
+    if (!WIFSTOPPED(wait_status) || SIGTRAP != WSTOPSIG(wait_status)) {
+        ERR("Didn't get expected SIGTRAP after syscall - got %d", WSTOPSIG(wait_status));
+        RETCLEAN(FAILURE);
+    }
+    if (-1 == ptrace(PTRACE_GETREGS, pid, NULL, &regs)) {
+        ERR("Cannot read process registers - %s", strerror(errno));
+        RETCLEAN(FAILURE);
+    }
+    *result = regs.rax;
+
+cleanup:
+    if (-1 == ptrace(PTRACE_POKEDATA, pid, (void *)saved.rip, (void *)instr)) {
+        ERR("Cannot restore child code - %s", strerror(errno));
+        ret = FAILURE;
+    }
+    if (-1 == ptrace(PTRACE_SETREGS, pid, NULL, &saved)) {
+        ERR("Cannot restore process registers - %s", strerror(errno));
+        ret = FAILURE;
+    }
+
+    return ret;
+}
+
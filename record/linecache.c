@@ -0,0 +1,258 @@
+/**************************************************************************
+ *
+ *  File:       linecache.c
+ *
+ *  Project:    Flight recorder (https://github.com/qrdl/flightrec)
+ *
+ *  Descr:      Address to source line lookup for breakpoints
+ *
+ *  Notes:      Every step needs the line for breakpoint address, so
+ *              lines are looked up in direct-mapped table, indexed by
+ *              offset from the first line address
+ *
+ **************************************************************************
+ *
+ *  Copyright (C) 2017-2020 Ilya Caramishev (flightrec@qrdl.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "flightrec.h"
+#include "eel.h"
+#include "linecache.h"
+
+struct cached_line **lc_table;  // line by offset from lc_base, NULL if table isn't built
+uint64_t lc_base;
+uint64_t lc_size;
+
+static struct cached_unit *cache;
+static int unit_count;
+
+/**************************************************************************
+ *
+ *  Function:   lc_init
+ *
+ *  Params:     units - cached units, sorted by address
+ *              count - number of units
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Build direct-mapped table that gives cached line for
+ *              line address in single load. If code is too big, table
+ *              isn't built and lookups use search
+ *
+ **************************************************************************/
+void lc_init(struct cached_unit *units, int count) {
+    cache = units;
+    unit_count = count;
+    lc_table = NULL;
+    if (!count) {
+        return;
+    }
+
+    lc_base = units[0].start;
+    lc_size = units[count - 1].end - lc_base + 1;
+    if (lc_size > LC_TABLE_MAX) {
+        INFO("Code is too big for line lookup table (%" PRIu64 " bytes), using search", lc_size);
+        return;
+    }
+    /* calloc() gets zeroed pages from OS, so gaps between units don't cost anything until accessed */
+    lc_table = calloc(lc_size, sizeof(*lc_table));
+    if (!lc_table) {
+        WARN("Cannot allocate line lookup table, using search");
+        return;
+    }
+    for (struct cached_unit *cur_unit = units; cur_unit < units + count; cur_unit++) {
+        for (struct cached_line *cur_line = cur_unit->lines; cur_line < cur_unit->lines + cur_unit->line_count;
+                cur_line++) {
+            lc_table[cur_line->address - lc_base] = cur_line;
+        }
+    }
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   lc_search
+ *
+ *  Params:     address - statement address to look for
+ *
+ *  Return:     found cached entry / NULL if not found
+ *
+ *  Descr:      Find unit where address is located, within unit use
+ *              linear approximation to find the address
+ *
+ **************************************************************************/
+struct cached_line *lc_search(uint64_t address) {
+    static int unit;   // typically addresses come from the same unit
+    int index, left, right;
+
+    if (!unit_count) {
+        return NULL;
+    }
+    if (cache[unit].start > address || cache[unit].end < address) {
+        /* unit has changed - look for unit */
+        left = 0;
+        right = unit_count;  // search interval doesn't include right bound
+        for (index = right / 2; right > left; index = (left + right) / 2) {
+            if (address < cache[index].start) {
+                right = index;
+            } else if (address > cache[index].end) {
+                left = index + 1;
+            } else {
+                break;
+            }
+        }
+        if (left == right) {
+            return NULL;
+        }
+        unit = index;
+    }
+
+    left = 0;
+    uint64_t left_addr = cache[unit].lines[left].address;
+    right = cache[unit].line_count - 1;   // search interval does include right bound
+    uint64_t right_addr = cache[unit].lines[right].address;
+
+    while (right >= left) {     // because right bound is included, right and left can be equal
+        /* addresses are sequential and kinda uniformly distributed, so linear approximation
+           should do better than binary search */
+        if (right_addr == left_addr) {
+            index = left;
+        } else {
+            index = left + (address - left_addr) * (right - left) / (right_addr - left_addr);
+        }
+        if (address < cache[unit].lines[index].address) {
+            right = index - 1;
+            right_addr = cache[unit].lines[right].address;
+        } else if (address > cache[unit].lines[index].address) {
+            left = index + 1;
+            left_addr = cache[unit].lines[left].address;
+        } else {
+            break;
+        }
+    }
+    if (left > right) {
+        return NULL;
+    }
+
+    return &cache[unit].lines[index];
+}
+
+
+#ifdef UNITTEST
+/* Benchmark of table lookup against search. Build with
+   gcc -DUNITTEST -O2 -I.. linecache.c -o linecache_test */
+
+#include <stdio.h>
+#include <time.h>
+
+#define UNITS           4096
+#define LINES_PER_UNIT  512
+#define LOOKUPS         (16 * 1024 * 1024)
+
+FILE *logfd;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+int main(void) {
+    logfd = stderr;
+    srand(1);
+
+    /* lines are 1 to 12 bytes long, units are separated by gaps, like in real binary */
+    struct cached_unit *units = malloc(UNITS * sizeof(*units));
+    uint64_t address = 0x1000, total = 0;
+    for (int i = 0; i < UNITS; i++) {
+        units[i].line_count = 1 + rand() % (2 * LINES_PER_UNIT);
+        units[i].lines = malloc(units[i].line_count * sizeof(struct cached_line));
+        for (uint64_t j = 0; j < units[i].line_count; j++) {
+            units[i].lines[j].address = address;
+            address += 1 + rand() % 12;
+        }
+        units[i].start = units[i].lines[0].address;
+        units[i].end = units[i].lines[units[i].line_count - 1].address;
+        total += units[i].line_count;
+        address += rand() % 256;
+    }
+
+    /* steps mostly go through nearby lines with occasional calls to another unit */
+    uint64_t *addresses = malloc(LOOKUPS * sizeof(*addresses));
+    int unit = 0;
+    uint64_t line = 0;
+    for (int i = 0; i < LOOKUPS; i++) {
+        if (!(rand() % 16)) {
+            unit = rand() % UNITS;
+            line = rand() % units[unit].line_count;
+        } else {
+            line = (line + 1) % units[unit].line_count;
+        }
+        addresses[i] = units[unit].lines[line].address;
+    }
+    printf("%d units, %" PRIu64 " lines, %" PRIu64 " bytes of code, %d lookups\n", UNITS, total,
+            address - units[0].start, LOOKUPS);
+
+    lc_init(units, UNITS);
+    if (!lc_table) {
+        printf("Table isn't built\n");
+        return EXIT_FAILURE;
+    }
+    struct cached_line **table = lc_table;
+
+    lc_table = NULL;    // force search
+    uintptr_t check_search = 0;
+    double start = now();
+    for (int i = 0; i < LOOKUPS; i++) {
+        check_search += (uintptr_t)lc_lookup(addresses[i]);
+    }
+    double search = now() - start;
+
+    lc_table = table;
+    uintptr_t check_table = 0;
+    start = now();
+    for (int i = 0; i < LOOKUPS; i++) {
+        check_table += (uintptr_t)lc_lookup(addresses[i]);
+    }
+    double direct = now() - start;
+
+    for (int i = 0; i < LOOKUPS; i++) {
+        lc_table = NULL;
+        struct cached_line *expected = lc_lookup(addresses[i]);
+        lc_table = table;
+        if (!expected || expected->address != addresses[i] || expected != lc_lookup(addresses[i])) {
+            printf("Mismatch for address 0x%" PRIx64 "\n", addresses[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (lc_lookup(units[0].start - 1) || lc_lookup(units[0].start + 1 == units[0].lines[1].address ? 0 :
+            units[0].start + 1) || lc_lookup(address + 1)) {
+        printf("Found line for address without a line\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("Search: %.2f ns per lookup\n", search * 1000000000.0 / LOOKUPS);
+    printf("Table:  %.2f ns per lookup\n", direct * 1000000000.0 / LOOKUPS);
+
+    return check_search == check_table ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
+
@@ -0,0 +1,74 @@
+/**************************************************************************
+ *
+ *  File:       linecache.h
+ *
+ *  Project:    Flight recorder (https://github.com/qrdl/flightrec)
+ *
+ *  Descr:      Address to source line lookup for breakpoints
+ *
+ *  Notes:
+ *
+ **************************************************************************
+ *
+ *  Copyright (C) 2017-2020 Ilya Caramishev (flightrec@qrdl.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+#ifndef _LINECACHE_H
+#define _LINECACHE_H
+
+#include <stdint.h>
+
+/* SQLite performance isn't good enough so I use my own cache. Steps within unit are sorted by address so I can
+   approximate the location of needed entry faster than logN */
+struct line_writes;
+struct cached_line {
+    uint64_t    address;
+    uint64_t    func_id;
+    char        func_flag;
+    uint8_t     org_instr_byte;
+    char        armed;      // breakpoint is set, with lazy arming lines get armed on first function call
+    uint64_t    slot;       // address of displaced instruction slot in child, 0 if line isn't displaced
+    struct line_writes  *writes;    // memory written by the line, NULL if line isn't decoded yet
+};
+struct cached_unit {
+    uint64_t            start;      // address of first line in unit
+    uint64_t            end;        // address of last line in unit
+    uint64_t            line_count;
+    struct cached_line  *lines;
+};
+
+/* direct-mapped table is indexed by offset from the first line address, so it takes 8 bytes per byte of code.
+   Bigger binaries fall back to search */
+#define LC_TABLE_MAX    (1ULL << 24)
+
+void lc_init(struct cached_unit *units, int count);
+struct cached_line *lc_search(uint64_t address);
+
+extern struct cached_line **lc_table;
+extern uint64_t lc_base;
+extern uint64_t lc_size;
+
+/* called for every step, so inline it */
+static inline struct cached_line *lc_lookup(uint64_t address) {
+    if (lc_table) {
+        uint64_t offset = address - lc_base;    // addresses below base wrap around and fail the check
+        return offset < lc_size ? lc_table[offset] : NULL;
+    }
+    return lc_search(address);
+}
+
+#endif
+
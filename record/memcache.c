@@ -34,9 +34,12 @@
 #include <sys/types.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/user.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <linux/limits.h>
+#include <limits.h>
 #include <pthread.h>
 
 #include "flightrec.h"
@@ -46,27 +49,136 @@
 #include "memcache.h"
 #include "db_workers.h"
 #include "channel.h"
+#include "reset_dirty.h"
 
-/* memory region, initially corresponds to single entry in /proc/<pid>/maps, but later if region grows,
-   added chunk is processed as separate region */
+/* memory region, node of AVL tree. Regions don't overlap, so tree is ordered by start address and by end address.
+   Cached pages are mapped separately for every region, so region can be split, trimmed or grown without copying.
+   In hash mode region keeps hash of every segment instead of pages, hashes are allocated from heap */
 struct region {
     uint64_t        start;
     uint64_t        end;
-    char            *pages;
+    char            *pages;         // cached pages or segment hashes
+    int64_t         offset;         // offset of cached pages in spill file, -1 if pages are in memory
+    struct region   *left;
+    struct region   *right;
+    int             height;
+};
+
+#define PAGE_SEGMENTS   (PAGE_SIZE / MEM_SEGMENT_SIZE)
+#define HPAGE_SIZE      (2 * 1024 * 1024)   // transparent huge page size on x86-64
+#define STAGING_SIZE    (IOV_MAX * PAGE_SIZE)
+#define DIFF_BATCH_MIN  32                  // don't wake diff workers for fewer pages than that per worker
+#define PIPELINE_MAX    65536               // max number of pages, copied but not processed yet
+#define STACK_REDZONE   128                 // area below stack pointer, that leaf functions may use
+#define STACK_SWITCH    (64 * PAGE_SIZE)    // bigger move of stack pointer is switch to another stack
+#define WRITE_BLOCK     (2 * MEM_SEGMENT_SIZE)  // diff kernels may compare segments in pairs, 64 blocks per page
+/* size of cache for client memory of size S */
+#define SHADOW_SIZE(S)  (hash_shadow ? (S) / MEM_SEGMENT_SIZE * sizeof(uint64_t) : (S))
+
+/* dirty page, waiting to be read */
+struct dirty_page {
+    uint64_t        address;
+    char            *cached;        // cached page or its segment hashes
+    char            *content;       // page content, read from child, NULL if page cannot be read
+};
+
+/* stack window of the thread - pages of current frame, compared on every step of the thread, writes there aren't
+   tracked. Written page keeps its soft-dirty flag (or stays unprotected) until tracking is reset, so when window
+   moves, pages it leaves are compared once more at next step, after tracking is reset */
+struct stack_window {
+    pid_t           tid;
+    uint64_t        start;
+    uint64_t        end;
+    uint64_t        left_start;     // pages, left by window at previous step
+    uint64_t        left_end;
+};
+
+/* dirty pages of the step, copied from child and waiting to be processed by pipeline thread */
+struct captured_pages {
+    uint64_t            step_id;
+    int                 count;
+    struct dirty_page   *pages;
+    char                *content;
 };
 
 static uint64_t find_page(uint64_t address, char **cached);
-static void process_page(uint64_t address, char *cached, uint64_t step_id);
+static int start_diff_workers(void);
+static void *diff_worker(void *arg);
+static void diff_pages(char *buf);
+static void process_dirty(struct dirty_page *pages, int count, int copied, uint64_t step_id);
+static void copy_pages(struct dirty_page *pages, int count, char *buf);
+static void capture_pages(int count, uint64_t step_id);
+static void *pipeline_worker(void *arg);
+static void wait_pipeline(uint64_t limit);
+static void process_page(uint64_t address, char *cached, const char *content, uint64_t step_id);
+static int process_writes(int count, const struct mem_range *writes, int write_count, uint64_t step_id);
+static int process_blocks(uint64_t address, char *cached, uint64_t blocks, uint64_t step_id);
+static int compare_pages(const void *a, const void *b);
+static void add_dirty_page(uint64_t address);
+static void add_dirty_tree(struct region *node);
+static int move_stack_window(pid_t tid, uint64_t sp, struct mem_range *ranges, int *moved);
+static unsigned int next_segment(const uint64_t *mask, unsigned int from, int changed);
+static void store_runs(uint64_t address, const char *content, const uint64_t *mask, char *cached, uint64_t step_id);
+static void store_snapshot(uint64_t address, const char *content, uint64_t size, uint64_t step_id);
+static void store_run(uint64_t address, const char *content, uint64_t size, uint64_t step_id);
+static int read_region(uint64_t start, uint64_t size, char *pages, uint64_t step_id);
+static void remove_range(uint64_t start, uint64_t end);
+static void trim_hashes(struct region *reg, uint64_t start, uint64_t end);
+static char *map_pages(uint64_t size, int64_t *offset);
+static void release_pages(char *pages, uint64_t size, int64_t offset);
+static void store_tree(struct region *node, uint64_t step_id);
+static struct region *region_at(uint64_t address);
+static struct region *region_after(uint64_t address);
+static struct region *tree_insert(struct region *node, struct region *new_node);
+static struct region *tree_remove(struct region *node, uint64_t start);
+static struct region *tree_balance(struct region *node);
+static struct region *tree_rotate(struct region *node, int right);
+static int tree_height(struct region *node);
 
-/* sorted array of memory regions */
+/* tree of memory regions, modified by BPF thread when child maps or unmaps memory */
 static struct region *cache;
-static unsigned int reg_count;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t shadow_size;            // size of cached pages kept in memory
+static int spill_fd = -1;               // file for cached pages that don't fit into memory budget
+static uint64_t spill_size;
 
 static pid_t child_pid;
 extern struct channel *proc_mem_ch;
+extern char *db_name;
+
+static struct dirty_page *dirty;        // pages dirtied since last step
+static int dirty_count;
+static int dirty_size;
+static char pages_lost;                 // set when written pages didn't fit into channel
+static char *staging;                   // pages, read from child in one go, IOV_MAX pages
+static alignas(PAGE_SIZE) const char zero_page[PAGE_SIZE];
+
+/* dirty pages of the step, shared by diff workers. Workers take batches of pages until all pages are taken */
+static struct {
+    struct dirty_page   *pages;
+    int                 count;
+    int                 batch;
+    int                 next;           // first page of next batch, updated atomically
+    int                 copied;         // pages are copied from child already
+    uint64_t            step_id;
+} diff_job;
+static pthread_barrier_t diff_start;    // main thread and diff workers wait here for pages to process
+static pthread_barrier_t diff_done;     // and here for all pages to be processed
 
-/* function pointers for best memory comparison functions, based on available CPU features and size */
-int (* memdiff)(const char *buf1, const char *buf2, size_t count);
+/* in pipelined mode pages are copied by main thread and processed by pipeline thread */
+static struct channel *pipeline_ch;
+static pthread_mutex_t pipeline_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipeline_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t pipeline_pages;         // pages, copied but not processed yet
+
+static struct stack_window *windows;    // checked by threads that report written pages
+static int window_count;
+static pthread_mutex_t window_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* function pointers for best page comparison and hashing functions, based on available CPU features */
+void (* pagediff)(const char *buf1, const char *buf2, size_t size, uint64_t *mask);
+void (* hashdiff)(const char *buf, size_t size, uint64_t *hashes, uint64_t *mask);
 
 /**************************************************************************
  *
@@ -84,9 +196,32 @@ int init_cache(pid_t pid) {
     char exe_name[PATH_MAX];
     char tmp[256];
 
-    memdiff = best_memdiff(MEM_SEGMENT_SIZE);
+    pagediff = best_pagediff();
+    hashdiff = best_hashdiff();
     child_pid = pid;
 
+    /* buffer must be aligned to allow fast vector instructions */
+    if (posix_memalign((void **)&staging, PAGE_SIZE, STAGING_SIZE)) {
+        ERR("Cannot allocate memory for staging buffer");
+        return FAILURE;
+    }
+    if (diff_workers > 1 && SUCCESS != start_diff_workers()) {
+        return FAILURE;
+    }
+    if (pipeline_mem) {
+        pipeline_ch = ch_create(CH_SINGLE_WRITER);
+        if (!pipeline_ch) {
+            return FAILURE;
+        }
+        pthread_t worker;
+        int ret = pthread_create(&worker, NULL, pipeline_worker, NULL);
+        if (ret) {
+            ERR("Cannot start pipeline thread: %s", strerror(ret));
+            return FAILURE;
+        }
+        pthread_setname_np(worker, "fr_pipeline");
+    }
+
     snprintf(tmp, sizeof(tmp), "/proc/%d/exe", pid);    // coverity[fs_check_call]
     ssize_t res = readlink(tmp, exe_name, sizeof(exe_name) - 1);
     if (res < 0) {
@@ -148,162 +283,1528 @@ int init_cache(pid_t pid) {
  *
  *  Return:     start address of memory page
  *
- *  Descr:      Find page by address
+ *  Descr:      Find page by address. Must be called with cache lock held
  *
  **************************************************************************/
 uint64_t find_page(uint64_t address, char **cached) {
-    int index;
-    /* use binary search to find region the address belongs to */
-    /* I don't want to use bsearch() to avoid extra function calls */
-    int left = 0;
-    int right = reg_count;
-    for (index = right / 2; right > left; index = (left + right) / 2) {
-        if (address < cache[index].start) {
-            right = index;
-        } else if (address >= cache[index].end) {
-            left = index + 1;
-        } else {
-            break;
-        }
-    }
-    if (left == right) {
+    struct region *reg = region_at(address);
+    if (!reg) {
         DBG("Address 0x%" PRIx64 " not found in cache", address);
         return 0;
     }
-    int page_num = (address - cache[index].start) / PAGE_SIZE;
-    *cached  = cache[index].pages + page_num * PAGE_SIZE;
-    return cache[index].start + page_num * PAGE_SIZE;
+    uint64_t offset = (address - reg->start) & ~(PAGE_SIZE - 1);
+    *cached = reg->pages + SHADOW_SIZE(offset);
+    return reg->start + offset;
 }
 
 
 /**************************************************************************
  *
- *  Function:   process_page
+ *  Function:   start_diff_workers
  *
- *  Params:     address - page address (in child memory space)
- *              cached - pointer to cached page content
+ *  Params:     N/A
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Start threads that process dirty pages together with main
+ *              thread, each with its own staging buffer
+ *
+ **************************************************************************/
+int start_diff_workers(void) {
+    if (    pthread_barrier_init(&diff_start, NULL, diff_workers) ||
+            pthread_barrier_init(&diff_done, NULL, diff_workers)) {
+        ERR("Cannot init barriers for diff workers");
+        return FAILURE;
+    }
+    for (int i = 1; i < diff_workers; i++) {    // main thread is a worker too
+        char *buf;
+        if (posix_memalign((void **)&buf, PAGE_SIZE, STAGING_SIZE)) {
+            ERR("Cannot allocate memory for staging buffer");
+            return FAILURE;
+        }
+        pthread_t worker;
+        int ret = pthread_create(&worker, NULL, diff_worker, buf);
+        if (ret) {
+            ERR("Cannot start diff worker: %s", strerror(ret));
+            return FAILURE;
+        }
+        pthread_setname_np(worker, "fr_diff");
+    }
+    INFO("Started %d diff workers", diff_workers - 1);
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   diff_worker
+ *
+ *  Params:     arg - staging buffer
+ *
+ *  Return:     N/A (never returns)
+ *
+ *  Descr:      Diff worker thread, processes dirty pages of every step
+ *              together with main thread
+ *
+ **************************************************************************/
+void *diff_worker(void *arg) {
+    for (;;) {
+        pthread_barrier_wait(&diff_start);
+        diff_pages(arg);
+        pthread_barrier_wait(&diff_done);
+    }
+
+    return NULL;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   diff_pages
+ *
+ *  Params:     buf - staging buffer
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Take batches of dirty pages of the step, read them from
+ *              child with single syscall, unless they are copied already,
+ *              and process them until there are no pages left
+ *
+ **************************************************************************/
+void diff_pages(char *buf) {
+    int first;
+    while ((first = __atomic_fetch_add(&diff_job.next, diff_job.batch, __ATOMIC_RELAXED)) < diff_job.count) {
+        struct dirty_page *pages = diff_job.pages + first;
+        int count = diff_job.count - first < diff_job.batch ? diff_job.count - first : diff_job.batch;
+        if (!diff_job.copied) {
+            copy_pages(pages, count, buf);
+        }
+        for (int i = 0; i < count; i++) {
+            if (pages[i].content && pages[i].cached) {
+                process_page(pages[i].address, pages[i].cached, pages[i].content, diff_job.step_id);
+            }
+        }
+    }
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   process_dirty
+ *
+ *  Params:     pages - dirty pages, sorted by address, without duplicates
+ *              count - number of pages
+ *              copied - 1 if pages are copied from child already
  *              step_id
  *
  *  Return:     N/A
  *
- *  Descr:      Find changed part of the page, store the changes into DB
- *              (by calling worker), cache new content
+ *  Descr:      Process dirty pages of the step, using diff workers if
+ *              there are many pages. Must be called with cache lock held
+ *
+ **************************************************************************/
+void process_dirty(struct dirty_page *pages, int count, int copied, uint64_t step_id) {
+    diff_job.pages = pages;
+    diff_job.count = count;
+    diff_job.next = 0;
+    diff_job.copied = copied;
+    diff_job.step_id = step_id;
+    if (diff_workers > 1 && count >= DIFF_BATCH_MIN * 2) {
+        /* split pages evenly, so every worker makes single read if possible */
+        diff_job.batch = (count + diff_workers - 1) / diff_workers;
+        if (diff_job.batch < DIFF_BATCH_MIN) {
+            diff_job.batch = DIFF_BATCH_MIN;
+        } else if (diff_job.batch > IOV_MAX) {
+            diff_job.batch = IOV_MAX;
+        }
+        pthread_barrier_wait(&diff_start);
+        diff_pages(staging);
+        pthread_barrier_wait(&diff_done);
+    } else {
+        diff_job.batch = IOV_MAX;
+        diff_pages(staging);
+    }
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   copy_pages
+ *
+ *  Params:     pages - dirty pages, sorted by address, without duplicates
+ *              count - number of pages, no more than IOV_MAX
+ *              buf - where to copy pages to
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Read dirty pages from child with single syscall, set
+ *              content of pages that can be read
+ *
+ **************************************************************************/
+void copy_pages(struct dirty_page *pages, int count, char *buf) {
+    struct iovec local;
+    struct iovec child[IOV_MAX];
+    for (int i = 0; i < count; i++) {
+        child[i].iov_base = (void *)pages[i].address;
+        child[i].iov_len = PAGE_SIZE;
+        pages[i].content = NULL;
+    }
+
+    /* reading stops at first page that cannot be read, skip it and read the rest */
+    for (int first = 0; first < count; ) {
+        local.iov_base = buf + first * PAGE_SIZE;
+        local.iov_len = (count - first) * PAGE_SIZE;
+        ssize_t res = process_vm_readv(child_pid, &local, 1, child + first, count - first, 0);
+        int read = res > 0 ? res / PAGE_SIZE : 0;
+        for (int i = first; i < first + read; i++) {
+            pages[i].content = buf + i * PAGE_SIZE;
+        }
+        first += read;
+        if (first < count) {
+            ERR("Cannot read child memory at 0x%" PRIx64 ": %s", pages[first].address,
+                    res < 0 ? strerror(errno) : "partial read");
+            first++;
+        }
+    }
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   capture_pages
+ *
+ *  Params:     count - number of dirty pages
+ *              step_id
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Copy dirty pages from child and pass them to pipeline
+ *              thread, so child can continue while pages are processed.
+ *              Waits if pipeline thread is too far behind
  *
  **************************************************************************/
-void process_page(uint64_t address, char *cached, uint64_t step_id) {
+void capture_pages(int count, uint64_t step_id) {
+    wait_pipeline(count < PIPELINE_MAX ? PIPELINE_MAX - count : 0);
+
+    struct captured_pages *msg = malloc(sizeof(*msg));
+    msg->step_id = step_id;
+    msg->count = count;
+    msg->pages = malloc(sizeof(*msg->pages) * count);
+    memcpy(msg->pages, dirty, sizeof(*msg->pages) * count);
     /* buffer must be aligned to allow fast vector instructions */
-    alignas(MEM_SEGMENT_SIZE) char buffer[PAGE_SIZE];
-    struct iovec local = {buffer, PAGE_SIZE};
-    struct iovec child = {(void *)address, PAGE_SIZE};
-    if (process_vm_readv(child_pid, &local, 1, &child, 1, 0) < (ssize_t)MEM_SEGMENT_SIZE) {
-        ERR("Cannot read child memory: %s", strerror(errno));
+    if (posix_memalign((void **)&msg->content, PAGE_SIZE, (size_t)count * PAGE_SIZE)) {
+        ERR("Cannot allocate memory for dirty pages");
+        free(msg->pages);
+        free(msg);
         return;
     }
+    for (int i = 0; i < count; i += IOV_MAX) {
+        copy_pages(msg->pages + i, count - i < IOV_MAX ? count - i : IOV_MAX, msg->content + i * PAGE_SIZE);
+    }
+
+    pthread_mutex_lock(&pipeline_lock);
+    pipeline_pages += count;
+    pthread_mutex_unlock(&pipeline_lock);
+    ch_write(pipeline_ch, (char *)msg, sizeof(*msg));    // pipeline thread will free msg
+}
+
 
-    /* loop through page segments, look for changed one */
-    for (uint64_t offset = 0; offset < PAGE_SIZE; offset += MEM_SEGMENT_SIZE) {
-        if (memdiff(buffer + offset, cached + offset, MEM_SEGMENT_SIZE)) {
-            // found changed segment
-            memcpy(cached + offset, buffer + offset, MEM_SEGMENT_SIZE);
+/**************************************************************************
+ *
+ *  Function:   pipeline_worker
+ *
+ *  Params:     arg - not used
+ *
+ *  Return:     N/A (never returns)
+ *
+ *  Descr:      Pipeline thread, processes pages copied by main thread.
+ *              Cached pages are looked up only now, because regions
+ *              could change since pages were copied
+ *
+ **************************************************************************/
+void *pipeline_worker(void *arg) {
+    (void)arg;
+    struct captured_pages *msg;
+    size_t size = sizeof(*msg);
 
-            /* store memory change event in DB using workier */
-            struct insert_mem_msg *msg = malloc(sizeof(*msg));
-            msg->address = address + offset;
-            msg->step_id = step_id;
-            memcpy(msg->content, buffer+offset, MEM_SEGMENT_SIZE);
-            ch_write(insert_mem_ch, (char *)msg, sizeof(*msg));    // channel reader will free msg
+    while (CHANNEL_OK == ch_read(pipeline_ch, (char **)&msg, &size, READ_BLOCK)) {
+        pthread_mutex_lock(&cache_lock);
+        for (int i = 0; i < msg->count; i++) {
+            msg->pages[i].cached = NULL;
+            if (msg->pages[i].content) {
+                find_page(msg->pages[i].address, &msg->pages[i].cached);
+            }
         }
+        process_dirty(msg->pages, msg->count, 1, msg->step_id);
+        pthread_mutex_unlock(&cache_lock);
+
+        pthread_mutex_lock(&pipeline_lock);
+        pipeline_pages -= msg->count;
+        pthread_cond_broadcast(&pipeline_cond);
+        pthread_mutex_unlock(&pipeline_lock);
+        free(msg->content);
+        free(msg->pages);
+        free(msg);
+        size = sizeof(*msg);
     }
+
+    return NULL;
 }
 
 
 /**************************************************************************
  *
- *  Function:   cache_add_region
+ *  Function:   wait_pipeline
  *
- *  Params:     address - start adress of new region
- *              size
+ *  Params:     limit - max number of pages left in pipeline
  *
  *  Return:     N/A
  *
- *  Descr:      Add new memory region to cache, memory regions are stored
- *              in arrey, sorted by start address to speed up address lookup
+ *  Descr:      Wait until pipeline thread processes enough pages
  *
  **************************************************************************/
-void cache_add_region(uint64_t address, uint64_t size, uint64_t step_id) {
-    /* look for potential position of new region in the cache */
-    unsigned int index;
-    for (index = 0; index < reg_count && cache[index].start <= address; index++);
-
-    struct region *tmp = cache;
-    reg_count++;
-    cache = malloc(sizeof(*cache) * reg_count);
-    struct region *new_reg = NULL;
-    if (!tmp) {
-        /* first region */
-        new_reg = cache;
+void wait_pipeline(uint64_t limit) {
+    pthread_mutex_lock(&pipeline_lock);
+    while (pipeline_pages > limit) {
+        pthread_cond_wait(&pipeline_cond, &pipeline_lock);
+    }
+    pthread_mutex_unlock(&pipeline_lock);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   cache_flush
+ *
+ *  Params:     N/A
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Wait until all copied pages are processed and their
+ *              changes are passed to DB worker
+ *
+ **************************************************************************/
+void cache_flush(void) {
+    if (pipeline_mem) {
+        wait_pipeline(0);
+    }
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   process_page
+ *
+ *  Params:     address - page address (in child memory space)
+ *              cached - pointer to cached page content or segment hashes
+ *              content - current page content
+ *              step_id
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Find changed part of the page, store the changes into DB
+ *              (by calling worker), cache new content or its hashes
+ *
+ **************************************************************************/
+void process_page(uint64_t address, char *cached, const char *content, uint64_t step_id) {
+    uint64_t mask[PAGE_SEGMENTS / 64];
+    if (hash_shadow) {
+        hashdiff(content, PAGE_SIZE, (uint64_t *)cached, mask);     // hashes get updated
     } else {
-        if (index > 0) {
-            /* copy regions preceeding the new one */
-            memcpy(cache, tmp, sizeof(*cache) * index);
-        }
-        if (index < (reg_count-1)) {
-            /* copy regions following the new one */
-            DBG("Copy to %d from %d %lu bytes", index + 1, index, sizeof(*cache) * (reg_count - index - 1));
-            memcpy(&cache[index + 1], &tmp[index], sizeof(*cache) * (reg_count - index - 1));
-        }
-        new_reg = cache + index;
-        free(tmp);
-    }
-    new_reg->start = address;
-    new_reg->end = address + size;
-
-    /* it is important to use aligned momory as CPU instructions used by memdiff operates with aligned memory */
-    posix_memalign((void **)&new_reg->pages, MEM_SEGMENT_SIZE, size);
-    struct iovec local = {new_reg->pages, size};
-    struct iovec child = {(void *)address, size};
-    if (process_vm_readv(child_pid, &local, 1, &child, 1, 0) < (ssize_t)size) {
-        ERR("Cannot read child memory: %s", strerror(errno));
-        return;
+        pagediff(content, cached, PAGE_SIZE, mask);
     }
-    for (uint64_t offset = 0; offset < size; offset += MEM_SEGMENT_SIZE) {
-        /* store memory change event in DB using workier */
-        struct insert_mem_msg *msg = malloc(sizeof(*msg));
-        msg->address = address + offset;
-        msg->step_id = step_id;
-        memcpy(msg->content, new_reg->pages + offset, MEM_SEGMENT_SIZE);
-        ch_write(insert_mem_ch, (char *)msg, sizeof(*msg));    // channel reader will free msg
+
+    store_runs(address, content, mask, hash_shadow ? NULL : cached, step_id);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   process_writes
+ *
+ *  Params:     count - number of dirty pages, sorted by address, without
+ *                      duplicates
+ *              writes - all memory, written since previous step
+ *              write_count - number of written ranges
+ *              step_id
+ *
+ *  Return:     number of dirty pages left to process as whole pages
+ *
+ *  Descr:      Process written parts of dirty pages, pages that cannot
+ *              be processed this way are left in dirty page list. Must
+ *              be called with cache lock held
+ *
+ **************************************************************************/
+int process_writes(int count, const struct mem_range *writes, int write_count, uint64_t step_id) {
+    int left = 0;
+    for (int i = 0; i < count; i++) {
+        uint64_t page = dirty[i].address;
+        uint64_t blocks = 0;        // bit per WRITE_BLOCK of the page
+        for (int j = 0; j < write_count; j++) {
+            uint64_t start = writes[j].start > page ? writes[j].start : page;
+            uint64_t end = writes[j].end < page + PAGE_SIZE ? writes[j].end : page + PAGE_SIZE;
+            for (uint64_t block = start; block < end; block = (block | (WRITE_BLOCK - 1)) + 1) {
+                blocks |= 1ULL << (block - page) / WRITE_BLOCK;
+            }
+        }
+        /* page, written outside of known writes, is compared as a whole */
+        if (!blocks || SUCCESS != process_blocks(page, dirty[i].cached, blocks, step_id)) {
+            dirty[left++] = dirty[i];
+        }
     }
 
-    INFO("Added mem region at 0x%" PRIx64 " for %" PRId64, address, size);
+    return left;
 }
 
 
 /**************************************************************************
  *
- *  Function:   proc_dirty_mem
+ *  Function:   process_blocks
+ *
+ *  Params:     address - page address (in child memory space)
+ *              cached - cached page or its hashes
+ *              blocks - bitmask of page blocks to process
+ *              step_id
+ *
+ *  Return:     SUCCESS / FAILURE if blocks cannot be read
+ *
+ *  Descr:      Read specified blocks of the page from child with single
+ *              syscall, store changed segments and update the cache
+ *
+ **************************************************************************/
+int process_blocks(uint64_t address, char *cached, uint64_t blocks, uint64_t step_id) {
+    /* blocks are read into staging at their page offsets, adjacent blocks are read together */
+    struct iovec local[PAGE_SIZE / WRITE_BLOCK];
+    struct iovec child[PAGE_SIZE / WRITE_BLOCK];
+    int count = 0;
+    ssize_t size = 0;
+    for (uint64_t rest = blocks; rest; ) {
+        int first = __builtin_ctzll(rest);
+        uint64_t unset = ~(rest >> first);
+        int last = unset ? first + __builtin_ctzll(unset) : 64;
+        rest &= last < 64 ? ~0ULL << last : 0;
+        local[count].iov_base = staging + first * WRITE_BLOCK;
+        local[count].iov_len = (last - first) * WRITE_BLOCK;
+        child[count].iov_base = (void *)(address + first * WRITE_BLOCK);
+        child[count].iov_len = local[count].iov_len;
+        size += local[count++].iov_len;
+    }
+    if (process_vm_readv(child_pid, local, count, child, count, 0) < size) {
+        return FAILURE;
+    }
+
+    uint64_t mask[PAGE_SEGMENTS / 64] = {0};
+    for (uint64_t rest = blocks; rest; rest &= rest - 1) {
+        uint64_t offset = __builtin_ctzll(rest) * WRITE_BLOCK;
+        uint64_t changed;
+        if (hash_shadow) {
+            hashdiff(staging + offset, WRITE_BLOCK, (uint64_t *)cached + offset / MEM_SEGMENT_SIZE, &changed);
+        } else {
+            pagediff(staging + offset, cached + offset, WRITE_BLOCK, &changed);
+        }
+        mask[offset / MEM_SEGMENT_SIZE / 64] |= changed << (offset / MEM_SEGMENT_SIZE % 64);
+    }
+    store_runs(address, staging, mask, hash_shadow ? NULL : cached, step_id);
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   store_runs
+ *
+ *  Params:     address - page address (in child memory space)
+ *              content - page content
+ *              mask - bitmask of page segments to store
+ *              cached - cached page to copy stored segments to, NULL if
+ *                       there is no need to copy
+ *              step_id
  *
- *  Params:     step_id
-  *
  *  Return:     N/A
  *
- *  Descr:      Process page fault events and process dirty pages
+ *  Descr:      Store segments of the page, adjacent segments are stored
+ *              as single run
  *
  **************************************************************************/
-void proc_dirty_mem(uint64_t step_id) {
-    uint64_t *address;
-    uint64_t page_address;
-    char *cached;
-    size_t size = sizeof(*address);
-    /* read and process until there is something to process */
-    while (CHANNEL_OK == ch_read(proc_mem_ch, (char **)&address, &size, READ_NONBLOCK)) {
-        DBG("Dirty addr 0x%" PRIx64 " at step %" PRId64, *address, step_id);
-        page_address = find_page(*address, &cached);
-        if (page_address) {
-            process_page(page_address, cached, step_id);
+void store_runs(uint64_t address, const char *content, const uint64_t *mask, char *cached, uint64_t step_id) {
+    unsigned int end;
+    for (unsigned int start = next_segment(mask, 0, 1); start < PAGE_SEGMENTS; start = next_segment(mask, end, 1)) {
+        end = next_segment(mask, start, 0);
+        uint64_t offset = start * MEM_SEGMENT_SIZE;
+        uint64_t size = (end - start) * MEM_SEGMENT_SIZE;
+        if (cached) {
+            memcpy(cached + offset, content + offset, size);
         }
+        store_run(address + offset, content + offset, size, step_id);
+    }
+}
 
-        free(address);
+
+/**************************************************************************
+ *
+ *  Function:   next_segment
+ *
+ *  Params:     mask - bitmask of changed page segments
+ *              from - segment to start search from
+ *              changed - 1 to look for changed segment, 0 - for unchanged
+ *
+ *  Return:     segment number / PAGE_SEGMENTS if not found
+ *
+ *  Descr:      Find next changed or unchanged segment of the page
+ *
+ **************************************************************************/
+unsigned int next_segment(const uint64_t *mask, unsigned int from, int changed) {
+    while (from < PAGE_SEGMENTS) {
+        uint64_t word = (changed ? mask[from / 64] : ~mask[from / 64]) >> (from % 64);
+        if (word) {
+            from += __builtin_ctzll(word);
+            break;
+        }
+        from = (from / 64 + 1) * 64;    // nothing in this word, go to the next one
+    }
+
+    return from < PAGE_SEGMENTS ? from : PAGE_SEGMENTS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   compare_pages
+ *
+ *  Params:     a, b - dirty pages to compare
+ *
+ *  Return:     -1 if a < b, 1 if a > b, 0 if equal
+ *
+ *  Descr:      qsort() comparison function for dirty pages
+ *
+ **************************************************************************/
+int compare_pages(const void *a, const void *b) {
+    uint64_t first = ((const struct dirty_page *)a)->address;
+    uint64_t second = ((const struct dirty_page *)b)->address;
+
+    return first < second ? -1 : first > second;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   cache_add_region
+ *
+ *  Params:     address - start adress of new region
+ *              size
+ *              step_id
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Add new memory region to cache and store its content. New
+ *              region replaces cached memory it overlaps, and region that
+ *              grows (e.g. heap) is extended rather than added
+ *
+ **************************************************************************/
+void cache_add_region(uint64_t address, uint64_t size, uint64_t step_id) {
+    uint64_t start = address & ~(PAGE_SIZE - 1);
+    uint64_t end = (address + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    size = end - start;
+
+    pthread_mutex_lock(&cache_lock);
+    remove_range(start, end);
+    remove_dirty_region(start, size);
+
+    /* region must be tracked before reading, so writes made after reading don't get lost */
+    add_dirty_region(start, size);
+
+    /* cached pages are mapped, so they are aligned as CPU instructions used by pagediff require */
+    char *pages = MAP_FAILED;
+    int64_t offset = -1;
+    struct region *prev = start ? region_at(start - 1) : NULL;
+    if (prev && hash_shadow) {
+        pages = realloc(prev->pages, SHADOW_SIZE(end - prev->start));
+        if (!pages) {
+            WARN("Cannot extend region at 0x%" PRIx64, prev->start);
+            prev = NULL;
+        } else {
+            prev->pages = pages;
+            pages += SHADOW_SIZE(start - prev->start);
+            shadow_size += SHADOW_SIZE(size);
+        }
+    } else if (prev && prev->offset < 0 && (!shadow_budget || shadow_size + size <= shadow_budget)) {
+        pages = mremap(prev->pages, start - prev->start, end - prev->start, MREMAP_MAYMOVE);
+        if (MAP_FAILED == pages) {
+            WARN("Cannot extend region at 0x%" PRIx64 ": %s", prev->start, strerror(errno));
+            prev = NULL;
+        } else {
+            prev->pages = pages;
+            pages += start - prev->start;
+            shadow_size += size;
+        }
+    } else {
+        prev = NULL;    // spilled region cannot grow, file space after it may be used already
+    }
+    if (!prev) {
+        pages = map_pages(size, &offset);
+        if (MAP_FAILED == pages) {
+            pthread_mutex_unlock(&cache_lock);
+            return;
+        }
     }
-    return;
+
+    if (SUCCESS != read_region(start, size, pages, step_id)) {
+        if (prev && hash_shadow) {
+            prev->end = end;
+            trim_hashes(prev, prev->start, start);   // extended hashes cannot be released separately
+        } else {
+            release_pages(pages, size, offset);
+        }
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    if (prev) {
+        prev->end = end;
+    } else {
+        struct region *new_reg = calloc(1, sizeof(*new_reg));
+        new_reg->start = start;
+        new_reg->end = end;
+        new_reg->pages = pages;
+        new_reg->offset = offset;
+        cache = tree_insert(cache, new_reg);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    INFO("Added mem region at 0x%" PRIx64 " for %" PRId64, start, size);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   read_region
+ *
+ *  Params:     start - start address of memory, page-aligned
+ *              size - memory size, multiple of page size
+ *              pages - where to store memory content or segment hashes
+ *              step_id
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Read memory from child, cache it and store it in DB. In
+ *              hash mode memory is read in chunks, because only hashes
+ *              are cached
+ *
+ **************************************************************************/
+int read_region(uint64_t start, uint64_t size, char *pages, uint64_t step_id) {
+    uint64_t chunk = hash_shadow ? STAGING_SIZE : size;
+    for (uint64_t offset = 0; offset < size; offset += chunk) {
+        if (size - offset < chunk) {
+            chunk = size - offset;
+        }
+        struct iovec local = {hash_shadow ? staging : pages, chunk};
+        struct iovec child = {(void *)(start + offset), chunk};
+        if (process_vm_readv(child_pid, &local, 1, &child, 1, 0) < (ssize_t)chunk) {
+            ERR("Cannot read child memory: %s", strerror(errno));
+            return FAILURE;
+        }
+        if (hash_shadow) {
+            hashdiff(staging, chunk, (uint64_t *)(pages + SHADOW_SIZE(offset)), NULL);
+        }
+        store_snapshot(start + offset, local.iov_base, chunk, step_id);
+    }
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   cache_remove_region
+ *
+ *  Params:     address - start adress of unmapped memory
+ *              size
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Remove unmapped memory from cache, regions it overlaps
+ *              are removed, trimmed or split
+ *
+ **************************************************************************/
+void cache_remove_region(uint64_t address, uint64_t size) {
+    /* page with the start address stays mapped if address isn't page-aligned, e.g. when heap shrinks */
+    uint64_t start = (address + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint64_t end = (address + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    if (start >= end) {
+        return;
+    }
+    pthread_mutex_lock(&cache_lock);
+    remove_range(start, end);
+    pthread_mutex_unlock(&cache_lock);
+    remove_dirty_region(start, end - start);
+
+    INFO("Removed mem region at 0x%" PRIx64 " for %" PRId64, start, end - start);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   cache_move_region
+ *
+ *  Params:     old_address - old start address of remapped memory
+ *              old_size
+ *              new_address - new start address of remapped memory
+ *              new_size
+ *              step_id
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Update cache after memory was remapped. Memory, moved to
+ *              new address, is stored as new region, because memory
+ *              content is recorded by address
+ *
+ **************************************************************************/
+void cache_move_region(uint64_t old_address, uint64_t old_size, uint64_t new_address, uint64_t new_size,
+        uint64_t step_id) {
+    if (old_address != new_address) {
+        cache_remove_region(old_address, old_size);
+        cache_add_region(new_address, new_size, step_id);
+    } else if (new_size > old_size) {
+        cache_add_region(old_address + old_size, new_size - old_size, step_id);
+    } else if (new_size < old_size) {
+        cache_remove_region(old_address + new_size, old_size - new_size);
+    }
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   remove_range
+ *
+ *  Params:     start - start address of memory, page-aligned
+ *              end - end address of memory, page-aligned
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Remove memory from cache. Must be called with cache lock
+ *              held
+ *
+ **************************************************************************/
+void remove_range(uint64_t start, uint64_t end) {
+    struct region *reg;
+    while (NULL != (reg = region_after(start)) && reg->start < end) {
+        if (reg->start < start && reg->end > end) {
+            /* hole in the middle - split the region */
+            struct region *tail = calloc(1, sizeof(*tail));
+            tail->start = end;
+            tail->end = reg->end;
+            if (hash_shadow) {
+                /* hashes are allocated as single block, so tail gets a copy */
+                tail->pages = map_pages(tail->end - tail->start, &tail->offset);
+                if (MAP_FAILED == tail->pages) {
+                    free(tail);     // tail memory cannot be tracked without hashes
+                } else {
+                    memcpy(tail->pages, reg->pages + SHADOW_SIZE(end - reg->start),
+                            SHADOW_SIZE(tail->end - tail->start));
+                    cache = tree_insert(cache, tail);
+                }
+                trim_hashes(reg, reg->start, start);
+                break;
+            }
+            tail->pages = reg->pages + (end - reg->start);
+            tail->offset = reg->offset < 0 ? -1 : reg->offset + (int64_t)(end - reg->start);
+            release_pages(reg->pages + (start - reg->start), end - start,
+                    reg->offset < 0 ? -1 : reg->offset + (int64_t)(start - reg->start));
+            reg->end = start;
+            cache = tree_insert(cache, tail);
+            break;
+        } else if (reg->start < start) {
+            /* cut the tail */
+            if (hash_shadow) {
+                trim_hashes(reg, reg->start, start);
+                continue;
+            }
+            release_pages(reg->pages + (start - reg->start), reg->end - start,
+                    reg->offset < 0 ? -1 : reg->offset + (int64_t)(start - reg->start));
+            reg->end = start;
+        } else if (reg->end > end) {
+            /* cut the head, region keeps its place in the tree */
+            if (hash_shadow) {
+                trim_hashes(reg, end, reg->end);
+                break;
+            }
+            release_pages(reg->pages, end - reg->start, reg->offset);
+            reg->pages += end - reg->start;
+            if (reg->offset >= 0) {
+                reg->offset += end - reg->start;
+            }
+            reg->start = end;
+            break;
+        } else {
+            cache = tree_remove(cache, reg->start);
+            release_pages(reg->pages, reg->end - reg->start, reg->offset);
+            free(reg);
+        }
+    }
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   trim_hashes
+ *
+ *  Params:     reg - region
+ *              start - new start address of region, page-aligned
+ *              end - new end address of region, page-aligned
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Shrink region in hash mode, keeping hashes of remaining
+ *              memory
+ *
+ **************************************************************************/
+void trim_hashes(struct region *reg, uint64_t start, uint64_t end) {
+    shadow_size -= SHADOW_SIZE(reg->end - reg->start) - SHADOW_SIZE(end - start);
+    if (start > reg->start) {
+        memmove(reg->pages, reg->pages + SHADOW_SIZE(start - reg->start), SHADOW_SIZE(end - start));
+    }
+    char *hashes = realloc(reg->pages, SHADOW_SIZE(end - start));
+    if (hashes) {
+        reg->pages = hashes;    // shrinking realloc() may still fail, then bigger block is kept
+    }
+    reg->start = start;
+    reg->end = end;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   map_pages
+ *
+ *  Params:     size - size of memory to map
+ *              offset - where to store offset in spill file, -1 if
+ *                       memory isn't file-backed
+ *
+ *  Return:     mapped memory / MAP_FAILED on error
+ *
+ *  Descr:      Map memory for cached pages. Big regions are aligned to
+ *              huge page boundary and use transparent huge pages to
+ *              reduce TLB misses while comparing pages. Once memory
+ *              budget is exhausted, cached pages are mapped from spill
+ *              file, so kernel can write cold pages out and evict them.
+ *              In hash mode memory for hashes is allocated from heap
+ *
+ **************************************************************************/
+char *map_pages(uint64_t size, int64_t *offset) {
+    char *pages;
+    if (hash_shadow) {
+        *offset = -1;
+        pages = malloc(SHADOW_SIZE(size));
+        if (!pages) {
+            ERR("Cannot allocate memory for hashes");
+            return MAP_FAILED;
+        }
+        shadow_size += SHADOW_SIZE(size);
+        return pages;
+    }
+    if (!shadow_budget || shadow_size + size <= shadow_budget) {
+        *offset = -1;
+        if (size < HPAGE_SIZE) {
+            pages = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        } else {
+            /* map bigger area and unmap unaligned head and tail */
+            char *area = mmap(NULL, size + HPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            pages = area;
+            if (MAP_FAILED != area) {
+                pages = (char *)(((uintptr_t)area + HPAGE_SIZE - 1) & ~(uintptr_t)(HPAGE_SIZE - 1));
+                if (pages > area) {
+                    munmap(area, pages - area);
+                }
+                munmap(pages + size, HPAGE_SIZE - (pages - area));
+                if (madvise(pages, size, MADV_HUGEPAGE)) {
+                    DBG("Cannot use huge pages: %s", strerror(errno));
+                }
+            }
+        }
+        if (MAP_FAILED == pages) {
+            ERR("Cannot allocate memory for cached pages: %s", strerror(errno));
+            return MAP_FAILED;
+        }
+        shadow_size += size;
+        return pages;
+    }
+
+    if (spill_fd < 0) {
+        /* file is next to recording, and is removed right away, so it doesn't outlive Recorder */
+        char *spill_name = malloc(strlen(db_name) + sizeof("_shadow"));
+        strcpy(spill_name, db_name);
+        strcat(spill_name, "_shadow");
+        spill_fd = open(spill_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (spill_fd < 0) {
+            ERR("Cannot create spill file '%s': %s", spill_name, strerror(errno));
+            free(spill_name);
+            return MAP_FAILED;
+        }
+        unlink(spill_name);
+        free(spill_name);
+        INFO("Memory budget exhausted, cached pages are spilled to file");
+    }
+    if (ftruncate(spill_fd, spill_size + size)) {
+        ERR("Cannot extend spill file: %s", strerror(errno));
+        return MAP_FAILED;
+    }
+    pages = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, spill_fd, spill_size);
+    if (MAP_FAILED == pages) {
+        ERR("Cannot map spill file: %s", strerror(errno));
+        return MAP_FAILED;
+    }
+    *offset = spill_size;
+    spill_size += size;
+
+    return pages;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   release_pages
+ *
+ *  Params:     pages - cached pages to release
+ *              size - size of cached pages
+ *              offset - offset of pages in spill file, -1 if pages are in
+ *                       memory
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Unmap cached pages, free file space used by spilled ones.
+ *              In hash mode only whole region can be released
+ *
+ **************************************************************************/
+void release_pages(char *pages, uint64_t size, int64_t offset) {
+    if (hash_shadow) {
+        free(pages);
+        shadow_size -= SHADOW_SIZE(size);
+        return;
+    }
+    munmap(pages, size);
+    if (offset < 0) {
+        shadow_size -= size;
+    } else if (fallocate(spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size)) {
+        DBG("Cannot free space in spill file: %s", strerror(errno));
+    }
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   cache_keyframe
+ *
+ *  Params:     step_id
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Store the whole content of cached memory for the step, so
+ *              records made before the step aren't needed to restore
+ *              memory state for the step and following steps
+ *
+ **************************************************************************/
+void cache_keyframe(uint64_t step_id) {
+    cache_flush();      // keyframe must include pages, changed before the step
+    pthread_mutex_lock(&cache_lock);
+    store_tree(cache, step_id);
+    pthread_mutex_unlock(&cache_lock);
+    DBG("Stored keyframe for step %" PRIu64, step_id);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   store_tree
+ *
+ *  Params:     node - root of region tree
+ *              step_id
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Store cached memory of all regions in the tree, in order
+ *              of addresses. In hash mode memory is read from child and
+ *              hashes get refreshed
+ *
+ **************************************************************************/
+void store_tree(struct region *node, uint64_t step_id) {
+    if (!node) {
+        return;
+    }
+    store_tree(node->left, step_id);
+    if (hash_shadow) {
+        read_region(node->start, node->end - node->start, node->pages, step_id);
+    } else {
+        store_snapshot(node->start, node->pages, node->end - node->start, step_id);
+    }
+    store_tree(node->right, step_id);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   store_snapshot
+ *
+ *  Params:     address - start address of memory (in child memory space),
+ *                        page-aligned
+ *              content - memory content, page-aligned
+ *              size - memory size, multiple of page size
+ *              step_id
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Store the whole memory in DB. Memory is stored as region,
+ *              that hides older content, and non-zero segments, so zero
+ *              memory doesn't need to be stored
+ *
+ **************************************************************************/
+void store_snapshot(uint64_t address, const char *content, uint64_t size, uint64_t step_id) {
+    struct insert_mem_msg *msg = malloc(sizeof(*msg));
+    msg->address = address;
+    msg->step_id = step_id;
+    msg->size = size;
+    msg->region = 1;
+    __atomic_add_fetch(&recorded_bytes, sizeof(*msg), __ATOMIC_RELAXED);
+    ch_write(insert_mem_ch, (char *)msg, sizeof(*msg));    // channel reader will free msg
+
+    for (uint64_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        uint64_t mask[PAGE_SEGMENTS / 64];
+        pagediff(content + offset, zero_page, PAGE_SIZE, mask);
+        store_runs(address + offset, content + offset, mask, NULL, step_id);
+    }
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   store_run
+ *
+ *  Params:     address - start address of memory (in child memory space)
+ *              content - memory content
+ *              size - memory size, no more than MEM_RUN_MAX
+ *              step_id
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Store run of memory segments in DB (by calling worker)
+ *
+ **************************************************************************/
+void store_run(uint64_t address, const char *content, uint64_t size, uint64_t step_id) {
+    /* store memory change event in DB using worker */
+    struct insert_mem_msg *msg = malloc(sizeof(*msg) + size);
+    msg->address = address;
+    msg->step_id = step_id;
+    msg->size = size;
+    msg->region = 0;
+    memcpy(msg->content, content, size);
+    __atomic_add_fetch(&recorded_bytes, sizeof(*msg) + size, __ATOMIC_RELAXED);
+    ch_write(insert_mem_ch, (char *)msg, sizeof(*msg) + size);    // channel reader will free msg
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   proc_dirty_mem
+ *
+ *  Params:     step_id
+ *              tid - thread that made the step
+ *              sp - stack pointer of the thread, 0 if stack window
+ *                   isn't used
+ *              writes - all memory, written since previous step, NULL
+ *                       if it isn't known
+ *              write_count - number of written ranges
+ *
+ *  Return:     1 if stack window has moved and tracking of written pages
+ *              must be reset at next step / 0 if not
+ *
+ *  Descr:      Collect dirty pages from page fault events and pages of
+ *              stack window, read them from child in batches and process,
+ *              using diff workers if there are many pages. In pipelined
+ *              mode pages are only copied, and processed later by
+ *              pipeline thread. If written memory is known, only written
+ *              parts of the pages are read and compared
+ *
+ **************************************************************************/
+int proc_dirty_mem(uint64_t step_id, pid_t tid, uint64_t sp, const struct mem_range *writes, int write_count) {
+    uint64_t *address;
+    size_t size = sizeof(*address);
+
+    /* cached pages must stay in place until they are processed. In pipelined mode cache isn't used here, so
+       there is no need to wait for pipeline thread */
+    if (!pipeline_mem) {
+        pthread_mutex_lock(&cache_lock);
+    }
+
+    /* collect pages, memory of the same page often gets written several times between steps */
+    dirty_count = 0;
+    while (CHANNEL_OK == ch_read(proc_mem_ch, (char **)&address, &size, READ_NONBLOCK)) {
+        DBG("Dirty addr 0x%" PRIx64 " at step %" PRId64, *address, step_id);
+        add_dirty_page(*address);
+        free(address);
+    }
+    if (__atomic_exchange_n(&pages_lost, 0, __ATOMIC_ACQ_REL)) {
+        WARN("Too many pages written before step %" PRId64 ", comparing all memory", step_id);
+        if (pipeline_mem) {
+            pthread_mutex_lock(&cache_lock);    // tree must not change while walking it
+        }
+        add_dirty_tree(cache);
+        if (pipeline_mem) {
+            pthread_mutex_unlock(&cache_lock);
+        }
+    }
+    int moved = 0;
+    if (sp) {
+        struct mem_range ranges[3];
+        int count = move_stack_window(tid, sp, ranges, &moved);
+        for (int i = 0; i < count; i++) {
+            for (uint64_t page = ranges[i].start; page < ranges[i].end; page += PAGE_SIZE) {
+                add_dirty_page(page);
+            }
+        }
+    }
+    if (!dirty_count) {
+        if (!pipeline_mem) {
+            pthread_mutex_unlock(&cache_lock);
+        }
+        return moved;
+    }
+
+    qsort(dirty, dirty_count, sizeof(*dirty), compare_pages);
+    int unique = 1;
+    for (int i = 1; i < dirty_count; i++) {
+        if (dirty[i].address != dirty[unique - 1].address) {
+            dirty[unique++] = dirty[i];
+        }
+    }
+
+    if (pipeline_mem) {
+        capture_pages(unique, step_id);
+        return moved;
+    }
+    if (writes) {
+        unique = process_writes(unique, writes, write_count, step_id);
+    }
+    process_dirty(dirty, unique, 0, step_id);
+    pthread_mutex_unlock(&cache_lock);
+
+    return moved;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   add_dirty_page
+ *
+ *  Params:     address - written address
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Add page to the list of dirty pages of the step. In
+ *              pipelined mode cached page is looked up later
+ *
+ **************************************************************************/
+void add_dirty_page(uint64_t address) {
+    char *cached = NULL;
+    uint64_t page_address = pipeline_mem ? address & ~(PAGE_SIZE - 1) : find_page(address, &cached);
+    if (!page_address) {
+        return;
+    }
+    if (dirty_count == dirty_size) {
+        dirty_size = dirty_size ? dirty_size * 2 : 64;
+        dirty = realloc(dirty, sizeof(*dirty) * dirty_size);
+    }
+    dirty[dirty_count].address = page_address;
+    dirty[dirty_count++].cached = cached;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   add_dirty_tree
+ *
+ *  Params:     node - root of region tree
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Add all pages of all regions in the tree to the list of
+ *              dirty pages
+ *
+ **************************************************************************/
+void add_dirty_tree(struct region *node) {
+    if (!node) {
+        return;
+    }
+    add_dirty_tree(node->left);
+    for (uint64_t page = node->start; page < node->end; page += PAGE_SIZE) {
+        add_dirty_page(page);
+    }
+    add_dirty_tree(node->right);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   cache_lost_pages
+ *
+ *  Params:     N/A
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Report that some written pages were lost, so all memory
+ *              has to be compared at next step. Called from thread that
+ *              reports written pages
+ *
+ **************************************************************************/
+void cache_lost_pages(void) {
+    __atomic_store_n(&pages_lost, 1, __ATOMIC_RELEASE);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   move_stack_window
+ *
+ *  Params:     tid - thread
+ *              sp - stack pointer of the thread
+ *              ranges - where to store stack memory to compare, up to 3
+ *                       ranges
+ *              moved - where to store 1 if window has moved
+ *
+ *  Return:     number of ranges
+ *
+ *  Descr:      Move stack window of the thread to follow stack pointer.
+ *              Memory to compare includes old window, because writes
+ *              there weren't tracked, and pages, left by window at
+ *              previous step. Writes to callers' frames, outside of the
+ *              window, are tracked as any other memory
+ *
+ **************************************************************************/
+int move_stack_window(pid_t tid, uint64_t sp, struct mem_range *ranges, int *moved) {
+    /* page with stack pointer and the next one, where frame of current function most likely is */
+    uint64_t new_start = (sp - STACK_REDZONE) & ~(PAGE_SIZE - 1);
+    uint64_t new_end = (sp + 2 * PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    int count = 0;
+
+    pthread_mutex_lock(&window_lock);
+    int i;
+    for (i = 0; i < window_count && windows[i].tid != tid; i++);
+    if (i == window_count) {
+        windows = realloc(windows, sizeof(*windows) * (window_count + 1));
+        windows[window_count].tid = tid;
+        windows[window_count].start = new_start;
+        windows[window_count].end = new_end;
+        windows[window_count].left_start = windows[window_count].left_end = 0;
+        window_count++;
+        ranges[count].start = new_start;
+        ranges[count++].end = new_end;
+        pthread_mutex_unlock(&window_lock);
+        return count;
+    }
+
+    struct stack_window *window = windows + i;
+    if (window->left_end) {
+        /* tracking has been reset since the window has left these pages, so it is the last time to compare them */
+        ranges[count].start = window->left_start;
+        ranges[count++].end = window->left_end;
+        window->left_start = window->left_end = 0;
+    }
+    ranges[count].start = window->start;
+    ranges[count++].end = window->end;
+    if (new_start >= window->end + STACK_SWITCH || new_end + STACK_SWITCH <= window->start) {
+        /* stack pointer is on different stack, e.g. signal stack, which is tracked as any other memory */
+        pthread_mutex_unlock(&window_lock);
+        return count;
+    }
+    if (new_start != window->start || new_end != window->end) {
+        ranges[count].start = new_start;
+        ranges[count++].end = new_end;
+        /* pages, written while in window, may have no write protection */
+        for (uint64_t page = window->start; page < window->end; page += PAGE_SIZE) {
+            if (page < new_start || page >= new_end) {
+                track_page(page);
+            }
+        }
+        window->left_start = window->start;
+        window->left_end = window->end;
+        window->start = new_start;
+        window->end = new_end;
+        *moved = 1;
+    }
+    pthread_mutex_unlock(&window_lock);
+
+    return count;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   cache_in_stack
+ *
+ *  Params:     address - written address
+ *
+ *  Return:     1 if address is in stack window / 0 if not
+ *
+ *  Descr:      Check if written address is compared on every step, so
+ *              write doesn't need to be tracked
+ *
+ **************************************************************************/
+int cache_in_stack(uint64_t address) {
+    int ret = 0;
+    pthread_mutex_lock(&window_lock);
+    for (int i = 0; i < window_count; i++) {
+        if (address >= windows[i].start && address < windows[i].end) {
+            ret = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&window_lock);
+
+    return ret;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   cache_drop_stack
+ *
+ *  Params:     tid - exited thread
+ *              start - where to store start of window
+ *              end - where to store end of window
+ *
+ *  Return:     1 if thread had stack window / 0 if not
+ *
+ *  Descr:      Remove stack window of the thread. Caller must report
+ *              window pages as written, because their writes weren't
+ *              tracked
+ *
+ **************************************************************************/
+int cache_drop_stack(pid_t tid, uint64_t *start, uint64_t *end) {
+    int ret = 0;
+    pthread_mutex_lock(&window_lock);
+    for (int i = 0; i < window_count; i++) {
+        if (windows[i].tid == tid) {
+            *start = windows[i].start;
+            *end = windows[i].end;
+            /* pages, left by window at last step, may be still not compared after tracking reset */
+            if (windows[i].left_end && windows[i].left_start < *start) {
+                *start = windows[i].left_start;
+            }
+            if (windows[i].left_end > *end) {
+                *end = windows[i].left_end;
+            }
+            windows[i] = windows[--window_count];
+            ret = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&window_lock);
+
+    return ret;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   region_at
+ *
+ *  Params:     address - memory address
+ *
+ *  Return:     region that contains the address / NULL if not found
+ *
+ *  Descr:      Find region by address
+ *
+ **************************************************************************/
+struct region *region_at(uint64_t address) {
+    struct region *node = cache;
+    while (node) {
+        if (address < node->start) {
+            node = node->left;
+        } else if (address >= node->end) {
+            node = node->right;
+        } else {
+            break;
+        }
+    }
+
+    return node;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   region_after
+ *
+ *  Params:     address - memory address
+ *
+ *  Return:     region / NULL if not found
+ *
+ *  Descr:      Find the lowest region that ends after the address, i.e.
+ *              region that contains the address, or the next one
+ *
+ **************************************************************************/
+struct region *region_after(uint64_t address) {
+    struct region *found = NULL;
+    struct region *node = cache;
+    while (node) {
+        if (node->end > address) {
+            found = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+
+    return found;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   tree_insert
+ *
+ *  Params:     node - root of (sub)tree
+ *              new_node - region to insert, it must not overlap with
+ *                         regions in the tree
+ *
+ *  Return:     new root of (sub)tree
+ *
+ *  Descr:      Insert region into the tree
+ *
+ **************************************************************************/
+struct region *tree_insert(struct region *node, struct region *new_node) {
+    if (!node) {
+        new_node->left = new_node->right = NULL;
+        new_node->height = 1;
+        return new_node;
+    }
+    if (new_node->start < node->start) {
+        node->left = tree_insert(node->left, new_node);
+    } else {
+        node->right = tree_insert(node->right, new_node);
+    }
+
+    return tree_balance(node);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   tree_remove
+ *
+ *  Params:     node - root of (sub)tree
+ *              start - start address of region to remove
+ *
+ *  Return:     new root of (sub)tree
+ *
+ *  Descr:      Remove region from the tree, region itself isn't freed
+ *
+ **************************************************************************/
+struct region *tree_remove(struct region *node, uint64_t start) {
+    if (!node) {
+        return NULL;
+    }
+    if (start < node->start) {
+        node->left = tree_remove(node->left, start);
+    } else if (start > node->start) {
+        node->right = tree_remove(node->right, start);
+    } else if (!node->left || !node->right) {
+        return node->left ? node->left : node->right;
+    } else {
+        /* replace node with the lowest region of right subtree */
+        struct region *next = node->right;
+        while (next->left) {
+            next = next->left;
+        }
+        next->right = tree_remove(node->right, next->start);
+        next->left = node->left;
+        node = next;
+    }
+
+    return tree_balance(node);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   tree_balance
+ *
+ *  Params:     node - root of subtree, its children are balanced
+ *
+ *  Return:     new root of subtree
+ *
+ *  Descr:      Update node height and rotate subtree if heights of its
+ *              children differ by more than one
+ *
+ **************************************************************************/
+struct region *tree_balance(struct region *node) {
+    int diff = tree_height(node->left) - tree_height(node->right);
+    if (diff > 1) {
+        if (tree_height(node->left->left) < tree_height(node->left->right)) {
+            node->left = tree_rotate(node->left, 0);
+        }
+        return tree_rotate(node, 1);
+    } else if (diff < -1) {
+        if (tree_height(node->right->right) < tree_height(node->right->left)) {
+            node->right = tree_rotate(node->right, 1);
+        }
+        return tree_rotate(node, 0);
+    }
+    int left = tree_height(node->left);
+    int right = tree_height(node->right);
+    node->height = (left > right ? left : right) + 1;
+
+    return node;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   tree_rotate
+ *
+ *  Params:     node - root of subtree
+ *              right - 1 to rotate right / 0 to rotate left
+ *
+ *  Return:     new root of subtree
+ *
+ *  Descr:      Rotate subtree, child becomes the root
+ *
+ **************************************************************************/
+struct region *tree_rotate(struct region *node, int right) {
+    struct region *child;
+    if (right) {
+        child = node->left;
+        node->left = child->right;
+        child->right = node;
+    } else {
+        child = node->right;
+        node->right = child->left;
+        child->left = node;
+    }
+
+    int left_height = tree_height(node->left);
+    int right_height = tree_height(node->right);
+    node->height = (left_height > right_height ? left_height : right_height) + 1;
+    left_height = tree_height(child->left);
+    right_height = tree_height(child->right);
+    child->height = (left_height > right_height ? left_height : right_height) + 1;
+
+    return child;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   tree_height
+ *
+ *  Params:     node - root of subtree
+ *
+ *  Return:     subtree height
+ *
+ *  Descr:      Get height of (possibly empty) subtree
+ *
+ **************************************************************************/
+int tree_height(struct region *node) {
+    return node ? node->height : 0;
 }
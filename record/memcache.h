@@ -32,8 +32,21 @@
 #include <inttypes.h>
 #include <sys/types.h>
 
+/* memory, written by the step */
+struct mem_range {
+    uint64_t    start;
+    uint64_t    end;
+};
+
 int init_cache(pid_t pid);
 void cache_add_region(uint64_t start, uint64_t size, uint64_t step_id);
-void proc_dirty_mem(uint64_t step_id);
+void cache_remove_region(uint64_t start, uint64_t size);
+void cache_move_region(uint64_t old_start, uint64_t old_size, uint64_t new_start, uint64_t new_size, uint64_t step_id);
+int proc_dirty_mem(uint64_t step_id, pid_t tid, uint64_t sp, const struct mem_range *writes, int write_count);
+void cache_lost_pages(void);
+void cache_keyframe(uint64_t step_id);
+void cache_flush(void);
+int cache_in_stack(uint64_t address);
+int cache_drop_stack(pid_t tid, uint64_t *start, uint64_t *end);
 
 #endif
@@ -31,6 +31,13 @@
 #include <x86intrin.h>
 #include <stdint.h>
 
+#include "mem.h"
+
+/* page diff kernels compare whole segment with single AVX2 instruction, or with two instructions of half size */
+#if MEM_SEGMENT_SIZE != 32
+#error Page diff kernels assume 32-byte memory segments
+#endif
+
 #ifdef __AVX512DQ__
 static int memdiff64(const char *buf1, const char *buf2, size_t size);
 #endif
@@ -42,6 +49,37 @@ static int memdiff16(const char *buf1, const char *buf2, size_t size);
 #endif
 static int memdiff8(const char *buf1, const char *buf2, size_t size);
 
+#ifdef __AVX512DQ__
+static void pagediff64(const char *buf1, const char *buf2, size_t size, uint64_t *mask);
+#endif
+#ifdef __AVX2__
+static void pagediff32(const char *buf1, const char *buf2, size_t size, uint64_t *mask);
+#endif
+#ifdef __SSE2__
+static void pagediff16(const char *buf1, const char *buf2, size_t size, uint64_t *mask);
+#endif
+static void pagediff8(const char *buf1, const char *buf2, size_t size, uint64_t *mask);
+
+#ifdef __AVX512DQ__
+static void hashdiff64(const char *buf, size_t size, uint64_t *hashes, uint64_t *mask);
+#endif
+#ifdef __AVX2__
+static void hashdiff32(const char *buf, size_t size, uint64_t *hashes, uint64_t *mask);
+#endif
+#ifdef __SSE2__
+static void hashdiff16(const char *buf, size_t size, uint64_t *hashes, uint64_t *mask);
+#endif
+static void hashdiff8(const char *buf, size_t size, uint64_t *hashes, uint64_t *mask);
+static inline uint64_t hash_final(const uint64_t *acc);
+static inline uint64_t hash_mix(uint64_t hash);
+
+/* segment hash is similar to XXH3 accumulation - every 8-byte word is mixed with the key, its halves are multiplied,
+   and neighbour word is added to keep the data that multiplication may lose. It needs only 32x32->64 multiplication,
+   available as vector instruction since SSE2, so the same hash is calculated by all implementations */
+static const uint64_t hash_key[4] __attribute__((aligned(32))) = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL
+};
+
 
 /**************************************************************************
  *
@@ -78,6 +116,72 @@ int (* best_memdiff(size_t size))(const char *, const char *, size_t) {
 }
 
 
+/**************************************************************************
+ *
+ *  Function:   best_pagediff
+ *
+ *  Params:
+ *
+ *  Return:     pointer to page comparison function
+ *
+ *  Descr:      Finds most effective implementation of segment-by-segment
+ *              comparison for the CPU
+ *
+ **************************************************************************/
+void (* best_pagediff(void))(const char *, const char *, size_t, uint64_t *) {
+#ifdef __AVX512DQ__
+    if (__builtin_cpu_supports("avx512dq")) {
+        return &pagediff64;
+    }
+#endif
+#ifdef __AVX2__
+    if (__builtin_cpu_supports("avx2")) {
+        return &pagediff32;
+    }
+#endif
+#ifdef __SSE2__
+    if (__builtin_cpu_supports("sse2")) {
+        return &pagediff16;
+    }
+#endif
+
+    return &pagediff8;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   best_hashdiff
+ *
+ *  Params:
+ *
+ *  Return:     pointer to segment hashing function
+ *
+ *  Descr:      Finds most effective implementation of segment hashing for
+ *              the CPU
+ *
+ **************************************************************************/
+void (* best_hashdiff(void))(const char *, size_t, uint64_t *, uint64_t *) {
+#ifdef __AVX512DQ__
+    if (__builtin_cpu_supports("avx512dq")) {
+        return &hashdiff64;
+    }
+#endif
+#ifdef __AVX2__
+    if (__builtin_cpu_supports("avx2")) {
+        return &hashdiff32;
+    }
+#endif
+#ifdef __SSE2__
+    if (__builtin_cpu_supports("sse2")) {
+        return &hashdiff16;
+    }
+#endif
+
+    return &hashdiff8;
+}
+
+
 #define STEP(A) do { \
         size -= (A); \
         buf1 += (A); \
@@ -219,3 +323,317 @@ int memdiff8(const char *buf1, const char *buf2, size_t size) {
 
     return 0;       // buffers are identical
 }
+
+
+/* set bit for segment N without branching. Bits are collected in B and stored into mask M every 64 segments, because
+   updating mask in memory for every segment makes iterations depend on each other */
+#define MARK(M,B,N,C) do { \
+        (B) |= (uint64_t)!!(C) << ((N) % 64); \
+        if (63 == (N) % 64 || (N) + 1 == size / MEM_SEGMENT_SIZE) { \
+            (M)[(N) / 64] = (B); \
+            (B) = 0; \
+        } \
+} while (0)
+
+#ifdef __AVX512DQ__
+/**************************************************************************
+ *
+ *  Function:   pagediff64
+ *
+ *  Params:     buf1 - first buffer (must be aligned to 64-byte boundary)
+ *              buf2 - second buffer (must be aligned to 64-byte boundary)
+ *              size - size of buffers, multiple of 64
+ *              mask - where to store bitmask of changed segments
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Compare memory segments using AVX512 CPU instructions,
+ *              each instruction compares two segments
+ *
+ **************************************************************************/
+void pagediff64(const char *buf1, const char *buf2, size_t size, uint64_t *mask) {
+    uint64_t bits = 0;
+    for (size_t seg = 0; seg < size / MEM_SEGMENT_SIZE; seg += 2) {
+        /* one bit per 8-byte word, lower 4 bits are for first segment, higher 4 bits - for second one */
+        __mmask8 diff = _mm512_cmpneq_epi64_mask(_mm512_load_epi64(buf1), _mm512_load_epi64(buf2));
+        MARK(mask, bits, seg, diff & 0x0F);
+        MARK(mask, bits, seg + 1, diff & 0xF0);
+        buf1 += 64;
+        buf2 += 64;
+    }
+}
+#endif
+
+
+#ifdef __AVX2__
+/**************************************************************************
+ *
+ *  Function:   pagediff32
+ *
+ *  Params:     buf1 - first buffer (must be aligned to 32-byte boundary)
+ *              buf2 - second buffer (must be aligned to 32-byte boundary)
+ *              size - size of buffers, multiple of 32
+ *              mask - where to store bitmask of changed segments
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Compare memory segments using AVX2 CPU instructions
+ *
+ **************************************************************************/
+void pagediff32(const char *buf1, const char *buf2, size_t size, uint64_t *mask) {
+    uint64_t bits = 0;
+    for (size_t seg = 0; seg < size / MEM_SEGMENT_SIZE; seg++) {
+        MARK(mask, bits, seg, (int)0xFFFFFFFF != _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_load_si256((__m256i const *)buf1),
+                _mm256_load_si256((__m256i const *)buf2))));
+        buf1 += 32;
+        buf2 += 32;
+    }
+}
+#endif
+
+
+#ifdef __SSE2__
+/**************************************************************************
+ *
+ *  Function:   pagediff16
+ *
+ *  Params:     buf1 - first buffer (must be aligned to 16-byte boundary)
+ *              buf2 - second buffer (must be aligned to 16-byte boundary)
+ *              size - size of buffers, multiple of 32
+ *              mask - where to store bitmask of changed segments
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Compare memory segments using SSE2 CPU instructions
+ *
+ **************************************************************************/
+void pagediff16(const char *buf1, const char *buf2, size_t size, uint64_t *mask) {
+    uint64_t bits = 0;
+    for (size_t seg = 0; seg < size / MEM_SEGMENT_SIZE; seg++) {
+        __m128i low = _mm_cmpeq_epi8(_mm_load_si128((__m128i const *)buf1),
+                _mm_load_si128((__m128i const *)buf2));
+        __m128i high = _mm_cmpeq_epi8(_mm_load_si128((__m128i const *)(buf1 + 16)),
+                _mm_load_si128((__m128i const *)(buf2 + 16)));
+        MARK(mask, bits, seg, 0xFFFF != _mm_movemask_epi8(_mm_and_si128(low, high)));
+        buf1 += 32;
+        buf2 += 32;
+    }
+}
+#endif
+
+
+/**************************************************************************
+ *
+ *  Function:   pagediff8
+ *
+ *  Params:     buf1 - first buffer
+ *              buf2 - second buffer
+ *              size - size of buffers, multiple of 32
+ *              mask - where to store bitmask of changed segments
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Compare memory segments using 64-bit integer operations
+ *
+ **************************************************************************/
+void pagediff8(const char *buf1, const char *buf2, size_t size, uint64_t *mask) {
+    const uint64_t *one = (const uint64_t *)buf1;
+    const uint64_t *two = (const uint64_t *)buf2;
+
+    uint64_t bits = 0;
+    for (size_t seg = 0; seg < size / MEM_SEGMENT_SIZE; seg++) {
+        MARK(mask, bits, seg, (one[0] ^ two[0]) | (one[1] ^ two[1]) | (one[2] ^ two[2]) | (one[3] ^ two[3]));
+        one += 4;
+        two += 4;
+    }
+}
+
+
+/* store new hash of segment N and mark segment as changed if hash differs from stored one */
+#define UPDATE_HASH(H,M,N,V) do { \
+        uint64_t hash = (V); \
+        if (M) { \
+            MARK(M, bits, N, hash != (H)[N]); \
+        } \
+        (H)[N] = hash; \
+} while (0)
+
+#ifdef __AVX512DQ__
+/**************************************************************************
+ *
+ *  Function:   hashdiff64
+ *
+ *  Params:     buf - buffer (must be aligned to 64-byte boundary)
+ *              size - size of buffer, multiple of 64
+ *              hashes - hashes of buffer segments, updated by function
+ *              mask - where to store bitmask of changed segments, NULL
+ *                     if only hashes are needed
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Hash memory segments using AVX512 CPU instructions, each
+ *              instruction processes two segments
+ *
+ **************************************************************************/
+void hashdiff64(const char *buf, size_t size, uint64_t *hashes, uint64_t *mask) {
+    __m512i key = _mm512_broadcast_i64x4(_mm256_load_si256((__m256i const *)hash_key));
+    uint64_t acc[8] __attribute__((aligned(64)));
+
+    uint64_t bits = 0;
+    for (size_t seg = 0; seg < size / MEM_SEGMENT_SIZE; seg += 2) {
+        __m512i data = _mm512_load_si512(buf);
+        __m512i data_key = _mm512_xor_si512(data, key);
+        __m512i product = _mm512_mul_epu32(data_key, _mm512_srli_epi64(data_key, 32));
+        _mm512_store_si512(acc, _mm512_add_epi64(product, _mm512_shuffle_epi32(data, _MM_PERM_BADC)));
+        UPDATE_HASH(hashes, mask, seg, hash_final(acc));
+        UPDATE_HASH(hashes, mask, seg + 1, hash_final(acc + 4));
+        buf += 64;
+    }
+}
+#endif
+
+
+#ifdef __AVX2__
+/**************************************************************************
+ *
+ *  Function:   hashdiff32
+ *
+ *  Params:     buf - buffer (must be aligned to 32-byte boundary)
+ *              size - size of buffer, multiple of 32
+ *              hashes - hashes of buffer segments, updated by function
+ *              mask - where to store bitmask of changed segments, NULL
+ *                     if only hashes are needed
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Hash memory segments using AVX2 CPU instructions
+ *
+ **************************************************************************/
+void hashdiff32(const char *buf, size_t size, uint64_t *hashes, uint64_t *mask) {
+    __m256i key = _mm256_load_si256((__m256i const *)hash_key);
+    /* words are rotated by 0, 17, 31 and 47 bits before folding, same as in hash_final() */
+    __m256i left = _mm256_set_epi64x(47, 31, 17, 0);
+    __m256i right = _mm256_set_epi64x(17, 33, 47, 64);
+
+    uint64_t bits = 0;
+    for (size_t seg = 0; seg < size / MEM_SEGMENT_SIZE; seg++) {
+        __m256i data = _mm256_load_si256((__m256i const *)buf);
+        __m256i data_key = _mm256_xor_si256(data, key);
+        __m256i product = _mm256_mul_epu32(data_key, _mm256_srli_epi64(data_key, 32));
+        __m256i acc = _mm256_add_epi64(product, _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2)));
+        acc = _mm256_or_si256(_mm256_sllv_epi64(acc, left), _mm256_srlv_epi64(acc, right));
+        __m128i fold = _mm_xor_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        UPDATE_HASH(hashes, mask, seg, hash_mix(_mm_cvtsi128_si64(fold) ^ _mm_extract_epi64(fold, 1)));
+        buf += 32;
+    }
+}
+#endif
+
+
+#ifdef __SSE2__
+/**************************************************************************
+ *
+ *  Function:   hashdiff16
+ *
+ *  Params:     buf - buffer (must be aligned to 16-byte boundary)
+ *              size - size of buffer, multiple of 32
+ *              hashes - hashes of buffer segments, updated by function
+ *              mask - where to store bitmask of changed segments, NULL
+ *                     if only hashes are needed
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Hash memory segments using SSE2 CPU instructions
+ *
+ **************************************************************************/
+void hashdiff16(const char *buf, size_t size, uint64_t *hashes, uint64_t *mask) {
+    __m128i key_low = _mm_load_si128((__m128i const *)hash_key);
+    __m128i key_high = _mm_load_si128((__m128i const *)(hash_key + 2));
+    uint64_t acc[4] __attribute__((aligned(16)));
+
+    uint64_t bits = 0;
+    for (size_t seg = 0; seg < size / MEM_SEGMENT_SIZE; seg++) {
+        __m128i data = _mm_load_si128((__m128i const *)buf);
+        __m128i data_key = _mm_xor_si128(data, key_low);
+        __m128i product = _mm_mul_epu32(data_key, _mm_srli_epi64(data_key, 32));
+        _mm_store_si128((__m128i *)acc, _mm_add_epi64(product, _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2))));
+        data = _mm_load_si128((__m128i const *)(buf + 16));
+        data_key = _mm_xor_si128(data, key_high);
+        product = _mm_mul_epu32(data_key, _mm_srli_epi64(data_key, 32));
+        _mm_store_si128((__m128i *)(acc + 2), _mm_add_epi64(product, _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2))));
+        UPDATE_HASH(hashes, mask, seg, hash_final(acc));
+        buf += 32;
+    }
+}
+#endif
+
+
+/**************************************************************************
+ *
+ *  Function:   hashdiff8
+ *
+ *  Params:     buf - buffer
+ *              size - size of buffer, multiple of 32
+ *              hashes - hashes of buffer segments, updated by function
+ *              mask - where to store bitmask of changed segments, NULL
+ *                     if only hashes are needed
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Hash memory segments using 64-bit integer operations
+ *
+ **************************************************************************/
+void hashdiff8(const char *buf, size_t size, uint64_t *hashes, uint64_t *mask) {
+    const uint64_t *data = (const uint64_t *)buf;
+    uint64_t acc[4];
+
+    uint64_t bits = 0;
+    for (size_t seg = 0; seg < size / MEM_SEGMENT_SIZE; seg++) {
+        for (int i = 0; i < 4; i++) {
+            uint64_t data_key = data[i] ^ hash_key[i];
+            acc[i] = (data_key & 0xFFFFFFFF) * (data_key >> 32) + data[i ^ 1];
+        }
+        UPDATE_HASH(hashes, mask, seg, hash_final(acc));
+        data += 4;
+    }
+}
+
+
+#define ROTL(V,N) (((V) << (N)) | ((V) >> (64 - (N))))
+/**************************************************************************
+ *
+ *  Function:   hash_final
+ *
+ *  Params:     acc - four accumulated words of segment
+ *
+ *  Return:     segment hash
+ *
+ *  Descr:      Fold accumulated words into single hash and mix its bits
+ *
+ **************************************************************************/
+uint64_t hash_final(const uint64_t *acc) {
+    return hash_mix(acc[0] ^ ROTL(acc[1], 17) ^ ROTL(acc[2], 31) ^ ROTL(acc[3], 47));
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   hash_mix
+ *
+ *  Params:     hash - folded hash
+ *
+ *  Return:     segment hash
+ *
+ *  Descr:      Mix hash bits, using MurmurHash3 finaliser
+ *
+ **************************************************************************/
+uint64_t hash_mix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
@@ -4,7 +4,8 @@
  *
  *  Project:    Flight recorder (https://github.com/qrdl/flightrec)
  *
- *  Descr:      Intercept dynamic memory manipulations in tracee
+ *  Descr:      Intercept dynamic memory manipulations in tracee, handle
+ *              breakpoints in-process if tracer asks for it
  *
  *  Notes:      All intercepted calls are sent to tracer via named pipe.
  *              Cannot use printf family of functions because it may call
@@ -36,6 +37,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <pthread.h>
 // for P_tmpdir
 #ifndef __USE_XOPEN
 #define __USE_XOPEN 1
@@ -43,12 +48,27 @@
 #include <stdio.h>
 
 #include "mem.h"
+#include "agent.h"
 
 #define SEND_ERROR_MSG   "Cannot send event: 0x"
 #define OPEN_ERROR_MSG   "Cannot open pipe: 0x"
 #define CREATE_ERROR_MSG "Cannot create pipe: 0x"
+#define AGENT_ERROR_MSG  "Cannot start agent: 0x"
+#define THREAD_ERROR_MSG "Breakpoint is hit by another thread, in-process agent supports only single-threaded programs\n"
 
 int fifo_fd = 0;
+static struct agent_ring *agent;    // shared with tracer, NULL if breakpoints are handled by tracer
+static int publishing;              // agent passes steps to tracer, cleared in forked child
+static uint64_t agent_thread;       // thread pointer of the thread, agent is started in
+static int flushed;                 // final sync is done
+
+static void open_fifo(const char *pidstr);
+static void init_agent(const char *pidstr);
+static void reopen_fifo(void);
+static void trap_handler(int sig, siginfo_t *info, void *context);
+static void fatal_handler(int sig, siginfo_t *info, void *context);
+static void stop_agent(void);
+static void final_sync(void);
 
 /* these functions aren't publicly declared so manually declare it here */
 void* __libc_malloc(size_t);
@@ -174,11 +194,33 @@ static void send_free_event(uint64_t address) {
  *
  **************************************************************************/
 static __attribute__((constructor)) void init(void) {
+    char pidstr[17];
+    int_to_hex_string(getpid(), pidstr);
+
+    open_fifo(pidstr);
+    /* forked child must not send its events to parent's Recorder */
+    pthread_atfork(NULL, NULL, reopen_fifo);
+
+    init_agent(pidstr);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   open_fifo
+ *
+ *  Params:     pidstr - process pid as hex string
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Open named pipe to tracer. If there is no tracer reading
+ *              from the pipe, events aren't sent
+ *
+ **************************************************************************/
+static void open_fifo(const char *pidstr) {
     char fifo_name[256] = "";
     strcpy(fifo_name, P_tmpdir);
     strcat(fifo_name, "/fr_");
-    char pidstr[17];
-    int_to_hex_string(getpid(), pidstr);
     strcat(fifo_name, pidstr);
 
     /* By this time tracer should have already created the pipe, but to be on the
@@ -195,6 +237,7 @@ static __attribute__((constructor)) void init(void) {
 
     fifo_fd = open(fifo_name, O_WRONLY | O_NONBLOCK);
     if (fifo_fd < 0) {
+        fifo_fd = 0;
         write(2, OPEN_ERROR_MSG, sizeof(OPEN_ERROR_MSG)-1);
         char errcode[17];
         int_to_hex_string(errno, errcode);
@@ -205,6 +248,289 @@ static __attribute__((constructor)) void init(void) {
 }
 
 
+/**************************************************************************
+ *
+ *  Function:   reopen_fifo
+ *
+ *  Params:     N/A
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Fork handler - switch forked child to its own pipe. Pipe
+ *              exists only if Recorder follows child processes
+ *
+ **************************************************************************/
+static void reopen_fifo(void) {
+    if (fifo_fd) {
+        close(fifo_fd);
+        fifo_fd = 0;
+    }
+    char pidstr[17];
+    int_to_hex_string(getpid(), pidstr);
+
+    char fifo_name[256] = "";
+    strcpy(fifo_name, P_tmpdir);
+    strcat(fifo_name, "/fr_");
+    strcat(fifo_name, pidstr);
+    if (0 == access(fifo_name, F_OK)) {
+        open_fifo(pidstr);
+    }
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   init_agent
+ *
+ *  Params:     pidstr - process pid as hex string
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Map shared memory, created by tracer, and install SIGTRAP
+ *              handler. If there is no shared memory, tracer handles
+ *              breakpoints itself
+ *
+ **************************************************************************/
+static void init_agent(const char *pidstr) {
+    char shm_name[64] = AGENT_SHM_PREFIX;
+    strcat(shm_name, pidstr);
+
+    int fd = shm_open(shm_name, O_RDWR, 0);
+    if (fd < 0) {
+        return;     // agent isn't requested
+    }
+    struct stat st;
+    if (!fstat(fd, &st)) {
+        void *area = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (MAP_FAILED != area) {
+            agent = area;
+        }
+    }
+    int err = errno;
+    close(fd);
+    if (!agent || AGENT_MAGIC != agent->magic) {
+        agent = NULL;
+        goto error;
+    }
+
+    /* handler must not touch program stack, otherwise tracer sees it as memory change */
+    stack_t stack;
+    stack.ss_sp = AGENT_STACK(agent);
+    stack.ss_size = AGENT_STACK_SIZE;
+    stack.ss_flags = 0;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = trap_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaltstack(&stack, NULL) || sigaction(SIGTRAP, &action, NULL)) {
+        err = errno;
+        goto error;
+    }
+    /* memory, written after the last sync, is read by tracer only if agent asks for it before client terminates */
+    action.sa_sigaction = fatal_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    int fatal[] = { SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL };
+    for (size_t i = 0; i < sizeof(fatal) / sizeof(*fatal); i++) {
+        if (sigaction(fatal[i], &action, NULL)) {
+            err = errno;
+            goto error;
+        }
+    }
+    atexit(final_sync);
+    /* forked child inherits breakpoints and handler, but not the tracer */
+    pthread_atfork(NULL, NULL, stop_agent);
+
+    __asm__ ("mov %%fs:0, %0" : "=r" (agent_thread));
+    publishing = 1;
+    __atomic_store_n(&agent->ready, 1, __ATOMIC_RELEASE);
+    return;
+
+error:
+    write(2, AGENT_ERROR_MSG, sizeof(AGENT_ERROR_MSG)-1);
+    char errcode[17];
+    int_to_hex_string(err, errcode);
+    write(2, errcode, strlen(errcode));
+    char eol = '\n';
+    write(2, &eol, 1);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   trap_handler
+ *
+ *  Params:     sig - signal number
+ *              info - signal info
+ *              context - user context of interrupted code
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Handle breakpoint - pass registers to tracer via ring and
+ *              resume from displaced copy of original instruction. After
+ *              every batch of steps wait for tracer to catch up. Forked
+ *              child only resumes from displaced instruction
+ *
+ **************************************************************************/
+static void trap_handler(int sig, siginfo_t *info, void *context) {
+    (void)info;
+    greg_t *gregs = ((ucontext_t *)context)->uc_mcontext.gregs;
+    uint64_t address = gregs[REG_RIP] - 1;      // RIP points to the instruction after INT 3
+    int saved_errno = errno;
+
+    /* find displaced instruction for the breakpoint using binary search */
+    struct agent_slot *slots = AGENT_SLOTS(agent);
+    uint64_t left = 0, right = agent->slot_count, index;
+    for (index = right / 2; right > left; index = (left + right) / 2) {
+        if (address < slots[index].address) {
+            right = index;
+        } else if (address > slots[index].address) {
+            left = index + 1;
+        } else {
+            break;
+        }
+    }
+    if (left == right) {
+        /* not a breakpoint set by tracer - let default action take place when handler returns */
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+    if (!publishing) {
+        gregs[REG_RIP] = slots[index].slot;
+        return;
+    }
+    /* ring and signal stack are used without any synchronisation, so steps of other threads would corrupt them */
+    uint64_t thread;
+    __asm__ ("mov %%fs:0, %0" : "=r" (thread));
+    if (thread != agent_thread) {
+        write(2, THREAD_ERROR_MSG, sizeof(THREAD_ERROR_MSG)-1);
+        abort();
+    }
+
+    uint64_t seq = agent->seq + 1;
+    struct agent_step *step = AGENT_STEPS(agent) + (seq - 1) % agent->batch;
+    step->seq = seq;
+    step->address = address;
+    /* convert signal context into the format of PTRACE_GETREGS */
+    struct user_regs_struct *regs = &step->regs;
+    regs->r15 = gregs[REG_R15];
+    regs->r14 = gregs[REG_R14];
+    regs->r13 = gregs[REG_R13];
+    regs->r12 = gregs[REG_R12];
+    regs->rbp = gregs[REG_RBP];
+    regs->rbx = gregs[REG_RBX];
+    regs->r11 = gregs[REG_R11];
+    regs->r10 = gregs[REG_R10];
+    regs->r9 = gregs[REG_R9];
+    regs->r8 = gregs[REG_R8];
+    regs->rax = gregs[REG_RAX];
+    regs->rcx = gregs[REG_RCX];
+    regs->rdx = gregs[REG_RDX];
+    regs->rsi = gregs[REG_RSI];
+    regs->rdi = gregs[REG_RDI];
+    regs->orig_rax = -1;
+    regs->rip = gregs[REG_RIP];
+    regs->eflags = gregs[REG_EFL];
+    regs->rsp = gregs[REG_RSP];
+    /* CSGSFS contains cs, gs, fs and ss selectors, 16 bits each */
+    regs->cs = gregs[REG_CSGSFS] & 0xFFFF;
+    regs->gs = (gregs[REG_CSGSFS] >> 16) & 0xFFFF;
+    regs->fs = (gregs[REG_CSGSFS] >> 32) & 0xFFFF;
+    regs->ss = (gregs[REG_CSGSFS] >> 48) & 0xFFFF;
+    regs->ds = 0;
+    regs->es = 0;
+    /* glibc keeps thread pointer at the start of thread control block */
+    __asm__ ("mov %%fs:0, %0" : "=r" (regs->fs_base));
+    regs->gs_base = 0;
+
+    /* publish the step, wake up tracer only if it is waiting */
+    agent->seq = seq;
+    __atomic_store_n(&agent->head, (uint32_t)seq, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&agent->waiting, __ATOMIC_SEQ_CST)) {
+        agent_futex(&agent->head, FUTEX_WAKE, 1, NULL);
+    }
+
+    if (!(seq % agent->batch)) {
+        /* end of batch - wait for tracer to process the memory */
+        uint32_t batch_num = seq / agent->batch;
+        uint32_t released;
+        while ((released = __atomic_load_n(&agent->release, __ATOMIC_ACQUIRE)) != batch_num) {
+            agent_futex(&agent->release, FUTEX_WAIT, released, NULL);
+        }
+    }
+
+    gregs[REG_RIP] = slots[index].slot;
+    errno = saved_errno;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   fatal_handler
+ *
+ *  Params:     sig - signal number
+ *              info - signal info
+ *              context - user context of interrupted code
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Let tracer read memory, written since last sync, before
+ *              client gets terminated by the signal
+ *
+ **************************************************************************/
+static void fatal_handler(int sig, siginfo_t *info, void *context) {
+    (void)info;
+    (void)context;
+    final_sync();
+    /* signal is delivered again when handler returns, now with default action */
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   stop_agent
+ *
+ *  Params:     N/A
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Fork handler - forked child must not pass its steps to
+ *              parent's tracer, it only needs breakpoints to be skipped
+ *
+ **************************************************************************/
+static void stop_agent(void) {
+    publishing = 0;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   final_sync
+ *
+ *  Params:     N/A
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Ask tracer to read memory, written after the last step
+ *              of the batch, and wait for it. Called when client exits or
+ *              crashes
+ *
+ **************************************************************************/
+static void final_sync(void) {
+    if (!publishing || __atomic_exchange_n(&flushed, 1, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    __atomic_store_n(&agent->flush, 1, __ATOMIC_SEQ_CST);
+    agent_futex(&agent->head, FUTEX_WAKE, 1, NULL);     // tracer may wait for steps
+    while (__atomic_load_n(&agent->flush, __ATOMIC_ACQUIRE)) {
+        agent_futex(&agent->flush, FUTEX_WAIT, 1, NULL);
+    }
+}
+
+
 /**************************************************************************
  *
  * Wrappers around standard library functions that call standard functions
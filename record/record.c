@@ -31,6 +31,7 @@
 #include <getopt.h>
 #include <errno.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <libgen.h>
 #include <linux/limits.h>
@@ -41,18 +42,43 @@
 
 #include "flightrec.h"
 #include "record.h"
+#include "reset_dirty.h"
 
 static void print_usage(char *name);
+static char *attach_target(pid_t pid);
+static void add_follow_arg(const char *option, const char *value);
+static void resume_target(void);
 
 FILE            *logfd;
 char            *acceptable_path;
 struct entry    *ignore_unit;
 struct entry    *process_unit;
+int             use_displaced;
+int             use_agent;
+int             lazy_arm;
+uint64_t        window_steps;
+uint64_t        window_bytes;
+uint64_t        start_at;
+uint64_t        stop_at;
+char            *start_spec;
+int             follow;
+int             dirty_method;
+uint64_t        shadow_budget;  // max size of cached client memory, kept in Recorder's memory
+int             hash_shadow;    // cache hashes of client memory instead of its copy
+int             diff_workers;   // number of threads that process dirty pages, including main one
+int             pipeline_mem;   // process dirty pages in background, while client runs
+int             stack_diff;     // compare active part of the stack on every step instead of tracking writes
+int             exact_writes;   // decode lines to compare only memory they write
+char            **follow_argv;  // options to pass to Recorders of child processes
+int             follow_argc;
 
 char *db_name;  // DB file name used by workers
 uid_t real_uid;
 gid_t real_gid;
 
+static pid_t handed_over;   // process, left stopped by parent Recorder
+static uid_t saved_euid;    // effective uid of Recorder, root when it is installed as setuid
+
 /**************************************************************************
  *
  *  Function:   main
@@ -67,13 +93,24 @@ gid_t real_gid;
 int main(int argc, char *argv[]) {
     logfd = stderr;
     int c;
+    pid_t attach_pid = 0;
+    char *stop_spec = NULL, *output = NULL;
+    int resume = 0;
+    static struct option long_options[] = {
+        {"start-at",    required_argument,  NULL,   'S'},
+        {"stop-at",     required_argument,  NULL,   'E'},
+        {"handed-over", no_argument,        NULL,   'F'},    // used when Recorder records child of traced process
+        {NULL,          0,                  NULL,   0}
+    };
 
     real_uid = getuid();
     real_gid = getgid();
+    saved_euid = geteuid();
 
-    while ((c = getopt(argc, argv, "p:x:i:l:")) != -1) {
+    while ((c = getopt_long(argc, argv, "p:x:i:l:ds:zb:a:fo:m:M:Hj:Pwe", long_options, NULL)) != -1) {
         if ('p' == c) {
             acceptable_path = optarg;
+            add_follow_arg("-p", optarg);
         } else if ('l' == c) {
             FILE *tmp = fopen(optarg, "w");
             if (!tmp) {
@@ -85,22 +122,111 @@ int main(int argc, char *argv[]) {
                 return EXIT_FAILURE;
             }
             logfd = tmp;
+        } else if ('d' == c) {
+            use_displaced = 1;
+            add_follow_arg("-d", NULL);
+        } else if ('b' == c) {
+            char *end;
+            uint64_t size = strtoull(optarg, &end, 10);
+            if (!size || (*end && strcmp(end, "M"))) {
+                printf("Invalid black box size '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            if (*end) {
+                window_bytes = size * 1024 * 1024;
+            } else {
+                window_steps = size;
+            }
+            add_follow_arg("-b", optarg);
+        } else if ('a' == c) {
+            attach_pid = atoi(optarg);
+            if (attach_pid <= 0) {
+                printf("Invalid process id '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+        } else if ('S' == c) {
+            start_spec = optarg;
+        } else if ('E' == c) {
+            stop_spec = optarg;
+            add_follow_arg("--stop-at", optarg);
+        } else if ('z' == c) {
+            lazy_arm = 1;
+            add_follow_arg("-z", NULL);
+        } else if ('f' == c) {
+            follow = 1;
+            add_follow_arg("-f", NULL);
+        } else if ('m' == c) {
+            if (!strcmp(optarg, "clear_refs")) {
+                dirty_method = DIRTY_CLEAR_REFS;
+            } else if (!strcmp(optarg, "uffd")) {
+                dirty_method = DIRTY_UFFD;
+            } else if (!strcmp(optarg, "scan")) {
+                dirty_method = DIRTY_SCAN;
+            } else {
+                printf("Invalid memory tracking method '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            add_follow_arg("-m", optarg);
+        } else if ('M' == c) {
+            char *end;
+            shadow_budget = strtoull(optarg, &end, 10) * 1024 * 1024;
+            if (!shadow_budget || *end) {
+                printf("Invalid memory budget '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            add_follow_arg("-M", optarg);
+        } else if ('H' == c) {
+            hash_shadow = 1;
+            add_follow_arg("-H", NULL);
+        } else if ('j' == c) {
+            diff_workers = atoi(optarg);
+            if (diff_workers <= 0) {
+                printf("Invalid number of diff workers '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            add_follow_arg("-j", optarg);
+        } else if ('P' == c) {
+            pipeline_mem = 1;
+            add_follow_arg("-P", NULL);
+        } else if ('w' == c) {
+            stack_diff = 1;
+            add_follow_arg("-w", NULL);
+        } else if ('e' == c) {
+            exact_writes = 1;
+            add_follow_arg("-e", NULL);
+        } else if ('o' == c) {
+            output = optarg;
+        } else if ('F' == c) {
+            resume = 1;
+        } else if ('s' == c) {
+            use_agent = atoi(optarg);
+            if (use_agent <= 0) {
+                printf("Invalid batch size '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            use_displaced = 1;  // agent can only resume from displaced instruction
         } else if ('x' == c) {
             struct entry *tmp = malloc(sizeof(*tmp));
             tmp->name = strdup(optarg);
             tmp->next = ignore_unit;
             ignore_unit = tmp;
+            add_follow_arg("-x", optarg);
         } else if ('i' == c) {
             struct entry *tmp = malloc(sizeof(*tmp));
             tmp->name = strdup(optarg);
             tmp->next = process_unit;
             process_unit = tmp;
+            add_follow_arg("-i", optarg);
         } else {
             if ('-' == optopt) {
                 break;
             }
-            if ('p' == optopt || 'x' == optopt || 'i' == optopt || 'l' == optopt) {
+            if ('p' == optopt || 'x' == optopt || 'i' == optopt || 'l' == optopt ||
+                    's' == optopt || 'b' == optopt || 'a' == optopt || 'o' == optopt || 'm' == optopt ||
+                    'M' == optopt || 'j' == optopt) {
                 printf("Option -%c requires an argument\n", optopt);
+            } else if ('S' == optopt || 'E' == optopt) {
+                printf("Option --%s requires an argument\n", 'S' == optopt ? "start-at" : "stop-at");
             } else {
                 printf("Unknown option %c\n", optopt);
             }
@@ -109,10 +235,63 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (optind == argc) {
+    if (lazy_arm && use_agent) {
+        printf("Lazy breakpoint arming (-z) cannot be used with in-process agent (-s)\n");
+        return EXIT_FAILURE;
+    }
+
+    if ((start_spec || stop_spec) && use_agent) {
+        printf("In-process agent (-s) cannot be used with --start-at/--stop-at\n");
+        return EXIT_FAILURE;
+    }
+
+    if (attach_pid && use_agent) {
+        printf("In-process agent (-s) cannot be used with already running process (-a)\n");
+        return EXIT_FAILURE;
+    }
+
+    if (follow && use_agent) {
+        printf("In-process agent (-s) cannot be used with following child processes (-f)\n");
+        return EXIT_FAILURE;
+    }
+
+    if (hash_shadow && shadow_budget) {
+        printf("Memory budget (-M) cannot be used with hashed memory copy (-H)\n");
+        return EXIT_FAILURE;
+    }
+
+    if (exact_writes && use_agent) {
+        printf("Exact writes (-e) cannot be used with in-process agent (-s)\n");
+        return EXIT_FAILURE;
+    }
+
+    if (exact_writes && pipeline_mem) {
+        printf("Exact writes (-e) cannot be used with pipelined memory processing (-P)\n");
+        return EXIT_FAILURE;
+    }
+
+    if (resume) {
+        /* whatever happens, process must not stay stopped */
+        if (!attach_pid) {
+            printf("Process id (-a) must be specified for process, handed over by parent Recorder\n");
+            return EXIT_FAILURE;
+        }
+        handed_over = attach_pid;
+        atexit(resume_target);
+    }
+
+    char *program;
+    if (attach_pid) {
+        program = attach_target(attach_pid);
+        if (!program) {
+            return EXIT_FAILURE;
+        }
+    } else if (optind == argc) {
         printf("You need to specify binary to process\n");
         print_usage(argv[0]);
         return EXIT_FAILURE;
+    } else {
+        program = argv[optind];
     }
 
     char *cur_path = malloc(PATH_MAX);
@@ -133,23 +312,29 @@ int main(int argc, char *argv[]) {
     }
     INFO("Processing sources under %s", acceptable_path);
 
-    db_name = malloc(strlen(argv[optind]) + sizeof(".fr_heap"));
-    strcpy(db_name, argv[optind]);
-    db_name = basename(db_name);
+    if (output) {
+        db_name = malloc(strlen(output) + sizeof("_heap"));
+        strcpy(db_name, output);
+    } else {
+        db_name = malloc(strlen(program) + sizeof(".fr_heap"));
+        strcpy(db_name, program);
+        db_name = basename(db_name);
+        strcat(db_name, ".fr");
+    }
     char *tail = db_name + strlen(db_name);
 
     /* remove old DBs, including the temp ones that may not be deleted after failed run */
-    strcpy(tail, ".fr_mem");
+    strcpy(tail, "_mem");
     if (remove(db_name) != 0 && ENOENT != errno) {
         ERR("Cannot delete old DB - %s", strerror(errno));
         return EXIT_FAILURE;
     }   
-    strcpy(tail, ".fr_heap");
+    strcpy(tail, "_heap");
     if (remove(db_name) != 0 && ENOENT != errno) {
         ERR("Cannot delete old DB - %s", strerror(errno));
         return EXIT_FAILURE;
     }
-    strcpy(tail, ".fr");
+    *tail = '\0';
     if (remove(db_name) != 0 && ENOENT != errno) {
         ERR("Cannot delete old DB - %s", strerror(errno));
         return EXIT_FAILURE;
@@ -176,13 +361,25 @@ int main(int argc, char *argv[]) {
 
     /* collect source file and line info */
     TIMER_START;
-    if (SUCCESS != dbg_srcinfo(argv[optind])) {
+    if (SUCCESS != dbg_srcinfo(program)) {
         ERR("Cannot process source file and line debug info");
         return EXIT_FAILURE;
     }
     TIMER_STOP("Collection of dbg info");
 
-    if (SUCCESS != record(&argv[optind])) {
+    if (start_spec && SUCCESS != find_trigger(start_spec, &start_at)) {
+        return EXIT_FAILURE;
+    }
+    if (stop_spec && SUCCESS != find_trigger(stop_spec, &stop_at)) {
+        return EXIT_FAILURE;
+    }
+
+    if (attach_pid) {
+        if (SUCCESS != attach(attach_pid, program)) {
+            ERR("Process recording failed");
+            return EXIT_FAILURE;
+        }
+    } else if (SUCCESS != record(&argv[optind])) {
         ERR("Program execution failed");
         return EXIT_FAILURE;
     }
@@ -203,18 +400,182 @@ int main(int argc, char *argv[]) {
  *
  **************************************************************************/
 void print_usage(char *name) {
-    printf("Usage: %s [-l <logfile>] [-p <path>] [-i <unit>] [-x <unit>] -- <program with params>\n",
-            name);
+    printf("Usage: %s [-l <logfile>] [-p <path>] [-i <unit>] [-x <unit>] [-d] [-s <batch>] [-z] "
+            "[-b <size>] [-m <method>] [-M <size>] [-H] [-j <threads>] [-P] [-w] [-e] [-f] [-o <file>] [--start-at <trigger>] [--stop-at <trigger>] -- <program with params>\n", name);
+    printf("       %s [<options>] -a <pid>\n", name);
+    printf("Options --start-at and --stop-at accept either <file>:<line> or <function>\n");
     printf("\t-l <logfile>  - the name of log file, by default stderr\n"
            "\t-p <path>     - specifies the acceptable initial part of path for the\n\t\t\t"
                              "units composing the binary. Units located elsewhere will\n\t\t\t"
                              "be ignored. By default - current directory.\n"
            "\t-i <unit      - name of the compilation unit to include, may occur\n\t\t\tseveral times.\n"
            "\t-x <unit>     - name of the compilation unit to exclude, may occur\n\t\t\tseveral times.\n\t\t\t"
-                             "All -x params are ignored if any number of -i params are specified.\n");
+                             "All -x params are ignored if any number of -i params are specified.\n"
+           "\t-d            - use displaced stepping - execute copies of original\n\t\t\t"
+                             "instructions out of line instead of removing and\n\t\t\t"
+                             "re-inserting breakpoints.\n"
+           "\t-s <batch>    - handle breakpoints in-process by fr_preload.so and\n\t\t\t"
+                             "pass steps via shared memory, implies -d. Memory and\n\t\t\t"
+                             "heap changes are recorded every <batch> steps.\n"
+           "\t-z            - set breakpoints only at function entries, the rest\n\t\t\t"
+                             "of function lines get breakpoints when function is\n\t\t\t"
+                             "called for the first time.\n"
+           "\t-b <size>     - black box mode - keep only last <size> steps, or last\n\t\t\t"
+                             "<size> megabytes of history if followed by 'M'.\n"
+           "\t-a <pid>      - attach to running process and record it until it\n\t\t\t"
+                             "exits or Recorder gets SIGINT/SIGTERM, then detach.\n"
+           "\t-m <method>   - how to detect memory changes - 'clear_refs' (default)\n\t\t\t"
+                             "resets soft-dirty flags of all pages on every step,\n\t\t\t"
+                             "'uffd' write-protects only pages written since\n\t\t\tprevious step, "
+                             "'scan' gets and write-protects\n\t\t\twritten pages with PAGEMAP_SCAN.\n"
+           "\t-M <size>     - keep copy of client memory within <size> megabytes\n\t\t\t"
+                             "of RAM, the rest is kept in temporary file.\n"
+           "\t-H            - keep hashes of client memory instead of its copy,\n\t\t\t"
+                             "uses 4 times less memory but more CPU.\n"
+           "\t-j <threads> - number of threads to find memory changes with, by\n\t\t\t"
+                             "default 1.\n"
+           "\t-P            - copy changed memory and let client continue, while\n\t\t\t"
+                             "changes are found in background.\n"
+           "\t-w            - compare pages of current stack frame on every step\n\t\t\t"
+                             "instead of tracking writes to it.\n"
+           "\t-e            - decode lines to find memory they write, and compare\n\t\t\t"
+                             "only written bytes instead of whole pages.\n"
+           "\t-f            - follow child processes - each forked or executed\n\t\t\t"
+                             "child is recorded into its own file.\n"
+           "\t-o <file>     - name of recording file, by default <program>.fr\n"
+           "\t--start-at <trigger> - run without recording until trigger is hit.\n"
+           "\t--stop-at <trigger>  - stop recording when trigger is hit. Program\n\t\t\t"
+                             "started by Recorder is terminated, attached one\n\t\t\tkeeps running.\n");
 };
 
 
+/**************************************************************************
+ *
+ *  Function:   attach_target
+ *
+ *  Params:     pid - process id
+ *
+ *  Return:     path to process executable / NULL on error
+ *
+ *  Descr:      Get binary of the process to attach to. Recorder runs as
+ *              root, so executable link is read with user's credentials -
+ *              kernel allows it only if user can trace the process.
+ *              Permission is checked again when threads are seized
+ *
+ **************************************************************************/
+char *attach_target(pid_t pid) {
+    char tmp[PATH_MAX];
+    char *exe = malloc(PATH_MAX);
+
+    snprintf(tmp, sizeof(tmp), "/proc/%d/exe", pid);
+    if (SUCCESS != drop_euid()) {
+        free(exe);
+        return NULL;
+    }
+    ssize_t res = readlink(tmp, exe, PATH_MAX - 1);
+    int err = errno;
+    if (SUCCESS != restore_euid()) {
+        free(exe);
+        return NULL;
+    }
+    if (res < 0) {
+        printf("Cannot get executable of process %d - %s\n", pid, strerror(err));
+        free(exe);
+        return NULL;
+    }
+    exe[res] = '\0';
+
+    return exe;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   add_follow_arg
+ *
+ *  Params:     option - command-line option
+ *              value - option value, may be NULL
+ *
+ *  Return:
+ *
+ *  Descr:      Remember option to pass it to Recorders of child processes
+ *
+ **************************************************************************/
+void add_follow_arg(const char *option, const char *value) {
+    follow_argv = realloc(follow_argv, sizeof(*follow_argv) * (follow_argc + 2));
+    follow_argv[follow_argc++] = (char *)option;
+    if (value) {
+        follow_argv[follow_argc++] = (char *)value;
+    }
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   resume_target
+ *
+ *  Params:
+ *
+ *  Return:
+ *
+ *  Descr:      Let the process, handed over by parent Recorder, continue.
+ *              Parent Recorder leaves the child stopped so it doesn't run
+ *              unrecorded until it is attached to
+ *
+ **************************************************************************/
+void resume_target(void) {
+    /* pid comes from command line, so signal it with user's credentials */
+    if (SUCCESS == drop_euid()) {
+        kill(handed_over, SIGCONT);
+        restore_euid();
+    }
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   drop_euid
+ *
+ *  Params:     N/A
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Switch effective uid to the user who runs Recorder, so
+ *              kernel checks permissions (including ptrace ones) as for
+ *              this user, not as for root
+ *
+ **************************************************************************/
+int drop_euid(void) {
+    if (seteuid(real_uid)) {
+        ERR("Cannot switch to user's credentials: %s", strerror(errno));
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   restore_euid
+ *
+ *  Params:     N/A
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Switch effective uid back to Recorder's one
+ *
+ **************************************************************************/
+int restore_euid(void) {
+    if (seteuid(saved_euid)) {
+        ERR("Cannot restore Recorder's credentials: %s", strerror(errno));
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+
 /**************************************************************************
  *
  *  Function:   get_abs_path
@@ -30,6 +30,7 @@
 #define _RECORD_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #include "stingray.h"
@@ -58,6 +59,10 @@ struct entry {
 
 int dbg_srcinfo(char *name);
 int record(char *params[]);
+int attach(pid_t pid, const char *name);
+int find_trigger(const char *spec, uint64_t *address);
+int drop_euid(void);
+int restore_euid(void);
 
 int create_db(void);
 int alter_db(void);
@@ -79,6 +84,24 @@ extern FILE            *logfd;
 extern char            *acceptable_path;
 extern struct entry    *ignore_unit;
 extern struct entry    *process_unit;
+extern int              use_displaced;
+extern int              use_agent;
+extern int              lazy_arm;
+extern uint64_t         window_steps;
+extern uint64_t         window_bytes;
+extern uint64_t         start_at;
+extern uint64_t         stop_at;
+extern char            *start_spec;
+extern int              follow;
+extern int              dirty_method;
+extern uint64_t         shadow_budget;
+extern int              hash_shadow;
+extern int              diff_workers;
+extern int              pipeline_mem;
+extern int              stack_diff;
+extern int              exact_writes;
+extern char           **follow_argv;
+extern int              follow_argc;
 extern int              unit_count;
 extern uid_t            real_uid;
 extern gid_t            real_gid;
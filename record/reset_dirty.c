@@ -8,7 +8,16 @@
  *
  *  Notes:      Counter-intuitively having one thread waiting to be
  *              triggered is significantly cheaper then creating new thread
- *              every time
+ *              every time.
+ *              Instead of soft-dirty flags worker can use userfaultfd
+ *              write protection - only cached memory regions are
+ *              protected, written pages are reported by uffd thread and
+ *              only these pages get protected again. Regions, that cannot
+ *              be protected (e.g. file-backed) use soft-dirty flags.
+ *              With asynchronous write protection kernel resolves write
+ *              faults itself, and written pages are collected and
+ *              protected again by single PAGEMAP_SCAN ioctl per region,
+ *              so neither worker thread nor page fault events are needed
  *
  **************************************************************************
  *
@@ -35,28 +44,113 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+#include <linux/userfaultfd.h>
 
 #include "flightrec.h"
 #include "eel.h"
+#include "inject.h"
 #include "reset_dirty.h"
 
+/* not defined by older headers */
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+#define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+#endif
+#ifndef UFFD_FEATURE_WP_ASYNC
+#define UFFD_FEATURE_WP_ASYNC       (1 << 15)
+#endif
+#ifndef PAGEMAP_SCAN
+#define PAGE_IS_WRITTEN             (1 << 1)
+#define PM_SCAN_WP_MATCHING         (1 << 0)
+#define PM_SCAN_CHECK_WPASYNC       (1 << 1)
+struct page_region {
+    uint64_t    start;
+    uint64_t    end;
+    uint64_t    categories;
+};
+struct pm_scan_arg {
+    uint64_t    size;
+    uint64_t    flags;
+    uint64_t    start;
+    uint64_t    end;
+    uint64_t    walk_end;
+    uint64_t    vec;
+    uint64_t    vec_len;
+    uint64_t    max_pages;
+    uint64_t    category_inverted;
+    uint64_t    category_mask;
+    uint64_t    category_anyof_mask;
+    uint64_t    return_mask;
+};
+#define PAGEMAP_SCAN                _IOWR('f', 16, struct pm_scan_arg)
+#endif
+
+#define SCAN_VEC_LEN                256     // number of page ranges returned by single scan
+
+/* memory region, known to dirty tracking */
+struct dirty_region {
+    uint64_t    start;
+    uint64_t    end;
+    int         protected;      // tracked by uffd, not by soft-dirty flag
+};
+
 static void *reset_dirty(void *);
+static int init_uffd(pid_t pid, pid_t tid, uint64_t features);
+static int init_scan(pid_t pid);
+static int protect_region(uint64_t address, uint64_t size);
+static void *uffd_handler(void *);
+static void protect_pages(void);
 
 static FILE *clear_refs;
 static sem_t start_sem, end_sem;
+static int method;
+static int (*report_page)(uint64_t address);
+
+static int uffd = -1;
+static int pagemap = -1;                // used by PAGEMAP_SCAN
+static struct page_region scan_vec[SCAN_VEC_LEN];
+static int reset_triggered;
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;   // regions are added by BPF thread
+static struct dirty_region *regions;    // sorted by start address
+static int region_count;
+static volatile int refs_dirty;         // page, not protected by uffd, was written
+static pthread_mutex_t pages_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *written_pages;         // pages, reported by uffd since last reset
+static size_t written_count;
+static size_t written_size;
+static uint64_t *protect_list;          // pages to protect during reset
+static size_t protect_size;
+
+#ifdef TIMING
+static uint64_t reset_count;
+static uint64_t protected_count;
+static double reset_time;
+#endif
 
 /**************************************************************************
  *
  *  Function:   start_reset_dirty
  *
- *  Params:     pid
+ *  Params:     pid - pid of the process
+ *              tid - stopped thread, used for creating userfaultfd
+ *              dirty_method - DIRTY_CLEAR_REFS / DIRTY_UFFD / DIRTY_SCAN
+ *              callback - function to call for every page, written by
+ *                         the process, if reported by uffd or scan. It
+ *                         returns 0 if writes to the page don't need to
+ *                         be tracked anymore
  *
  *  Return:     FAILURE / SUCCESS
  *
  *  Descr:      Start the worker thread
  *
  **************************************************************************/
-int start_reset_dirty(pid_t pid) {
+int start_reset_dirty(pid_t pid, pid_t tid, int dirty_method, int (*callback)(uint64_t)) {
     char tmp[256];
     snprintf(tmp, sizeof(tmp), "/proc/%d/clear_refs", pid);
     clear_refs = fopen(tmp, "w");
@@ -64,6 +158,22 @@ int start_reset_dirty(pid_t pid) {
         ERR("Cannot open file '%s': %s", tmp, strerror(errno));
         return FAILURE;
     }
+    method = dirty_method;
+    report_page = callback;
+    if (DIRTY_UFFD == method &&
+            SUCCESS != init_uffd(pid, tid, UFFD_FEATURE_PAGEFAULT_FLAG_WP | UFFD_FEATURE_WP_UNPOPULATED)) {
+        WARN("Cannot use userfaultfd write protection, falling back to soft-dirty flags");
+        method = DIRTY_CLEAR_REFS;
+    }
+    if (DIRTY_SCAN == method && SUCCESS != init_scan(pid)) {
+        WARN("Cannot use PAGEMAP_SCAN, falling back to soft-dirty flags");
+        method = DIRTY_CLEAR_REFS;
+    }
+    if (DIRTY_SCAN == method &&
+            SUCCESS != init_uffd(pid, tid, UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED)) {
+        WARN("Cannot use asynchronous userfaultfd write protection, falling back to soft-dirty flags");
+        method = DIRTY_CLEAR_REFS;
+    }
     if (sem_init(&start_sem, 0, 0)) {
         ERR("Cannot init the semaphoe for BPF thread sync: %s", strerror(errno));
         return FAILURE;
@@ -78,11 +188,196 @@ int start_reset_dirty(pid_t pid) {
         return FAILURE;
     }
     pthread_setname_np(reset_dirty_thread, "fr_dirty");
+    if (DIRTY_UFFD == method) {
+        pthread_t uffd_thread;
+        if (pthread_create(&uffd_thread, NULL, uffd_handler, NULL)) {
+            ERR("Error starting uffd thread: %s", strerror(errno));
+            return FAILURE;
+        }
+        pthread_setname_np(uffd_thread, "fr_uffd");
+    }
     INFO("Reset dirty worker thread started");
     return SUCCESS;
 }
 
 
+/**************************************************************************
+ *
+ *  Function:   add_dirty_region
+ *
+ *  Params:     address - start address of region
+ *              size - region size
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Start tracking writes to memory region. Region gets write
+ *              protection if userfaultfd is used and region supports it
+ *
+ **************************************************************************/
+void add_dirty_region(uint64_t address, uint64_t size) {
+    pthread_mutex_lock(&regions_lock);
+    int index;
+    for (index = 0; index < region_count && regions[index].start <= address; index++);
+    if (!(region_count % 16)) {
+        regions = realloc(regions, sizeof(*regions) * (region_count + 16));
+    }
+    memmove(regions + index + 1, regions + index, sizeof(*regions) * (region_count - index));
+    region_count++;
+    struct dirty_region *region = regions + index;
+    region->start = address;
+    region->end = address + size;
+    region->protected = DIRTY_CLEAR_REFS != method && protect_region(address, size);
+    pthread_mutex_unlock(&regions_lock);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   remove_dirty_region
+ *
+ *  Params:     address - start address of unmapped memory
+ *              size - memory size
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Stop tracking writes to unmapped memory. Kernel removes
+ *              userfaultfd registration on unmap by itself
+ *
+ **************************************************************************/
+void remove_dirty_region(uint64_t address, uint64_t size) {
+    uint64_t end = address + size;
+    pthread_mutex_lock(&regions_lock);
+    for (int index = 0; index < region_count && regions[index].start < end; index++) {
+        struct dirty_region *region = regions + index;
+        if (region->end <= address) {
+            continue;
+        }
+        if (region->start < address && region->end > end) {
+            /* hole in the middle - split the region */
+            if (!(region_count % 16)) {
+                regions = realloc(regions, sizeof(*regions) * (region_count + 16));
+                region = regions + index;
+            }
+            memmove(region + 1, region, sizeof(*regions) * (region_count - index));
+            region_count++;
+            region->end = address;
+            region[1].start = end;
+            break;
+        } else if (region->start < address) {
+            region->end = address;
+        } else if (region->end > end) {
+            region->start = end;
+        } else {
+            memmove(region, region + 1, sizeof(*regions) * (region_count - index - 1));
+            region_count--;
+            index--;
+        }
+    }
+    pthread_mutex_unlock(&regions_lock);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   protect_region
+ *
+ *  Params:     address - start address of region
+ *              size - region size
+ *
+ *  Return:     1 if region is protected / 0 if not
+ *
+ *  Descr:      Register region with userfaultfd and write-protect it
+ *
+ **************************************************************************/
+int protect_region(uint64_t address, uint64_t size) {
+    struct uffdio_register reg = {
+        .range = { .start = address, .len = size },
+        .mode = UFFDIO_REGISTER_MODE_WP
+    };
+    if (ioctl(uffd, UFFDIO_REGISTER, &reg)) {
+        if (DIRTY_SCAN == method) {
+            WARN("Region at 0x%" PRIx64 " cannot be write-protected, its changes aren't recorded: %s", address,
+                    strerror(errno));
+        } else {
+            DBG("Region at 0x%" PRIx64 " cannot be write-protected: %s", address, strerror(errno));
+        }
+        return 0;
+    }
+    struct uffdio_writeprotect wp = {
+        .range = { .start = address, .len = size },
+        .mode = UFFDIO_WRITEPROTECT_MODE_WP
+    };
+    if (ioctl(uffd, UFFDIO_WRITEPROTECT, &wp)) {
+        WARN("Cannot write-protect region at 0x%" PRIx64 ": %s", address, strerror(errno));
+        struct uffdio_range range = { .start = address, .len = size };
+        ioctl(uffd, UFFDIO_UNREGISTER, &range);
+        return 0;
+    }
+    DBG("Region at 0x%" PRIx64 " is write-protected", address);
+
+    return 1;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   check_dirty_fault
+ *
+ *  Params:     address - address of page fault
+ *
+ *  Return:     1 if page fault must be processed / 0 if not
+ *
+ *  Descr:      Check page fault, reported by BPF. Writes to protected
+ *              regions are reported by uffd thread or collected by scan,
+ *              page faults there are of no interest
+ *
+ **************************************************************************/
+int check_dirty_fault(uint64_t address) {
+    if (DIRTY_CLEAR_REFS == method) {
+        return 1;
+    }
+    int left = 0;
+    int right = region_count;
+    int index;
+    for (index = right / 2; right > left; index = (left + right) / 2) {
+        if (address < regions[index].start) {
+            right = index;
+        } else if (address >= regions[index].end) {
+            left = index + 1;
+        } else {
+            break;
+        }
+    }
+    if (left == right) {
+        return 1;               // memory isn't cached, but let the cache decide
+    }
+    if (regions[index].protected) {
+        return 0;
+    }
+    __atomic_store_n(&refs_dirty, 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   need_page_faults
+ *
+ *  Params:     N/A
+ *
+ *  Return:     1 if page faults must be reported / 0 if not
+ *
+ *  Descr:      Tell whether memory changes are detected by page faults.
+ *              Asynchronous write protection can be set for any region,
+ *              and scan finds written pages itself
+ *
+ **************************************************************************/
+int need_page_faults(void) {
+    return DIRTY_SCAN != method;
+}
+
+
 /**************************************************************************
  *
  *  Function:   trigger_reset_dirty
@@ -95,7 +390,9 @@ int start_reset_dirty(pid_t pid) {
  *
  **************************************************************************/
 void trigger_reset_dirty(void) {
-    if (sem_post(&start_sem)) {
+    /* scan protects pages itself, so only soft-dirty flags may need reset */
+    reset_triggered = DIRTY_SCAN != method || __atomic_load_n(&refs_dirty, __ATOMIC_ACQUIRE);
+    if (reset_triggered && sem_post(&start_sem)) {
         ERR("Cannot increment semaphore: %s", strerror(errno));
     }
 }
@@ -113,12 +410,128 @@ void trigger_reset_dirty(void) {
  *
  **************************************************************************/
 void wait_reset_dirty(void) {
-    if (sem_wait(&end_sem)) {
+    if (reset_triggered && sem_wait(&end_sem)) {
         ERR("Cannot decrement semaphore: %s", strerror(errno));
     }
 }
 
 
+/**************************************************************************
+ *
+ *  Function:   collect_dirty_pages
+ *
+ *  Params:     N/A
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Report pages, written since previous call, and protect
+ *              them again, both in one go. Does nothing unless
+ *              PAGEMAP_SCAN is used
+ *
+ **************************************************************************/
+void collect_dirty_pages(void) {
+    if (DIRTY_SCAN != method) {
+        return;
+    }
+#ifdef TIMING
+    struct timespec started, stopped;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &started);
+#endif
+
+    pthread_mutex_lock(&regions_lock);
+    for (int i = 0; i < region_count; i++) {
+        if (!regions[i].protected) {
+            continue;
+        }
+        struct pm_scan_arg arg = {
+            .size = sizeof(arg),
+            .flags = PM_SCAN_WP_MATCHING | PM_SCAN_CHECK_WPASYNC,
+            .start = regions[i].start,
+            .end = regions[i].end,
+            .vec = (uint64_t)scan_vec,
+            .vec_len = SCAN_VEC_LEN,
+            .category_mask = PAGE_IS_WRITTEN,
+            .return_mask = PAGE_IS_WRITTEN
+        };
+        /* if there are more written ranges than fit into vector, scan stops at walk_end */
+        do {
+            int count = ioctl(pagemap, PAGEMAP_SCAN, &arg);
+            if (count < 0) {
+                /* region may be unmapped and its address reused */
+                DBG("Cannot scan region at 0x%" PRIx64 ": %s", regions[i].start, strerror(errno));
+                break;
+            }
+            for (int j = 0; j < count; j++) {
+                for (uint64_t page = scan_vec[j].start; page < scan_vec[j].end; page += PAGE_SIZE) {
+                    report_page(page);
+#ifdef TIMING
+                    protected_count++;
+#endif
+                }
+            }
+            arg.start = arg.walk_end;
+        } while (arg.start < arg.end);
+    }
+    pthread_mutex_unlock(&regions_lock);
+
+#ifdef TIMING
+    clock_gettime(CLOCK_MONOTONIC_RAW, &stopped);
+    reset_time += stopped.tv_sec - started.tv_sec + (stopped.tv_nsec - started.tv_nsec) / 1000000000.0;
+    reset_count++;
+#endif
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   release_dirty_regions
+ *
+ *  Params:     N/A
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Remove write protection before detaching from process,
+ *              otherwise it blocks on the first write to protected page
+ *
+ **************************************************************************/
+void release_dirty_regions(void) {
+    if (DIRTY_CLEAR_REFS == method) {
+        return;
+    }
+    pthread_mutex_lock(&regions_lock);
+    for (int i = 0; i < region_count; i++) {
+        if (regions[i].protected) {
+            struct uffdio_range range = { .start = regions[i].start, .len = regions[i].end - regions[i].start };
+            if (ioctl(uffd, UFFDIO_UNREGISTER, &range) && ENOENT != errno && EINVAL != errno) {
+                ERR("Cannot remove write protection at 0x%" PRIx64 ": %s", regions[i].start, strerror(errno));
+            }
+            regions[i].protected = 0;
+        }
+    }
+    pthread_mutex_unlock(&regions_lock);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   report_reset_dirty
+ *
+ *  Params:     N/A
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Log time spent in resetting, it allows to compare methods
+ *
+ **************************************************************************/
+void report_reset_dirty(void) {
+#ifdef TIMING
+    INFO("Dirty tracking with %s: %" PRIu64 " resets, %" PRIu64 " pages protected, took %.3lf sec",
+            DIRTY_UFFD == method ? "userfaultfd" : DIRTY_SCAN == method ? "PAGEMAP_SCAN" : "clear_refs", reset_count,
+            protected_count, reset_time);
+#endif
+}
+
+
 /**************************************************************************
  *
  *  Function:   reset_dirty
@@ -128,7 +541,8 @@ void wait_reset_dirty(void) {
  *  Return:     NULL
  *
  *  Descr:      Thread function - reset soft-dirty flag for all memory
- *              pages to force page faults on any change
+ *              pages to force page faults on any change, and protect
+ *              pages written since last reset
  *
  **************************************************************************/
 void *reset_dirty(void* unused) {
@@ -141,14 +555,28 @@ void *reset_dirty(void* unused) {
             ERR("Cannot decrement semaphore: %s", strerror(errno));
             return NULL;
         }
+#ifdef TIMING
+        struct timespec started, stopped;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &started);
+#endif
 
         /* actual job */
-        rewind(clear_refs);
-        if (!fwrite(&buf, 1, 1, clear_refs)) {
-            ERR("Cannot write to clear_refs file");
-            return NULL;
+        if (DIRTY_UFFD == method) {
+            protect_pages();
+        }
+        if (DIRTY_CLEAR_REFS == method || __atomic_exchange_n(&refs_dirty, 0, __ATOMIC_ACQ_REL)) {
+            rewind(clear_refs);
+            if (!fwrite(&buf, 1, 1, clear_refs)) {
+                ERR("Cannot write to clear_refs file");
+                return NULL;
+            }
         }
 
+#ifdef TIMING
+        clock_gettime(CLOCK_MONOTONIC_RAW, &stopped);
+        reset_time += stopped.tv_sec - started.tv_sec + (stopped.tv_nsec - started.tv_nsec) / 1000000000.0;
+        reset_count++;
+#endif
         /* signal end of processing */
         if (sem_post(&end_sem)) {
             ERR("Cannot increment semaphore: %s", strerror(errno));
@@ -158,3 +586,337 @@ void *reset_dirty(void* unused) {
 
     return NULL;
 }
+
+
+/**************************************************************************
+ *
+ *  Function:   init_scan
+ *
+ *  Params:     pid - pid of the process
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Open pagemap of the process and check that kernel
+ *              supports PAGEMAP_SCAN (Linux 6.7 and later)
+ *
+ **************************************************************************/
+int init_scan(pid_t pid) {
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "/proc/%d/pagemap", pid);
+    pagemap = open(tmp, O_RDONLY | O_CLOEXEC);
+    if (pagemap < 0) {
+        ERR("Cannot open file '%s': %s", tmp, strerror(errno));
+        return FAILURE;
+    }
+    /* empty range is valid, older kernels don't know the ioctl */
+    struct pm_scan_arg arg = { .size = sizeof(arg), .flags = PM_SCAN_WP_MATCHING | PM_SCAN_CHECK_WPASYNC };
+    if (ioctl(pagemap, PAGEMAP_SCAN, &arg) < 0) {
+        ERR("PAGEMAP_SCAN isn't supported: %s", strerror(errno));
+        close(pagemap);
+        pagemap = -1;
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   init_uffd
+ *
+ *  Params:     pid - pid of the process
+ *              tid - stopped thread
+ *              features - required userfaultfd features
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Create userfaultfd for process memory. It can only be
+ *              created by the process itself, so make the process call
+ *              userfaultfd() and copy the descriptor
+ *
+ **************************************************************************/
+int init_uffd(pid_t pid, pid_t tid, uint64_t features) {
+    uint64_t args[6] = { O_CLOEXEC | O_NONBLOCK, 0, 0, 0, 0, 0 };
+    uint64_t fd;
+    if (SUCCESS != inject_syscall(tid, SYS_userfaultfd, args, &fd)) {
+        return FAILURE;
+    }
+    if ((int64_t)fd < 0) {
+        /* without CAP_SYS_PTRACE or vm.unprivileged_userfaultfd process can only handle user-mode faults, and
+           kernel-mode write to protected page (e.g. by read()) would fail */
+        ERR("Cannot create userfaultfd in child: %s", strerror(-(int64_t)fd));
+        return FAILURE;
+    }
+
+    int ret = SUCCESS;
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0) {
+        ERR("Cannot open pidfd: %s", strerror(errno));
+        RETCLEAN(FAILURE);
+    }
+    uffd = syscall(SYS_pidfd_getfd, pidfd, (int)fd, 0);
+    close(pidfd);
+    if (uffd < 0) {
+        ERR("Cannot get userfaultfd from child: %s", strerror(errno));
+        RETCLEAN(FAILURE);
+    }
+
+    struct uffdio_api api = {
+        .api = UFFD_API,
+        .features = features
+    };
+    if (ioctl(uffd, UFFDIO_API, &api)) {
+        ERR("Userfaultfd write protection isn't supported: %s", strerror(errno));
+        close(uffd);
+        uffd = -1;
+        RETCLEAN(FAILURE);
+    }
+
+cleanup:
+    /* descriptor in child isn't needed anymore, memory context stays with the copy */
+    args[0] = fd;
+    inject_syscall(tid, SYS_close, args, &fd);
+
+    return ret;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   uffd_handler
+ *
+ *  Params:     unused
+ *
+ *  Return:     NULL
+ *
+ *  Descr:      Thread function - report pages written by the process and
+ *              remove write protection from them, so process can continue.
+ *              Pages stay unprotected if their writes don't need tracking
+ *
+ **************************************************************************/
+void *uffd_handler(void *unused) {
+    (void)unused;
+    struct pollfd pfd = { .fd = uffd, .events = POLLIN };
+    struct uffd_msg msg;
+
+    for (;;) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            ERR("Cannot poll userfaultfd: %s", strerror(errno));
+            return NULL;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP)) {
+            return NULL;        // process is gone
+        }
+        while (sizeof(msg) == read(uffd, &msg, sizeof(msg))) {
+            if (UFFD_EVENT_PAGEFAULT != msg.event || !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+                continue;
+            }
+            uint64_t page = msg.arg.pagefault.address & PAGE_MASK;
+            if (report_page(page)) {
+                track_page(page);
+            }
+
+            /* page is reported already, so process can write to it until the next reset */
+            struct uffdio_writeprotect wp = {
+                .range = { .start = page, .len = PAGE_SIZE },
+                .mode = 0
+            };
+            if (ioctl(uffd, UFFDIO_WRITEPROTECT, &wp) && ENOENT != errno) {
+                ERR("Cannot remove write protection at 0x%" PRIx64 ": %s", page, strerror(errno));
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   track_page
+ *
+ *  Params:     address - page address
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Write-protect page at next reset. Page, written while its
+ *              writes weren't tracked, has no write protection and must
+ *              get it back when tracking is needed again
+ *
+ **************************************************************************/
+void track_page(uint64_t address) {
+    if (DIRTY_UFFD != method) {
+        return;     // soft-dirty flags are reset for all pages and PAGEMAP_SCAN protects written pages by itself
+    }
+    pthread_mutex_lock(&pages_lock);
+    if (written_count == written_size) {
+        written_size = written_size ? written_size * 2 : 1024;
+        written_pages = realloc(written_pages, sizeof(*written_pages) * written_size);
+    }
+    written_pages[written_count++] = address;
+    pthread_mutex_unlock(&pages_lock);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   protect_pages
+ *
+ *  Params:     N/A
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Write-protect pages, written since last reset, adjacent
+ *              pages are protected in one go
+ *
+ **************************************************************************/
+void protect_pages(void) {
+    pthread_mutex_lock(&pages_lock);
+    size_t count = written_count;
+    if (count > protect_size) {
+        protect_size = written_size;
+        protect_list = realloc(protect_list, sizeof(*protect_list) * protect_size);
+    }
+    memcpy(protect_list, written_pages, sizeof(*written_pages) * count);
+    written_count = 0;
+    pthread_mutex_unlock(&pages_lock);
+
+    /* pages are reported in order of writing, usually sequential */
+    for (size_t i = 0; i < count; ) {
+        struct uffdio_writeprotect wp = {
+            .range = { .start = protect_list[i], .len = PAGE_SIZE },
+            .mode = UFFDIO_WRITEPROTECT_MODE_WP
+        };
+        for (i++; i < count && protect_list[i] == wp.range.start + wp.range.len; i++) {
+            wp.range.len += PAGE_SIZE;
+        }
+        /* region may be unmapped already */
+        if (ioctl(uffd, UFFDIO_WRITEPROTECT, &wp) && ENOENT != errno && EINVAL != errno) {
+            ERR("Cannot write-protect memory at 0x%" PRIx64 ": %s", (uint64_t)wp.range.start, strerror(errno));
+        }
+    }
+#ifdef TIMING
+    protected_count += count;
+#endif
+}
+
+
+#ifdef UNITTEST
+/* Benchmark of userfaultfd write protection and PAGEMAP_SCAN against clear_refs. Child writes to several pages of big region
+   between breakpoints, tracer resets dirty tracking at every breakpoint. Run as root, build with
+   gcc -DUNITTEST -D_GNU_SOURCE -O2 -I.. reset_dirty.c inject.c -o reset_dirty_test -pthread */
+
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#define REGION_ADDR     0x600000000000ULL
+#define REGION_SIZE     (256ULL * 1024 * 1024)
+#define STEPS           2000
+#define WRITES          16
+
+FILE *logfd;
+static uint64_t reported;
+
+static int count_page(uint64_t address) {
+    (void)address;
+    reported++;
+    return 1;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static int run(int dirty_method) {
+    pid_t pid = fork();
+    if (!pid) {
+        char *mem = mmap((void *)REGION_ADDR, REGION_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (MAP_FAILED == mem) {
+            _exit(EXIT_FAILURE);
+        }
+        memset(mem, 0, REGION_SIZE);
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        for (uint64_t step = 0; step < STEPS; step++) {
+            for (uint64_t i = 0; i < WRITES; i++) {
+                mem[((step * WRITES + i) * 7919 * PAGE_SIZE) % REGION_SIZE]++;
+            }
+            __asm__ volatile ("int3");
+        }
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFSTOPPED(status)) {
+        printf("Child failed to start\n");
+        return FAILURE;
+    }
+    if (SUCCESS != start_reset_dirty(pid, pid, dirty_method, count_page)) {
+        return FAILURE;
+    }
+    add_dirty_region(REGION_ADDR, REGION_SIZE);
+
+    /* total time includes handling of write faults by uffd thread */
+    double total = 0, started = now();
+    for (int step = 0; step < STEPS; step++) {
+        ptrace(PTRACE_CONT, pid, NULL, NULL);
+        waitpid(pid, &status, 0);
+        if (!WIFSTOPPED(status) || SIGTRAP != WSTOPSIG(status)) {
+            printf("Unexpected child status %x\n", status);
+            return FAILURE;
+        }
+        double start = now();
+        collect_dirty_pages();
+        trigger_reset_dirty();
+        wait_reset_dirty();
+        total += now() - start;
+    }
+    double elapsed = now() - started;
+    ptrace(PTRACE_CONT, pid, NULL, NULL);
+    waitpid(pid, &status, 0);
+
+    printf("%-10s: %.2f us per reset, %.2f us per step, %" PRIu64 " pages reported\n",
+            DIRTY_UFFD == method ? "uffd" : DIRTY_SCAN == method ? "scan" : "clear_refs", total * 1000000.0 / STEPS, elapsed * 1000000.0 / STEPS,
+            reported);
+    if (DIRTY_CLEAR_REFS != method && reported != STEPS * WRITES) {
+        printf("Expected %d pages to be reported\n", STEPS * WRITES);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+int main(void) {
+    logfd = stderr;
+    printf("%d steps, %d pages written per step, %llu MB region\n", STEPS, WRITES, REGION_SIZE / 1024 / 1024);
+
+    /* each method needs its own process because tracking state is global */
+    int methods[] = { DIRTY_CLEAR_REFS, DIRTY_UFFD, DIRTY_SCAN };
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (!pid) {
+            exit(SUCCESS == run(methods[i]) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || EXIT_SUCCESS != WEXITSTATUS(status)) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+#endif
@@ -32,8 +32,21 @@
 #include <sys/types.h>
 #include <stdint.h>
 
-int start_reset_dirty(pid_t pid);
+/* methods of dirty page tracking */
+#define DIRTY_CLEAR_REFS    0   // soft-dirty flags, reset for whole process via /proc/<pid>/clear_refs
+#define DIRTY_UFFD          1   // userfaultfd write protection of cached regions
+#define DIRTY_SCAN          2   // asynchronous userfaultfd write protection, written pages are got by PAGEMAP_SCAN
+
+int start_reset_dirty(pid_t pid, pid_t tid, int dirty_method, int (*callback)(uint64_t));
+void add_dirty_region(uint64_t address, uint64_t size);
+void remove_dirty_region(uint64_t address, uint64_t size);
+void track_page(uint64_t address);
+int check_dirty_fault(uint64_t address);
+int need_page_faults(void);
 void trigger_reset_dirty(void);
 void wait_reset_dirty(void);
+void collect_dirty_pages(void);
+void release_dirty_regions(void);
+void report_reset_dirty(void);
 
 #endif
@@ -31,6 +31,7 @@
 #include <sys/wait.h>
 #include <sys/user.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -41,6 +42,9 @@
 #include <inttypes.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <poll.h>
+#include <dirent.h>
+#include <libgen.h>
 // for P_tmpdir
 #ifndef __USE_XOPEN
 #define __USE_XOPEN 1
@@ -60,42 +64,108 @@
 #include "bpf.h"
 #include "db_workers.h"
 #include "reset_dirty.h"
+#include "displaced.h"
+#include "linecache.h"
+#include "agent.h"
+#include "decoder.h"
 
 #ifdef __x86_64__
 #define IP(A)   A.rip
 #define BP(A)   A.rbp
+#define SP(A)   A.rsp
 #else
 #define IP(A)   A.eip
 #define BP(A)   A.ebp
+#define SP(A)   A.esp
 #endif
 
 #define FUNC_FLAG_START     1
 #define FUNC_FLAG_END       2
 
-/* SQLite performance isn't good enough so I use my own cache. Steps within unit are sorted by address so I can
-   approximate the location of needed entry faster than logN */
-struct cached_line {
-    uint64_t    address;
-    uint64_t    func_id;
-    char        func_flag;
-    uint8_t     org_instr_byte;
+/* threads, child processes and new programs, started by traced process, are reported to Recorder */
+#define TRACE_OPTIONS       (PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEEXEC)
+
+/* syscalls return error as value from -4095 to -1 */
+#define IS_ERR_VALUE(A)     ((A) >= (uint64_t)-4095)
+
+/* number of memory keyframes per black box window */
+#define KEYFRAME_COUNT      4
+
+/* lines that write more or longer than that are processed by whole pages */
+#define LINE_WRITES_MAX     16
+#define LINE_CODE_MAX       256
+
+/* memory writes of the line, found by decoding its code. Addresses are calculated from registers at the start of
+   the line, so count is -1 if any write address cannot be found this way */
+struct line_writes {
+    int             count;
+    struct x86_mem  ops[];
 };
-struct cached_unit {
-    uint64_t            start;      // address of first line in unit
-    uint64_t            end;        // address of last line in unit
-    uint64_t            line_count;
-    struct cached_line  *lines;
+
+/* black box window keeps records starting from memory keyframe */
+struct keyframe {
+    uint64_t    step_id;
+    uint64_t    bytes;      // recorded_bytes value before keyframe
+};
+
+/* traced thread of the child. Threads are never removed from the list, exited ones are just marked */
+struct thread {
+    ULONG   id;             // thread number in order of appearance, starting from 1
+    pid_t   tid;
+    ULONG   depth;          // call depth and function of the last step of the thread
+    ULONG   func_id;
+    int     signal;         // signal to deliver when thread is resumed
+    char    started;        // initial stop of new thread is received
+    char    stopped;        // thread is stopped by Recorder and must be resumed
+    char    exited;
+    char    depth_known;    // thread was created while being traced so its depth is counted from 0
+    char    stepped;        // thread has recorded steps
+    char    name[16];       // thread name from /proc/<pid>/task/<tid>/comm
 };
 
+static int trace(pid_t pid, const char *name);
+static struct thread *get_thread(pid_t tid, int create);
+static void switch_thread(struct thread *thread);
+static int next_stop(pid_t pid, pid_t *tid, int *status, REG_TYPE deliver);
+static int wait_child(pid_t *tid, int *status);
+static int stop_threads(pid_t tid);
+static int resume_threads(pid_t tid);
+static int detach(pid_t pid, pid_t tid, int sig);
+static int restore_code(int fd, int disarm);
+static int handle_fork(pid_t child);
+static int hand_over(pid_t child, int exec);
+static int spawn_recorder(pid_t child, int exec);
+static int in_thread_group(pid_t pid, pid_t tid);
+static int trap_pending(pid_t tid);
+static void request_detach(int sig);
+static int set_initial_depth(pid_t tid);
+static int store_threads(void);
+static int in_traced_code(uint64_t address);
+static int arm_breakpoints(void);
+static int set_trigger(uint64_t address);
+static int fire_trigger(void);
+static void *drain_fifo(void *arg);
 static void set_ip(pid_t, REG_TYPE ip);
 static int set_breakpoints(pid_t pid);
-static int process_breakpoint(pid_t pid);
-static struct cached_line *lookup_cache(uint64_t address);
+static int arm_unit(struct cached_unit *unit, uint64_t *displaced, uint64_t *skipped);
+static int arm_function(struct cached_line *line);
+static int set_agent(pid_t pid);
+static int compare_slots(const void *a, const void *b);
+static int run_agent(pid_t pid, int *signum);
+static void final_sync(uint64_t seq);
+static int process_breakpoint(pid_t tid);
+static int process_step(struct user_regs_struct *regs, int sync, struct cached_line **line);
+static int single_thread(void);
+static int line_writes(struct cached_line *line, const struct user_regs_struct *regs, struct mem_range *ranges);
+static struct line_writes *decode_writes(struct cached_line *line);
 static int get_base_address(pid_t p, uint64_t *offset);
 
 static void bpf_callback(void *cookie, void *data, int data_size);
+static int dirty_page(uint64_t address);
+static int move_window(void);
 
 static int fifo_fd = 0;                 // FIFO for receiving alloc/free events from fr_preload.so
+static int mem_fd = -1;                 // child memory, used for setting breakpoints
 static struct channel *insert_step_ch;  // Channel for communicating with step insertion worker
 static struct channel *insert_heap_ch;  // Channel for communicating with heap event insertion worker
 struct channel *insert_mem_ch;          // Channel for communicating with mem insertion worker,
@@ -107,10 +177,51 @@ struct channel *proc_mem_ch;            // Channel for communicating with mem wo
 static uint64_t base_address = 0;
 /* this mutex is used to sync access to cached memory between main loop and bpf_callback() */
 static struct cached_unit *instr_cache;
+static int cached_unit_count;           // units with at least one line, may be less than unit_count
 static volatile char mem_dirty;
 static uint64_t step_id = 0;
 static sem_t bpf_sem;
 static volatile int stop;
+static volatile int bpf_running;
+static int step_traps;                  // number of SIGTRAPs caused by single-stepping rather than breakpoints
+static struct agent_ring *agent;        // shared memory for in-process agent, NULL if agent isn't used
+static size_t agent_size;
+static struct keyframe keyframes[KEYFRAME_COUNT * 2];   // keyframes within black box window, oldest first
+static int keyframe_count;
+uint64_t recorded_bytes;                // approx size of data sent to DB workers, used by black box mode
+uint64_t prune_before;                  // steps before this one are dropped by DB workers in black box mode
+static ULONG depth, func_id;            // call depth and function of the last step of current thread
+static struct thread **threads;         // all threads of the child, in order of appearance
+static int thread_count;
+static struct thread *cur_thread;       // thread of the last step, owns depth and func_id
+static int attached;                    // tracing process that was started elsewhere
+static volatile sig_atomic_t detach_requested;
+static pthread_t main_thread;
+static volatile int triggered;          // start trigger reached, FIFO isn't drained by helper thread anymore
+static int stop_reached;                // stop trigger reached, tracing should stop after this step
+static pid_t *handed;                   // forked children handed over before their fork event was reported
+static int handed_count;
+static struct mem_range writes[LINE_WRITES_MAX];    // memory, written by the line of the last step
+static int write_count = -1;            // -1 if memory, written since the last step, isn't known
+/* general purpose registers in ModRM numbering */
+static const size_t gpr_offsets[] = {
+    offsetof(struct user_regs_struct, rax),
+    offsetof(struct user_regs_struct, rcx),
+    offsetof(struct user_regs_struct, rdx),
+    offsetof(struct user_regs_struct, rbx),
+    offsetof(struct user_regs_struct, rsp),
+    offsetof(struct user_regs_struct, rbp),
+    offsetof(struct user_regs_struct, rsi),
+    offsetof(struct user_regs_struct, rdi),
+    offsetof(struct user_regs_struct, r8),
+    offsetof(struct user_regs_struct, r9),
+    offsetof(struct user_regs_struct, r10),
+    offsetof(struct user_regs_struct, r11),
+    offsetof(struct user_regs_struct, r12),
+    offsetof(struct user_regs_struct, r13),
+    offsetof(struct user_regs_struct, r14),
+    offsetof(struct user_regs_struct, r15),
+};
 
 /**************************************************************************
  *
@@ -133,159 +244,616 @@ int record(char *params[]) {
         /* parent */
         int wait_status;
         waitpid(pid, &wait_status, 0);      // wait for SIGTRAP from child, indicating the exec
-
-        // create temporary FIFO to get info re dynamic memory
-        char fifo_name[256];
-        sprintf(fifo_name, "%s/fr_%X", P_tmpdir, pid);
-        /* there is a race between parent and child in creating the fifo so handle it */
-        if (mkfifo(fifo_name, S_IRUSR | S_IWUSR) && EEXIST != errno) {
-            ERR("Cannot create named pipe: %s", strerror(errno));
+        /* threads, created by child, get traced automatically */
+        if (-1 == ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)TRACE_OPTIONS)) {
+            ERR("Cannot set trace options: %s", strerror(errno));
             return FAILURE;
         }
-        if (chown(fifo_name, real_uid, real_gid)) {
-            ERR("Cannot change pipe ownership: %s", strerror(errno));
-            return EXIT_FAILURE;
-        }
-        fifo_fd = open(fifo_name, O_RDONLY | O_NONBLOCK);
-        if (fifo_fd < 0) {
-            ERR("Cannot open named pipe: %s", strerror(errno));
+        if (SUCCESS != trace(pid, params[0])) {
             return FAILURE;
         }
-
-        // set breakpoints for all known source lines in child process
-        if (SUCCESS != set_breakpoints(pid)) {
-            ERR("Cannot set breakpoints");
-            return FAILURE;
+    } else {
+        /* child */
+        if (setuid(real_uid) || setgid(real_gid)) {
+            ERR("Cannot set ownership for child process: %s", strerror(errno));
+            exit(EXIT_FAILURE);
         }
-        INFO("Tracing %s", params[0]);
-
-        /* Start worker threads  */
-        if (SUCCESS != start_reset_dirty(pid)) {
-            return FAILURE;
+        if (-1 == ptrace(PTRACE_TRACEME, 0, NULL, NULL)) {
+            ERR("Cannot start trace in the child - %s", strerror(errno));
+            exit(EXIT_FAILURE);
         }
-        mem_dirty = 1;
-        START_DB_WORKER(step);
-        START_DB_WORKER(heap);
-        START_DB_WORKER(mem);
+        putenv("LD_PRELOAD=/usr/bin/fr_preload.so");    // preload lib to intercept malloc() etc.
+        execvp(params[0], params);
+        /* get here only in case of exec failure  */
+        ERR("Cannot execute %s - %s", params[0], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    printf("done\n");
+
+    return SUCCESS;
+}
 
-        /* continue to first executable line */
-        if (-1 == ptrace(PTRACE_CONT, pid, NULL, NULL)) {
-            ERR("Cannot start executing child program: %s", strerror(errno));
+
+/**************************************************************************
+ *
+ *  Function:   attach
+ *
+ *  Params:     pid - pid of running process
+ *              name - program name
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Attach to already running process and record it until
+ *              it exits or Recorder gets SIGINT/SIGTERM, in later case
+ *              detach from the process and leave it running
+ *
+ **************************************************************************/
+int attach(pid_t pid, const char *name) {
+    printf("Initialising ... ");
+    fflush(stdout);
+    TIMER_START;
+
+    /* seize all threads, new ones may appear while doing it, so repeat until there are no new threads.
+       Main thread goes first to get number 1 */
+    struct thread *leader = get_thread(pid, 1);
+    char task_dir[64];
+    sprintf(task_dir, "/proc/%d/task", pid);
+    for (int found = 1; found; ) {
+        found = 0;
+        DIR *dir = opendir(task_dir);
+        if (!dir) {
+            ERR("Cannot open directory '%s': %s", task_dir, strerror(errno));
             return FAILURE;
         }
-        waitpid(pid, &wait_status, 0);      // wait for SIGTRAP from child, indicating the breakpoint
-        int signum = WSTOPSIG(wait_status);
-        if (WIFEXITED(wait_status) || SIGTRAP != signum) {
-            ERR("Child exited right after the start");
-            return FAILURE;
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+            pid_t tid = (pid_t)strtol(entry->d_name, NULL, 10);
+            struct thread *thread = get_thread(tid, 0);
+            if (tid <= 0 || (thread && thread->started)) {
+                continue;
+            }
+            /* seize with user's credentials, so kernel checks that user may trace the process (it could have been
+               replaced by another one with the same pid), including Yama restrictions */
+            if (SUCCESS != drop_euid()) {
+                closedir(dir);
+                return FAILURE;
+            }
+            long ret = ptrace(PTRACE_SEIZE, tid, NULL, (void *)TRACE_OPTIONS);
+            int err = errno;
+            if (SUCCESS != restore_euid()) {
+                closedir(dir);
+                return FAILURE;
+            }
+            errno = err;
+            if (-1 == ret) {
+                if (ESRCH == errno) {
+                    continue;   // thread has just exited
+                }
+                ERR("Cannot attach to thread %d: %s", tid, strerror(errno));
+                closedir(dir);
+                return FAILURE;
+            }
+            if (-1 == ptrace(PTRACE_INTERRUPT, tid, NULL, NULL)) {
+                ERR("Cannot stop thread %d: %s", tid, strerror(errno));
+                closedir(dir);
+                return FAILURE;
+            }
+            int wait_status;
+            if (-1 == waitpid(tid, &wait_status, __WALL) || !WIFSTOPPED(wait_status)) {
+                ERR("Thread %d didn't stop", tid);
+                closedir(dir);
+                return FAILURE;
+            }
+            thread = get_thread(tid, 1);
+            thread->started = 1;
+            thread->stopped = 1;
+            found = 1;
         }
+        closedir(dir);
+    }
+    if (!leader->started) {
+        ERR("Cannot attach to process %d", pid);
+        return FAILURE;
+    }
+    attached = 1;
+
+    /* SIGINT/SIGTERM must interrupt waiting for child in main thread, so handler forwards it from other threads */
+    main_thread = pthread_self();
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_detach;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;    // no SA_RESTART
+    if (sigaction(SIGINT, &action, NULL) || sigaction(SIGTERM, &action, NULL)) {
+        ERR("Cannot set signal handler: %s", strerror(errno));
+        return FAILURE;
+    }
+    WARN("Dynamic memory events aren't recorded for attached process");
 
-        /* init memory cache and store initial memory content */
-        if (SUCCESS != init_cache(pid)) {
-            return FAILURE;
-        }
-        if (SUCCESS != process_breakpoint(pid)) {
+    if (SUCCESS != trace(pid, name)) {
+        return FAILURE;
+    }
+    printf("done\n");
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   trace
+ *
+ *  Params:     pid - pid of stopped process to trace
+ *              name - program name
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Set breakpoints, record process activity until it exits
+ *              or tracer detaches from it, and save recorded data
+ *
+ **************************************************************************/
+int trace(pid_t pid, const char *name) {
+    int wait_status;
+
+    // create temporary FIFO to get info re dynamic memory
+    char fifo_name[256];
+    sprintf(fifo_name, "%s/fr_%X", P_tmpdir, pid);
+    /* there is a race between parent and child in creating the fifo so handle it */
+    if (mkfifo(fifo_name, S_IRUSR | S_IWUSR) && EEXIST != errno) {
+        ERR("Cannot create named pipe: %s", strerror(errno));
+        return FAILURE;
+    }
+    if (chown(fifo_name, real_uid, real_gid)) {
+        ERR("Cannot change pipe ownership: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    fifo_fd = open(fifo_name, O_RDONLY | O_NONBLOCK);
+    if (fifo_fd < 0) {
+        ERR("Cannot open named pipe: %s", strerror(errno));
+        return FAILURE;
+    }
+
+    // set breakpoints for all known source lines in child process
+    if (SUCCESS != set_breakpoints(pid)) {
+        ERR("Cannot set breakpoints");
+        return FAILURE;
+    }
+    if (use_agent && SUCCESS != set_agent(pid)) {
+        ERR("Cannot set in-process agent");
+        return FAILURE;
+    }
+    INFO("Tracing %s", name);
+
+    /* heap events before start trigger are of no interest, but FIFO must not get full */
+    pthread_t drain_thread;
+    if (start_at) {
+        if (pthread_create(&drain_thread, NULL, drain_fifo, NULL)) {
+            ERR("Error starting FIFO drain thread: %s", strerror(errno));
             return FAILURE;
         }
+        INFO("Running till start trigger at 0x%" PRIx64, start_at);
+    }
 
-        /* init channel and load BPF programs to monitor page faults, signals and mmap/munmap/brk syscalls
-           Do it after first stop as we need semaphore to be posted starting from step 2 */
-        proc_mem_ch = ch_create();
-        if (!proc_mem_ch) {
+    /* continue to first executable line, attached process may get signals or be stopped before getting there */
+    struct thread *leader = get_thread(pid, 1);
+    if (!attached) {
+        leader->started = 1;
+        leader->stopped = 1;
+        leader->depth_known = !start_at;
+    }
+    if (SUCCESS != resume_threads(0)) {
+        return FAILURE;
+    }
+    pid_t tid = 0;          // thread that has stopped
+    REG_TYPE deliver = 0;   // signal to pass to child when continuing it
+    for (;;) {
+        // wait for SIGTRAP from child, indicating the breakpoint
+        if (SUCCESS != next_stop(pid, &tid, &wait_status, deliver)) {
             return FAILURE;
         }
-        if (sem_init(&bpf_sem, 0, 0)) {
-            ERR("Cannot init the semaphoe for BPF thread sync: %s", strerror(errno));
-            return FAILURE;
+        deliver = 0;
+        if (!WIFSTOPPED(wait_status) || (SIGTRAP == WSTOPSIG(wait_status) && !(wait_status >> 16))) {
+            break;
         }
-        if (SUCCESS != bpf_start(pid, bpf_callback)) {
+        if (PTRACE_EVENT_EXEC == wait_status >> 16) {
+            /* new program opens FIFO with the same name, so it must be gone before the hand over */
+            remove(fifo_name);
+            hand_over(pid, 1);
+            ERR("Child executed another program before reaching any traced line");
             return FAILURE;
         }
-        TIMER_STOP("Initialisation");        
-        printf("process %d is ready to be traced\n", pid);
-        printf("---------- 8< ----------\n");
+        if (wait_status >> 16) {
+            /* ptrace event stop, caused by PTRACE_INTERRUPT */
+            if (!trap_pending(tid)) {
+                detach(pid, tid, 0);
+                ERR("Detached before reaching any traced line");
+                return FAILURE;
+            }
+        } else if (attached || start_at) {
+            deliver = WSTOPSIG(wait_status);
+        } else {
+            break;
+        }
+    }
+    if (start_at) {
+        __atomic_store_n(&triggered, 1, __ATOMIC_RELEASE);
+        pthread_join(drain_thread, NULL);
+    }
+    int signum = WSTOPSIG(wait_status);
+    if (!WIFSTOPPED(wait_status) || SIGTRAP != signum) {
+        ERR(start_at ? "Child exited before reaching the start trigger" : "Child exited right after the start");
+        return FAILURE;
+    }
+    /* other threads may hit breakpoints before BPF program starts counting SIGTRAPs, so keep them stopped until
+       then. Threads, stopped at breakpoint, get back to it to hit it again */
+    if (SUCCESS != stop_threads(tid)) {
+        return FAILURE;
+    }
+    if (start_at && SUCCESS != fire_trigger()) {
+        return FAILURE;
+    }
 
-        TIMER_START;
-        while (-1 != ptrace(PTRACE_CONT, pid, NULL, NULL)) {
-            waitpid(pid, &wait_status, 0);      // wait for SIGTRAP from child, indicating the breakpoint
+    /* Start worker threads  */
+    if (SUCCESS != start_reset_dirty(pid, tid, dirty_method, dirty_page)) {
+        return FAILURE;
+    }
+    mem_dirty = 1;
+    START_DB_WORKER(step, CH_SINGLE_WRITER);
+    START_DB_WORKER(heap, CH_SINGLE_WRITER);
+    START_DB_WORKER(mem, CH_MULTI_WRITER);        // written by main thread, diff workers, pipeline and BPF threads
+    if (agent && !__atomic_load_n(&agent->ready, __ATOMIC_ACQUIRE)) {
+        ERR("Agent isn't running in child, check that fr_preload.so is loaded");
+        return FAILURE;
+    }
+
+    /* init memory cache and store initial memory content */
+    if (SUCCESS != init_cache(pid)) {
+        return FAILURE;
+    }
+    if (SUCCESS != process_breakpoint(tid)) {
+        return FAILURE;
+    }
+
+    /* init channel and load BPF programs to monitor page faults, signals and mmap/munmap/brk syscalls
+       Do it after first stop as we need semaphore to be posted starting from step 2. Channel is written from BPF and
+       uffd threads, they cannot wait for main thread, which may wait for them */
+    proc_mem_ch = ch_create(CH_MULTI_WRITER | CH_NOWAIT);
+    if (!proc_mem_ch) {
+        return FAILURE;
+    }
+    if (sem_init(&bpf_sem, 0, 0)) {
+        ERR("Cannot init the semaphoe for BPF thread sync: %s", strerror(errno));
+        return FAILURE;
+    }
+    /* with PAGEMAP_SCAN page faults aren't needed to detect memory changes */
+    if (SUCCESS != bpf_start(pid, bpf_callback, need_page_faults())) {
+        return FAILURE;
+    }
+    bpf_running = 1;
+    if (SUCCESS != resume_threads(tid)) {
+        return FAILURE;
+    }
+    TIMER_STOP("Initialisation");        
+    printf("process %d is ready to be traced\n", pid);
+    printf("---------- 8< ----------\n");
+
+    TIMER_START;
+    if (agent) {
+        if (SUCCESS != run_agent(pid, &signum)) {
+            return FAILURE;
+        }
+    } else {
+        for (;;) {
+            // wait for SIGTRAP from child, indicating the breakpoint
+            if (SUCCESS != next_stop(pid, &tid, &wait_status, deliver)) {
+                return FAILURE;
+            }
+            deliver = 0;
             if (WIFEXITED(wait_status)) {
                 INFO("child exited");
                 signum = 0;
                 break;                          // child exited ok
             }
+            if (WIFSIGNALED(wait_status)) {
+                signum = WTERMSIG(wait_status);
+                INFO("Child terminated - %s", strsignal(signum));
+                break;
+            }
 
             if (WIFSTOPPED(wait_status)) {
                 signum = WSTOPSIG(wait_status);
+                if (PTRACE_EVENT_EXEC == wait_status >> 16) {
+                    /* new program is recorded separately, if at all */
+                    INFO("Child executed another program");
+                    if (remove(fifo_name)) {
+                        ERR("Cannot remove pipe: %s", strerror(errno));
+                    }
+                    *fifo_name = '\0';
+                    if (SUCCESS != hand_over(pid, 1)) {
+                        return FAILURE;
+                    }
+                    signum = 0;
+                    break;
+                }
+                if (wait_status >> 16) {
+                    /* ptrace event stop, caused by PTRACE_INTERRUPT. If thread has just hit the breakpoint, detach
+                       after processing it, otherwise SIGTRAP gets delivered after detaching */
+                    if (!trap_pending(tid)) {
+                        if (SUCCESS != detach(pid, tid, 0)) {
+                            return FAILURE;
+                        }
+                        signum = 0;
+                        break;
+                    }
+                    continue;
+                }
                 if (SIGTRAP != signum) {
+                    if (detach_requested) {
+                        if (SUCCESS != detach(pid, tid, signum)) {
+                            return FAILURE;
+                        }
+                        signum = 0;
+                        break;
+                    }
+                    if (attached) {
+                        deliver = signum;   // attached process handles its signals as usual
+                        write_count = -1;   // signal handler can write anything
+                        continue;
+                    }
                     INFO("Child stopped - %s", strsignal(signum));
                     break;
                 }
                 /* wait until BPF callback finishes processing */
-                if (sem_wait(&bpf_sem)) {
-                    ERR("Error waiting for condition: %s", strerror(errno));
-                    return FAILURE;
+                while (sem_wait(&bpf_sem)) {
+                    if (EINTR != errno) {
+                        ERR("Error waiting for condition: %s", strerror(errno));
+                        return FAILURE;
+                    }
                 }
-                if (SUCCESS != process_breakpoint(pid)) {
+                if (SUCCESS != process_breakpoint(tid)) {
                     return FAILURE;
                 }
+                if (stop_reached && !attached) {
+                    /* FIFO is closed after recording, so child cannot continue without Recorder */
+                    INFO("Stop trigger reached, terminating child");
+                    kill(pid, SIGKILL);
+                    while (waitpid(-1, &wait_status, __WALL) > 0 || EINTR == errno);   // reap all threads
+                    signum = 0;
+                    break;
+                }
+                if (detach_requested || stop_reached) {
+                    if (SUCCESS != detach(pid, tid, 0)) {
+                        return FAILURE;
+                    }
+                    signum = 0;
+                    break;
+                }
             } else {
                 // TODO: can we get here?
                 ERR("Unsupported wait status %d", wait_status);
                 return FAILURE;
             }
         }
-        stop = 1;
-        TIMER_STOP("Client tracing");
-        printf("---------- 8< ----------\n");
-        printf("Finishing ... ");
-        fflush(stdout);
+    }
+    stop = 1;
+    TIMER_STOP("Client tracing");
+    printf("---------- 8< ----------\n");
+    printf("Finishing ... ");
+    fflush(stdout);
+
+    TIMER_START;
+
+    cache_flush();      // memory changes, still in pipeline, must get to DB worker
+    DAB_CLOSE(DAB_FLAG_NONE);
+    INFO("Waiting for worker threads to finish");
+
+    /* Send termination to workers and wait for workers to finish. Because workers
+       flush data to DB, process them one by one, concurrency can corrupt DB */
+    WAIT_DB_WORKER(step);
+    WAIT_DB_WORKER(heap);
+    WAIT_DB_WORKER(mem);
+    bpf_stop();
+    report_reset_dirty();
+
+    close(fifo_fd);
+    close(mem_fd);
+    if (*fifo_name && remove(fifo_name)) {
+        ERR("Cannot remove pipe: %s", strerror(errno));
+    }
+    if (agent) {
+        char shm_name[64];
+        sprintf(shm_name, AGENT_SHM_PREFIX "%X", pid);
+        munmap(agent, agent_size);
+        if (shm_unlink(shm_name)) {
+            ERR("Cannot remove agent shared memory: %s", strerror(errno));
+        }
+    }
 
-        TIMER_START;
+    /* TODO I don't know why but inserting of signal into DB fails with 'locked', so DB close/open helps */
+    extern char *db_name;
+    if (DAB_OK != DAB_OPEN(db_name, DAB_FLAG_NONE)) {     // already in multi-threaded mode
+        return FAILURE;
+    }
+    if (signum && DAB_OK != DAB_EXEC("INSERT INTO misc (key, value) VALUES ('exit_signal', ?)", signum)) {
+        ERR("Cannot store exit signal in DB");
+    }
+    if (SUCCESS != store_threads()) {
+        ERR("Cannot store threads in DB");
+    }
+    DAB_CLOSE(DAB_FLAG_NONE);
+    TIMER_STOP("Finishing");
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   get_thread
+ *
+ *  Params:     tid - thread id
+ *              create - add thread to the list if it isn't there
+ *
+ *  Return:     thread / NULL if not found
+ *
+ *  Descr:      Find running thread by its id
+ *
+ **************************************************************************/
+struct thread *get_thread(pid_t tid, int create) {
+    if (cur_thread && cur_thread->tid == tid && !cur_thread->exited) {
+        return cur_thread;      // most of the time the same thread stops again
+    }
+    /* thread ids can be reused, so look from the end for the thread that is still running */
+    for (int i = thread_count - 1; i >= 0; i--) {
+        if (threads[i]->tid == tid && !threads[i]->exited) {
+            return threads[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    if (!(thread_count % 16)) {
+        threads = realloc(threads, sizeof(*threads) * (thread_count + 16));
+    }
+    struct thread *thread = calloc(1, sizeof(*thread));
+    thread->id = thread_count + 1;
+    thread->tid = tid;
+    /* thread, created after the start of recording, starts outside of traced code */
+    thread->depth_known = bpf_running;
+    threads[thread_count++] = thread;
+
+    return thread;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   switch_thread
+ *
+ *  Params:     thread - thread that has hit the breakpoint
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Save call depth and function of current thread and load
+ *              ones of new thread
+ *
+ **************************************************************************/
+void switch_thread(struct thread *thread) {
+    if (thread == cur_thread) {
+        return;
+    }
+    if (cur_thread) {
+        cur_thread->depth = depth;
+        cur_thread->func_id = func_id;
+    }
+    depth = thread->depth;
+    func_id = thread->func_id;
+    cur_thread = thread;
+}
 
-        DAB_CLOSE(DAB_FLAG_NONE);
-        INFO("Waiting for worker threads to finish");
 
-        /* Send termination to workers and wait for workers to finish. Because workers
-           flush data to DB, process them one by one, concurrency can corrupt DB */
-        WAIT_DB_WORKER(step);
-        WAIT_DB_WORKER(heap);
-        WAIT_DB_WORKER(mem);
-        bpf_stop();
+/**************************************************************************
+ *
+ *  Function:   next_stop
+ *
+ *  Params:     pid - pid of process being traced
+ *              tid - thread to continue, 0 if none, gets thread that
+ *                    has stopped
+ *              status - where to store wait status
+ *              deliver - signal to deliver to continued thread
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Continue the thread and wait for the stop that needs to be
+ *              processed by the caller - breakpoint, signal, detach
+ *              request or the end of process. Thread creation and exit
+ *              are handled here
+ *
+ **************************************************************************/
+int next_stop(pid_t pid, pid_t *tid, int *status, REG_TYPE deliver) {
+    pid_t cur = *tid;
 
-        close(fifo_fd);
-        if (remove(fifo_name)) {
-            ERR("Cannot remove pipe: %s", strerror(errno));
+    for (;;) {
+        /* thread may be killed while stopped, it will be reported by waitpid() */
+        if (cur && -1 == ptrace(PTRACE_CONT, cur, NULL, (void *)deliver) && ESRCH != errno) {
+            ERR("Cannot continue thread %d: %s", cur, strerror(errno));
+            return FAILURE;
+        }
+        deliver = 0;
+        if (SUCCESS != wait_child(&cur, status)) {
+            return FAILURE;
+        }
+        struct thread *thread = get_thread(cur, 0);
+        if (!thread && WIFSTOPPED(*status) && !in_thread_group(pid, cur)) {
+            /* initial stop of forked child may be reported before fork event */
+            if (SUCCESS != hand_over(cur, 0)) {
+                return FAILURE;
+            }
+            handed = realloc(handed, sizeof(*handed) * (handed_count + 1));
+            handed[handed_count++] = cur;
+            cur = 0;
+            continue;
+        }
+        if (!thread) {
+            thread = get_thread(cur, 1);
         }
 
-        /* TODO I don't know why but inserting of signal into DB fails with 'locked', so DB close/open helps */
-        if (signum) {
-            extern char *db_name;
-            if (DAB_OK != DAB_OPEN(db_name, DAB_FLAG_NONE)) {     // already in multi-threaded mode
+        if (WIFEXITED(*status) || WIFSIGNALED(*status)) {
+            thread->exited = 1;
+            uint64_t start, end;
+            if (stack_diff && cache_drop_stack(cur, &start, &end)) {
+                /* writes to stack window weren't tracked, so process its pages at next step */
+                for (uint64_t page = start; page < end; page += PAGE_SIZE) {
+                    dirty_page(page);
+                    track_page(page);
+                }
+            }
+            if (cur == pid) {
+                break;          // thread group leader is reported last, when whole process is gone
+            }
+            DBG("Thread %d exited", cur);
+            cur = 0;
+            continue;
+        }
+        thread->stopped = 0;
+        if (PTRACE_EVENT_CLONE == *status >> 16) {
+            unsigned long new_tid;
+            if (-1 == ptrace(PTRACE_GETEVENTMSG, cur, NULL, &new_tid)) {
+                ERR("Cannot get new thread id: %s", strerror(errno));
+                return FAILURE;
+            }
+            DBG("Thread %lu created", new_tid);
+            get_thread((pid_t)new_tid, 1);
+            continue;
+        }
+        if (PTRACE_EVENT_FORK == *status >> 16) {
+            unsigned long child;
+            if (-1 == ptrace(PTRACE_GETEVENTMSG, cur, NULL, &child)) {
+                ERR("Cannot get child process id: %s", strerror(errno));
                 return FAILURE;
             }
-            if (DAB_OK != DAB_EXEC("INSERT INTO misc (key, value) VALUES ('exit_signal', ?)", signum)) {
-                ERR("Cannot store exit signal in DB");
+            if (SUCCESS != handle_fork((pid_t)child)) {
+                return FAILURE;
             }
-            DAB_CLOSE(DAB_FLAG_NONE);
+            continue;
         }
-        TIMER_STOP("Finishing");
-    } else {
-        /* child */
-        if (setuid(real_uid) || setgid(real_gid)) {
-            ERR("Cannot set ownership for child process: %s", strerror(errno));
-            exit(EXIT_FAILURE);
+        if (PTRACE_EVENT_EXEC == *status >> 16) {
+            break;              // process image is gone, caller decides what to do
         }
-        if (-1 == ptrace(PTRACE_TRACEME, 0, NULL, NULL)) {
-            ERR("Cannot start trace in the child - %s", strerror(errno));
-            exit(EXIT_FAILURE);
+        if (!thread->started) {
+            /* new thread starts with SIGSTOP, or event stop if process is attached */
+            thread->started = 1;
+            if (*status >> 16 || SIGSTOP == WSTOPSIG(*status)) {
+                continue;
+            }
         }
-        putenv("LD_PRELOAD=/usr/bin/fr_preload.so");    // preload lib to intercept malloc() etc.
-        execvp(params[0], params);
-        /* get here only in case of exec failure  */
-        ERR("Cannot execute %s - %s", params[0], strerror(errno));
-        exit(EXIT_FAILURE);
+        if (*status >> 16 && !detach_requested) {
+            continue;           // group stop or stray PTRACE_INTERRUPT
+        }
+        break;
     }
-    printf("done\n");
+    *tid = cur;
 
     return SUCCESS;
 }
@@ -293,30 +861,615 @@ int record(char *params[]) {
 
 /**************************************************************************
  *
- *  Function:   set_breakpoints
+ *  Function:   wait_child
  *
- *  Params:     pid - pid of process being traced
+ *  Params:     tid - where to store id of thread that changed state
+ *              status - where to store wait status
  *
  *  Return:     SUCCESS / FAILURE
  *
- *  Descr:      Set breakpoints for all known source lines, fill line
- *              cache to be used in process_breakpoint
+ *  Descr:      Wait for state change of any child thread. If waiting is
+ *              interrupted by detach request, stop one of the threads
  *
  **************************************************************************/
-int set_breakpoints(pid_t pid) {
-    int ret = SUCCESS;
-    void *unit_cursor, *line_cursor;
-    REG_TYPE int3 = 0xCC;    // INT 3
-    int db_stat;
-
-    if (DAB_OK != DAB_CURSOR_OPEN(&unit_cursor, "SELECT "
-                "file.unit_id, "
-                "count(*), "
-                "MIN(statement.address) AS start, "
-                "MAX(statement.address) "
-            "FROM "
-                "file "
-                "JOIN statement ON statement.file_id = file.id "
+int wait_child(pid_t *tid, int *status) {
+    while (-1 == (*tid = waitpid(-1, status, __WALL))) {
+        if (EINTR != errno) {
+            ERR("Cannot wait for child: %s", strerror(errno));
+            return FAILURE;
+        }
+        if (!detach_requested) {
+            continue;
+        }
+        /* any stopped thread will do, detach() stops the rest */
+        int i;
+        for (i = 0; i < thread_count; i++) {
+            if (threads[i]->started && !threads[i]->exited &&
+                    0 == ptrace(PTRACE_INTERRUPT, threads[i]->tid, NULL, NULL)) {
+                break;
+            }
+        }
+        if (i == thread_count) {
+            ERR("Cannot stop child: %s", strerror(errno));
+            return FAILURE;
+        }
+    }
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   stop_threads
+ *
+ *  Params:     tid - thread that is stopped already
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Stop all running threads. Thread that has hit the
+ *              breakpoint gets its IP set back to the breakpoint, so
+ *              it hits it again (or executes restored instruction) when
+ *              resumed
+ *
+ **************************************************************************/
+int stop_threads(pid_t tid) {
+    /* attached threads can be interrupted, threads of forked child can only be stopped by signal */
+    for (int i = 0; i < thread_count; i++) {
+        struct thread *thread = threads[i];
+        if (thread->tid == tid || thread->exited || thread->stopped || !thread->started) {
+            continue;
+        }
+        if (attached ? ptrace(PTRACE_INTERRUPT, thread->tid, NULL, NULL) :
+                syscall(SYS_tgkill, threads[0]->tid, thread->tid, SIGSTOP)) {
+            thread->exited = ESRCH == errno;
+        }
+    }
+
+    /* list may grow while threads are stopped */
+    for (int i = 0; i < thread_count; i++) {
+        struct thread *thread = threads[i];
+        if (thread->tid == tid || thread->exited || thread->stopped) {
+            continue;
+        }
+        for (;;) {
+            int status;
+            if (-1 == waitpid(thread->tid, &status, __WALL)) {
+                if (EINTR == errno) {
+                    continue;
+                }
+                ERR("Cannot wait for thread %d: %s", thread->tid, strerror(errno));
+                return FAILURE;
+            }
+            if (WIFEXITED(status) || WIFSIGNALED(status)) {
+                thread->exited = 1;
+                break;
+            }
+            int sig = WSTOPSIG(status);
+            if (PTRACE_EVENT_CLONE == status >> 16) {
+                unsigned long new_tid;
+                if (-1 != ptrace(PTRACE_GETEVENTMSG, thread->tid, NULL, &new_tid)) {
+                    get_thread((pid_t)new_tid, 1);
+                }
+            } else if (PTRACE_EVENT_FORK == status >> 16) {
+                unsigned long child;
+                if (-1 != ptrace(PTRACE_GETEVENTMSG, thread->tid, NULL, &child) &&
+                        SUCCESS != handle_fork((pid_t)child)) {
+                    return FAILURE;
+                }
+            } else if (!thread->started) {
+                thread->started = 1;    // initial stop of new thread
+                break;
+            } else if (status >> 16) {
+                /* interrupt stop is reported before pending SIGTRAP, so get SIGTRAP first */
+                if (!trap_pending(thread->tid)) {
+                    break;
+                }
+            } else if (SIGTRAP == sig) {
+                struct user_regs_struct regs;
+                if (-1 == ptrace(PTRACE_GETREGS, thread->tid, NULL, &regs)) {
+                    ERR("Cannot read thread registers - %s", strerror(errno));
+                    return FAILURE;
+                }
+                if (lc_lookup(IP(regs) - 1 - base_address)) {
+                    set_ip(thread->tid, IP(regs) - 1);
+                } else {
+                    thread->signal = sig;   // not a breakpoint
+                }
+                if (attached) {
+                    break;      // SIGTRAP is dropped when thread is resumed
+                }
+            } else if (SIGSTOP == sig && !attached) {
+                break;
+            } else {
+                thread->signal = sig;   // deliver it when thread is resumed
+                if (attached) {
+                    break;
+                }
+            }
+            /* keep going till expected stop */
+            if (-1 == ptrace(PTRACE_CONT, thread->tid, NULL, NULL) && ESRCH != errno) {
+                ERR("Cannot continue thread %d: %s", thread->tid, strerror(errno));
+                return FAILURE;
+            }
+        }
+        thread->stopped = !thread->exited;
+    }
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   resume_threads
+ *
+ *  Params:     tid - thread to leave stopped, 0 if none
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Continue all threads, stopped by Recorder
+ *
+ **************************************************************************/
+int resume_threads(pid_t tid) {
+    for (int i = 0; i < thread_count; i++) {
+        struct thread *thread = threads[i];
+        if (thread->tid == tid || !thread->stopped) {
+            continue;
+        }
+        if (-1 == ptrace(PTRACE_CONT, thread->tid, NULL, (void *)(REG_TYPE)thread->signal) && ESRCH != errno) {
+            ERR("Cannot continue thread %d: %s", thread->tid, strerror(errno));
+            return FAILURE;
+        }
+        thread->signal = 0;
+        thread->stopped = 0;
+    }
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   detach
+ *
+ *  Params:     pid - pid of process being traced
+ *              tid - stopped thread
+ *              sig - signal to deliver to the thread, 0 if none
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Stop all threads, restore original code and detach from
+ *              the process. Scratch memory with displaced instructions
+ *              stays mapped because process may execute one of them at
+ *              the moment
+ *
+ **************************************************************************/
+int detach(pid_t pid, pid_t tid, int sig) {
+    if (SUCCESS != stop_threads(tid)) {
+        return FAILURE;
+    }
+    if (SUCCESS != restore_code(mem_fd, 1)) {
+        return FAILURE;
+    }
+    release_dirty_regions();
+
+    for (int i = 0; i < thread_count; i++) {
+        struct thread *thread = threads[i];
+        if (thread->exited || (thread->tid != tid && !thread->stopped)) {
+            continue;
+        }
+        if (-1 == ptrace(PTRACE_DETACH, thread->tid, NULL,
+                    (void *)(REG_TYPE)(thread->tid == tid ? sig : thread->signal)) && ESRCH != errno) {
+            ERR("Cannot detach from thread %d: %s", thread->tid, strerror(errno));
+            return FAILURE;
+        }
+    }
+    INFO("Detached from process %d", pid);
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   restore_code
+ *
+ *  Params:     fd - memory file of the process
+ *              disarm - mark lines as not armed
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Put original instructions in place of breakpoints. It is
+ *              used for traced process and for its forked children, which
+ *              get the copy of code with breakpoints, in later case traced
+ *              process keeps its breakpoints
+ *
+ **************************************************************************/
+int restore_code(int fd, int disarm) {
+    for (struct cached_unit *cur_unit = instr_cache; cur_unit < instr_cache + cached_unit_count; cur_unit++) {
+        uint64_t start = cur_unit->start + base_address;
+        size_t size = cur_unit->end - cur_unit->start + 1;
+        char *code = malloc(size);
+        if ((ssize_t)size != pread(fd, code, size, start)) {
+            ERR("Cannot peek at child code - %s", strerror(errno));
+            free(code);
+            return FAILURE;
+        }
+        for (struct cached_line *cur_line = cur_unit->lines; cur_line < cur_unit->lines + cur_unit->line_count;
+                cur_line++) {
+            if (cur_line->armed) {
+                code[cur_line->address + base_address - start] = cur_line->org_instr_byte;
+                if (disarm) {
+                    cur_line->armed = 0;
+                }
+            }
+        }
+        if ((ssize_t)size != pwrite(fd, code, size, start)) {
+            ERR("Cannot update child code - %s", strerror(errno));
+            free(code);
+            return FAILURE;
+        }
+        free(code);
+    }
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   handle_fork
+ *
+ *  Params:     child - pid of new process
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Process fork event - wait for initial stop of child and
+ *              hand it over, unless it was done already
+ *
+ **************************************************************************/
+int handle_fork(pid_t child) {
+    for (int i = 0; i < handed_count; i++) {
+        if (handed[i] == child) {
+            handed[i] = handed[--handed_count];
+            return SUCCESS;
+        }
+    }
+
+    int status;
+    while (-1 == waitpid(child, &status, __WALL)) {
+        if (EINTR != errno) {
+            ERR("Cannot wait for child process %d: %s", child, strerror(errno));
+            return FAILURE;
+        }
+    }
+    if (!WIFSTOPPED(status)) {
+        return SUCCESS;     // killed before it had a chance to run
+    }
+
+    return hand_over(child, 0);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   hand_over
+ *
+ *  Params:     child - stopped process to hand over
+ *              exec - process has executed new program
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Detach from child process (or from the traced process
+ *              that has executed new program) and, if children are
+ *              followed, start new Recorder for it. Process is left
+ *              stopped, new Recorder resumes it when it is ready
+ *
+ **************************************************************************/
+int hand_over(pid_t child, int exec) {
+    if (!exec) {
+        /* forked child would die on inherited breakpoint */
+        char path[64];
+        sprintf(path, "/proc/%d/mem", child);
+        int fd = open(path, O_RDWR);
+        if (fd < 0) {
+            ERR("Cannot open memory of child process %d: %s", child, strerror(errno));
+            return FAILURE;
+        }
+        int ret = restore_code(fd, 0);
+        close(fd);
+        if (SUCCESS != ret) {
+            return FAILURE;
+        }
+    }
+    /* signal cannot be passed with PTRACE_DETACH from event stop, so make it pending */
+    if (follow && kill(child, SIGSTOP)) {
+        ERR("Cannot stop process %d: %s", child, strerror(errno));
+        return FAILURE;
+    }
+    if (-1 == ptrace(PTRACE_DETACH, child, NULL, NULL) && ESRCH != errno) {
+        ERR("Cannot detach from process %d: %s", child, strerror(errno));
+        return FAILURE;
+    }
+    if (!follow) {
+        INFO(exec ? "Program executed by process %d isn't recorded" : "Child process %d isn't recorded", child);
+        return SUCCESS;
+    }
+
+    return spawn_recorder(child, exec);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   spawn_recorder
+ *
+ *  Params:     child - stopped process to record
+ *              exec - process has executed new program
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Start new Recorder that attaches to the process and
+ *              records it into its own file, with the same options as
+ *              this Recorder. Every Recorder has its own workers, FIFO,
+ *              code cache and BPF filter, so they don't interfere.
+ *              Double fork makes new Recorder independent from this one
+ *
+ **************************************************************************/
+int spawn_recorder(pid_t child, int exec) {
+    char output[PATH_MAX], pidstr[16];
+
+    sprintf(pidstr, "%d", child);
+    if (exec) {
+        char path[64], exe[PATH_MAX];
+        sprintf(path, "/proc/%d/exe", child);
+        ssize_t len = readlink(path, exe, sizeof(exe) - 1);
+        if (len < 0) {
+            ERR("Cannot get executable of process %d: %s", child, strerror(errno));
+            kill(child, SIGCONT);
+            return FAILURE;
+        }
+        exe[len] = '\0';
+        snprintf(output, sizeof(output), "%s.%d.fr", basename(exe), child);
+    } else {
+        /* child's recording is named after the parent's one */
+        extern char *db_name;
+        int len = strlen(db_name);
+        if (len > 3 && !strcmp(db_name + len - 3, ".fr")) {
+            len -= 3;
+        }
+        snprintf(output, sizeof(output), "%.*s.%d.fr", len, db_name, child);
+    }
+
+    char **argv = malloc(sizeof(*argv) * (follow_argc + 10));
+    int argc = 0;
+    argv[argc++] = "fr_record";
+    for (int i = 0; i < follow_argc; i++) {
+        argv[argc++] = follow_argv[i];
+    }
+    if (start_at && !__atomic_load_n(&triggered, __ATOMIC_ACQUIRE)) {
+        argv[argc++] = "--start-at";
+        argv[argc++] = start_spec;
+    }
+    argv[argc++] = "--handed-over";
+    argv[argc++] = "-o";
+    argv[argc++] = output;
+    argv[argc++] = "-a";
+    argv[argc++] = pidstr;
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        ERR("Cannot start Recorder for process %d: %s", child, strerror(errno));
+        kill(child, SIGCONT);
+        free(argv);
+        return FAILURE;
+    }
+    if (!pid) {
+        /* intermediate process exits right away, so new Recorder isn't a child of this one */
+        if (fork()) {
+            _exit(EXIT_SUCCESS);
+        }
+        for (int fd = sysconf(_SC_OPEN_MAX) - 1; fd > 2; fd--) {
+            close(fd);
+        }
+        execv("/proc/self/exe", argv);
+        kill(child, SIGCONT);
+        _exit(EXIT_FAILURE);
+    }
+    free(argv);
+    while (-1 == waitpid(pid, NULL, 0) && EINTR == errno);
+    INFO("Process %d is recorded into %s", child, output);
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   in_thread_group
+ *
+ *  Params:     pid - pid of process being traced
+ *              tid - thread id
+ *
+ *  Return:     1 if thread belongs to the process / 0 if not
+ *
+ *  Descr:      Tell new thread from forked child process
+ *
+ **************************************************************************/
+int in_thread_group(pid_t pid, pid_t tid) {
+    char path[64];
+    sprintf(path, "/proc/%d/task/%d", pid, tid);
+
+    return !access(path, F_OK);
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   trap_pending
+ *
+ *  Params:     tid - thread being traced
+ *
+ *  Return:     1 if thread has pending SIGTRAP / 0 if not
+ *
+ *  Descr:      Check whether thread has hit the breakpoint but SIGTRAP
+ *              isn't reported yet because PTRACE_INTERRUPT stop is
+ *              reported first
+ *
+ **************************************************************************/
+int trap_pending(pid_t tid) {
+    char tmp[256];
+    uint64_t pending = 0;
+
+    snprintf(tmp, sizeof(tmp), "/proc/%d/status", tid);
+    FILE *status = fopen(tmp, "r");
+    if (!status) {
+        ERR("Cannot open file '%s': %s", tmp, strerror(errno));
+        return 0;
+    }
+    while (fgets(tmp, sizeof(tmp), status)) {
+        if (1 == sscanf(tmp, "SigPnd: %" SCNx64, &pending)) {
+            break;
+        }
+    }
+    fclose(status);
+
+    return !!(pending & (1ULL << (SIGTRAP - 1)));
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   request_detach
+ *
+ *  Params:     sig - signal number
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      SIGINT/SIGTERM handler - ask main loop to detach from the
+ *              process. Signal may be delivered to any thread, but only
+ *              in main thread it interrupts waiting for the child
+ *
+ **************************************************************************/
+void request_detach(int sig) {
+    detach_requested = 1;
+    if (!pthread_equal(pthread_self(), main_thread)) {
+        pthread_kill(main_thread, sig);
+    }
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   set_initial_depth
+ *
+ *  Params:     tid - thread being traced
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Thread stopped at its first breakpoint may be deep in the call
+ *              stack, so count traced functions in the stack by following
+ *              frame pointers
+ *
+ **************************************************************************/
+int set_initial_depth(pid_t tid) {
+    struct user_regs_struct regs;
+    if (-1 == ptrace(PTRACE_GETREGS, tid, NULL, &regs)) {
+        ERR("Cannot read process registers - %s", strerror(errno));
+        return FAILURE;
+    }
+    struct cached_line *line = lc_lookup(IP(regs) - 1 - base_address);
+    if (!line) {
+        WARN("Cannot find statement for address 0x%" PRIx64, (uint64_t)IP(regs) - 1 - base_address);
+        return FAILURE;
+    }
+
+    ULONG frames = 0;
+    REG_TYPE ret_addr;
+    if (FUNC_FLAG_START == line->func_flag) {
+        /* frame isn't set up yet, return address is on top of the stack */
+        errno = 0;
+        ret_addr = ptrace(PTRACE_PEEKDATA, tid, (void *)SP(regs), NULL);
+        if (!errno && in_traced_code(ret_addr)) {
+            frames++;
+        }
+    }
+    for (REG_TYPE frame = BP(regs); frame; ) {
+        errno = 0;  // PTRACE_PEEKDATA can return anything, even -1, so use only errno for diag
+        ret_addr = ptrace(PTRACE_PEEKDATA, tid, (void *)(frame + sizeof(REG_TYPE)), NULL);
+        REG_TYPE next = ptrace(PTRACE_PEEKDATA, tid, (void *)frame, NULL);
+        if (errno) {
+            break;
+        }
+        if (in_traced_code(ret_addr)) {
+            frames++;
+        }
+        if (next <= frame) {
+            break;      // stack grows down, so caller's frame must be above
+        }
+        frame = next;
+    }
+
+    /* function entry increments the depth when step is processed */
+    depth = FUNC_FLAG_START == line->func_flag ? frames : frames + 1;
+    INFO("Initial call depth of thread %d is %" PRIu64, tid, (uint64_t)depth);
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   in_traced_code
+ *
+ *  Params:     address - code address
+ *
+ *  Return:     1 if address belongs to traced unit / 0 if not
+ *
+ *  Descr:      Check if address is within one of traced units
+ *
+ **************************************************************************/
+int in_traced_code(uint64_t address) {
+    address -= base_address;
+    for (struct cached_unit *cur_unit = instr_cache; cur_unit < instr_cache + cached_unit_count; cur_unit++) {
+        if (address >= cur_unit->start && address <= cur_unit->end) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   set_breakpoints
+ *
+ *  Params:     pid - pid of process being traced
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Set breakpoints for all known source lines, fill line
+ *              cache to be used in process_breakpoint. If displaced
+ *              stepping is used, create displaced instructions as well
+ *
+ **************************************************************************/
+int set_breakpoints(pid_t pid) {
+    int ret = SUCCESS;
+    void *unit_cursor, *line_cursor;
+    int db_stat;
+    uint64_t line_count = 0;
+
+    if (DAB_OK != DAB_CURSOR_OPEN(&unit_cursor, "SELECT "
+                "file.unit_id, "
+                "count(*), "
+                "MIN(statement.address) AS start, "
+                "MAX(statement.address) "
+            "FROM "
+                "file "
+                "JOIN statement ON statement.file_id = file.id "
             "GROUP BY "
                 "file.unit_id "
             "ORDER BY "
@@ -341,7 +1494,6 @@ int set_breakpoints(pid_t pid) {
     instr_cache = malloc(sizeof(*instr_cache) * unit_count);
 
     uint64_t unit_id;
-    REG_TYPE instr;
     for (   struct cached_unit *cur_unit = instr_cache;
             DAB_OK == (db_stat = DAB_CURSOR_FETCH(  unit_cursor,
                                                     &unit_id,
@@ -360,119 +1512,632 @@ int set_breakpoints(pid_t pid) {
                                                         &cur_line->func_id,
                                                         &cur_line->func_flag));
                 cur_line++) {
-            errno = 0;  // PTRACE_PEEKDATA can return anything, even -1, so use only errno for diag
-            instr = ptrace(PTRACE_PEEKDATA, pid, (void *)(cur_line->address + base_address), NULL);
-            if (errno) {
-                if ((EIO == errno || EFAULT == errno) && !base_address) {
-                    /* may fail because address needs to be adjusted by base address */
-                    if (SUCCESS != get_base_address(pid, &base_address)) {
-                        RETCLEAN(FAILURE);
-                    }
-                    if (!base_address) {
-                        ERR("Cannot peek at child code (base addr is zero) - %s", strerror(errno));
-                        RETCLEAN(FAILURE);
-                    }
-                    /* save base address for further use by Examine */
-                    if (DAB_OK != DAB_EXEC("INSERT INTO misc (key, value) VALUES ('base_address', ?)", base_address)) {
-                        ERR("Cannot update unit base address");
-                        RETCLEAN(FAILURE);
-                    }
-                    // repeat the attempt with non-zero base_address
-                    errno = 0;  // PTRACE_PEEKDATA can return anything, even -1, so use only errno for diag
-                    instr = ptrace(PTRACE_PEEKDATA, pid, (void *)(cur_line->address + base_address), NULL);
-                    if (errno) {
-                        ERR("Cannot peek at child code - %s", strerror(errno));
-                        RETCLEAN(FAILURE);
-                    }
-                } else {
-                    ERR("Cannot peek at child code - %s", strerror(errno));
-                    RETCLEAN(FAILURE);
-                }
-            }
-            cur_line->org_instr_byte = instr & 0xFF;
-            /* update child code */
-            instr = (instr & ~0xFF) | int3;
-            if (-1 == ptrace(PTRACE_POKEDATA, pid, (void *)(cur_line->address + base_address), (void *)instr)) {
-                ERR("Cannot update child code - %s", strerror(errno));
-                RETCLEAN(FAILURE);
-            }
-            DBG("Set breakpoint at 0x%" PRIx64, cur_line->address);
+            cur_line->armed = 0;
+            cur_line->slot = 0;
+            cur_line->writes = NULL;
         }
         if (DAB_NO_DATA != db_stat) {
             RETCLEAN(FAILURE);
         }
+        line_count += cur_unit->line_count;
+        cached_unit_count++;
     }
     if (DAB_NO_DATA != db_stat) {
         RETCLEAN(FAILURE);
     }
+    lc_init(instr_cache, cached_unit_count);
+    if (!cached_unit_count) {
+        RETCLEAN(SUCCESS);
+    }
+
+    /* read and update child code in bulk rather than word by word with ptrace */
+    char mem_name[256];
+    snprintf(mem_name, sizeof(mem_name), "/proc/%d/mem", pid);
+    mem_fd = open(mem_name, O_RDWR);
+    if (mem_fd < 0) {
+        ERR("Cannot open file '%s': %s", mem_name, strerror(errno));
+        RETCLEAN(FAILURE);
+    }
+
+    char probe;
+    if (pread(mem_fd, &probe, sizeof(probe), instr_cache[0].start) != sizeof(probe)) {
+        /* may fail because address needs to be adjusted by base address */
+        if (SUCCESS != get_base_address(pid, &base_address)) {
+            RETCLEAN(FAILURE);
+        }
+        if (!base_address) {
+            ERR("Cannot peek at child code (base addr is zero) - %s", strerror(errno));
+            RETCLEAN(FAILURE);
+        }
+        /* save base address for further use by Examine */
+        if (DAB_OK != DAB_EXEC("INSERT INTO misc (key, value) VALUES ('base_address', ?)", base_address)) {
+            ERR("Cannot update unit base address");
+            RETCLEAN(FAILURE);
+        }
+    }
+
+    if (use_displaced && SUCCESS != dsp_init(pid, line_count, instr_cache[0].start + base_address)) {
+        RETCLEAN(FAILURE);
+    }
+
+    /* with start trigger only trigger line gets breakpoint, the rest are armed when it is hit */
+    if (start_at) {
+        ret = set_trigger(start_at);
+    } else {
+        ret = arm_breakpoints();
+    }
+
+cleanup:
+    DAB_CURSOR_FREE(unit_cursor);
+    DAB_CURSOR_FREE(line_cursor);
+
+    return ret;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   find_trigger
+ *
+ *  Params:     spec - trigger in form of <file>:<line> or <function>
+ *              address - where to store trigger line address
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Find address of the first statement for the line, or of
+ *              function entry line
+ *
+ **************************************************************************/
+int find_trigger(const char *spec, uint64_t *address) {
+    void *cursor;
+    int ret;
+    char *file = strdup(spec);
+    char *colon = strrchr(file, ':');
+    char *end = NULL;
+    ULONG line = colon ? strtoul(colon + 1, &end, 10) : 0;
+
+    if (line && !*end) {
+        *colon = '\0';
+        ret = DAB_CURSOR_OPEN(&cursor, "SELECT "
+                    "statement.address "
+                "FROM "
+                    "statement "
+                    "JOIN file ON file.id = statement.file_id "
+                "WHERE "
+                    "(file.name = ? OR file.path = ?) "
+                    "AND statement.line = ? "
+                "ORDER BY "
+                    "statement.address "
+                "LIMIT 1",
+                file, file, line);
+    } else {
+        ret = DAB_CURSOR_OPEN(&cursor, "SELECT "
+                    "statement.address "
+                "FROM "
+                    "statement "
+                    "JOIN function ON function.id = statement.function_id "
+                "WHERE "
+                    "function.name = ? "
+                    "AND statement.func_flag = ? "
+                "LIMIT 1",
+                spec, FUNC_FLAG_START);
+    }
+    if (DAB_OK != ret) {
+        free(file);
+        return FAILURE;
+    }
+    ret = DAB_CURSOR_FETCH(cursor, address);
+    DAB_CURSOR_FREE(cursor);
+    free(file);
+    if (DAB_NO_DATA == ret) {
+        printf("Trigger '%s' doesn't match any traced line\n", spec);
+        return FAILURE;
+    } else if (DAB_OK != ret) {
+        return FAILURE;
+    }
+    INFO("Trigger '%s' is at 0x%" PRIx64, spec, *address);
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   arm_breakpoints
+ *
+ *  Params:     N/A
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Set breakpoints for all cached units
+ *
+ **************************************************************************/
+int arm_breakpoints(void) {
+    uint64_t displaced = 0, skipped = 0, line_count = 0;
+    for (struct cached_unit *cur_unit = instr_cache; cur_unit < instr_cache + cached_unit_count; cur_unit++) {
+        if (SUCCESS != arm_unit(cur_unit, &displaced, &skipped)) {
+            return FAILURE;
+        }
+        line_count += cur_unit->line_count;
+    }
+
+    if (use_displaced) {
+        if (SUCCESS != dsp_commit()) {
+            return FAILURE;
+        }
+        INFO("%" PRIu64 " of %" PRIu64 " lines use displaced stepping", displaced, line_count);
+    }
+    if (skipped) {
+        WARN("%" PRIu64 " lines cannot be displaced and won't be recorded", skipped);
+    }
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   set_trigger
+ *
+ *  Params:     address - trigger line address
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Set the only breakpoint at start trigger line
+ *
+ **************************************************************************/
+int set_trigger(uint64_t address) {
+    struct cached_line *line = lc_lookup(address);
+    if (!line) {
+        ERR("Start trigger at 0x%" PRIx64 " isn't in traced code", address);
+        return FAILURE;
+    }
+    if (1 != pread(mem_fd, &line->org_instr_byte, 1, address + base_address)) {
+        ERR("Cannot peek at child code - %s", strerror(errno));
+        return FAILURE;
+    }
+    char int3 = 0xCC;
+    if (1 != pwrite(mem_fd, &int3, 1, address + base_address)) {
+        ERR("Cannot update child code - %s", strerror(errno));
+        return FAILURE;
+    }
+    line->armed = 1;
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   fire_trigger
+ *
+ *  Params:     N/A
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Child stopped at start trigger - remove trigger breakpoint
+ *              and arm all lines, including trigger one, so trigger stop
+ *              gets processed as regular breakpoint
+ *
+ **************************************************************************/
+int fire_trigger(void) {
+    INFO("Start trigger reached");
+    struct cached_line *line = lc_lookup(start_at);
+    /* original code must be in place when arming, otherwise INT 3 is saved as original instruction */
+    if (1 != pwrite(mem_fd, &line->org_instr_byte, 1, start_at + base_address)) {
+        ERR("Cannot update child code - %s", strerror(errno));
+        return FAILURE;
+    }
+    line->armed = 0;
+
+    if (SUCCESS != arm_breakpoints()) {
+        return FAILURE;
+    }
+    if (!line->armed) {
+        /* lazy arming - arm the function trigger belongs to */
+        struct cached_unit *unit;
+        for (unit = instr_cache; unit < instr_cache + cached_unit_count; unit++) {
+            if (line >= unit->lines && line < unit->lines + unit->line_count) {
+                break;
+            }
+        }
+        struct cached_line *entry;
+        for (entry = line; entry > unit->lines && FUNC_FLAG_START != entry->func_flag &&
+                entry[-1].func_id == line->func_id; entry--);
+        if (SUCCESS != arm_function(entry)) {
+            return FAILURE;
+        }
+    }
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   drain_fifo
+ *
+ *  Params:     arg - not used
+ *
+ *  Return:     NULL
+ *
+ *  Descr:      Thread function - discard heap events sent by child until
+ *              start trigger is reached
+ *
+ **************************************************************************/
+void *drain_fifo(void *arg) {
+    (void)arg;
+    struct heap_event event;
+    uint64_t discarded = 0;
+    struct pollfd fifo = { .fd = fifo_fd, .events = POLLIN };
+
+    while (!__atomic_load_n(&triggered, __ATOMIC_ACQUIRE)) {
+        if (poll(&fifo, 1, 100) <= 0) {
+            continue;       // timeout or signal, check the trigger
+        }
+        while (read(fifo_fd, &event, sizeof(event)) > 0) {
+            discarded++;
+        }
+        if (fifo.revents & POLLHUP) {
+            usleep(100000);    // no writer yet or anymore, poll() returns immediately
+        }
+    }
+    INFO("%" PRIu64 " heap events before start trigger discarded", discarded);
+
+    return NULL;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   arm_unit
+ *
+ *  Params:     unit - cached unit with lines to set breakpoints for
+ *              displaced - counter of lines with displaced instruction
+ *              skipped - counter of lines left without breakpoint
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Read unit code at once, save original instruction bytes,
+ *              create displaced instructions if needed and write back
+ *              pages with breakpoints. With lazy arming only function
+ *              entry lines get breakpoints
+ *
+ **************************************************************************/
+int arm_unit(struct cached_unit *unit, uint64_t *displaced, uint64_t *skipped) {
+    uint64_t start = (unit->start + base_address) & PAGE_MASK;
+    /* last instruction may span to the next page */
+    uint64_t end = (unit->end + base_address + X86_MAX_INSTR_LEN + PAGE_SIZE - 1) & PAGE_MASK;
+    char *code = malloc(end - start);
+    ssize_t size = pread(mem_fd, code, end - start, start);
+    /* code may end before the end of the last page */
+    if (size <= (ssize_t)(unit->end + base_address - start)) {
+        ERR("Cannot peek at child code - %s", size < 0 ? strerror(errno) : "short read");
+        free(code);
+        return FAILURE;
+    }
+
+    uint64_t page = 0;  // page with breakpoints to write back, relative to start
+    int dirty = 0;
+    for (struct cached_line *cur_line = unit->lines; cur_line < unit->lines + unit->line_count; cur_line++) {
+        uint64_t offset = cur_line->address + base_address - start;
+        cur_line->org_instr_byte = code[offset];
+        if (use_displaced) {
+            uint64_t avail = size - offset;
+            cur_line->slot = dsp_add_line(cur_line->address + base_address, (uint8_t *)code + offset,
+                    avail < X86_MAX_INSTR_LEN ? avail : X86_MAX_INSTR_LEN);
+            if (cur_line->slot) {
+                (*displaced)++;
+            } else if (use_agent) {
+                /* agent cannot step over original instruction, so line isn't traced */
+                (*skipped)++;
+                continue;
+            } else {
+                DBG("Instruction at 0x%" PRIx64 " cannot be displaced", cur_line->address);
+            }
+        }
+
+        if (lazy_arm && FUNC_FLAG_START != cur_line->func_flag && cur_line->func_id) {
+            continue;       // will be armed when function is called for the first time
+        }
+
+        if ((offset & PAGE_MASK) != page) {
+            if (dirty && PAGE_SIZE != pwrite(mem_fd, code + page, PAGE_SIZE, start + page)) {
+                ERR("Cannot update child code - %s", strerror(errno));
+                free(code);
+                return FAILURE;
+            }
+            page = offset & PAGE_MASK;
+        }
+        code[offset] = 0xCC;    // INT 3
+        cur_line->armed = 1;
+        dirty = 1;
+        DBG("Set breakpoint at 0x%" PRIx64, cur_line->address);
+    }
+    /* last page may be incomplete */
+    uint64_t tail = (uint64_t)size - page < PAGE_SIZE ? (uint64_t)size - page : PAGE_SIZE;
+    if (dirty && (ssize_t)tail != pwrite(mem_fd, code + page, tail, start + page)) {
+        ERR("Cannot update child code - %s", strerror(errno));
+        free(code);
+        return FAILURE;
+    }
+
+    free(code);
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   arm_function
+ *
+ *  Params:     line - function entry line
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Set breakpoints for all function lines if it is the first
+ *              call of the function
+ *
+ **************************************************************************/
+int arm_function(struct cached_line *line) {
+    /* function lines are contiguous within the unit, starting from entry line */
+    struct cached_unit *unit;
+    for (unit = instr_cache; unit < instr_cache + cached_unit_count; unit++) {
+        if (line >= unit->lines && line < unit->lines + unit->line_count) {
+            break;
+        }
+    }
+    struct cached_line *last;
+    for (last = line; last + 1 < unit->lines + unit->line_count && last[1].func_id == line->func_id; last++);
+    if (last == line || last->armed) {
+        return SUCCESS;     // function is armed already
+    }
+
+    uint64_t start = line[1].address + base_address;
+    size_t size = last->address + base_address - start + 1;
+    char *code = malloc(size);
+    if ((ssize_t)size != pread(mem_fd, code, size, start)) {
+        ERR("Cannot peek at child code - %s", strerror(errno));
+        free(code);
+        return FAILURE;
+    }
+    for (struct cached_line *cur_line = line + 1; cur_line <= last; cur_line++) {
+        code[cur_line->address + base_address - start] = 0xCC;     // INT 3
+        cur_line->armed = 1;
+    }
+    if ((ssize_t)size != pwrite(mem_fd, code, size, start)) {
+        ERR("Cannot update child code - %s", strerror(errno));
+        free(code);
+        return FAILURE;
+    }
+    free(code);
+    DBG("Armed %td lines of function %" PRIu64, last - line, line->func_id);
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   compare_slots
+ *
+ *  Params:     a, b - slots to compare
+ *
+ *  Return:     -1 / 0 / 1
+ *
+ *  Descr:      Compare slots by address, used for sorting
+ *
+ **************************************************************************/
+int compare_slots(const void *a, const void *b) {
+    uint64_t left = ((const struct agent_slot *)a)->address;
+    uint64_t right = ((const struct agent_slot *)b)->address;
+    return left < right ? -1 : left > right;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   set_agent
+ *
+ *  Params:     pid - pid of process being traced
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Create shared memory for in-process agent with the table
+ *              of displaced instructions
+ *
+ **************************************************************************/
+int set_agent(pid_t pid) {
+    uint64_t slot_count = 0;
+    for (struct cached_unit *cur_unit = instr_cache; cur_unit < instr_cache + cached_unit_count; cur_unit++) {
+        for (struct cached_line *cur_line = cur_unit->lines; cur_line < cur_unit->lines + cur_unit->line_count;
+                cur_line++) {
+            if (cur_line->slot) {
+                slot_count++;
+            }
+        }
+    }
+
+    uint64_t slots_offset = sizeof(struct agent_ring);
+    uint64_t steps_offset = slots_offset + slot_count * sizeof(struct agent_slot);
+    steps_offset = (steps_offset + 63) & ~63ULL;    // avoid sharing cache line between slots and steps
+    uint64_t stack_offset = steps_offset + use_agent * sizeof(struct agent_step);
+    stack_offset = (stack_offset + 15) & ~15ULL;
+    agent_size = stack_offset + AGENT_STACK_SIZE;
+
+    char shm_name[64];
+    sprintf(shm_name, AGENT_SHM_PREFIX "%X", pid);
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        ERR("Cannot create shared memory: %s", strerror(errno));
+        return FAILURE;
+    }
+    /* agent runs with real uid so it needs access to the memory */
+    if (fchown(fd, real_uid, real_gid) || ftruncate(fd, agent_size)) {
+        ERR("Cannot set up shared memory: %s", strerror(errno));
+        close(fd);
+        return FAILURE;
+    }
+    agent = mmap(NULL, agent_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == agent) {
+        agent = NULL;
+        ERR("Cannot map shared memory: %s", strerror(errno));
+        return FAILURE;
+    }
 
-cleanup:
-    DAB_CURSOR_FREE(unit_cursor);
-    DAB_CURSOR_FREE(line_cursor);
+    agent->magic = AGENT_MAGIC;
+    agent->batch = use_agent;
+    agent->slot_count = slot_count;
+    agent->slots_offset = slots_offset;
+    agent->steps_offset = steps_offset;
+    agent->stack_offset = stack_offset;
 
-    return ret;
+    struct agent_slot *slot = AGENT_SLOTS(agent);
+    for (struct cached_unit *cur_unit = instr_cache; cur_unit < instr_cache + cached_unit_count; cur_unit++) {
+        for (struct cached_line *cur_line = cur_unit->lines; cur_line < cur_unit->lines + cur_unit->line_count;
+                cur_line++) {
+            if (cur_line->slot) {
+                slot->address = cur_line->address + base_address;
+                slot->slot = cur_line->slot;
+                slot++;
+            }
+        }
+    }
+    /* units are sorted by start address but may overlap */
+    qsort(AGENT_SLOTS(agent), slot_count, sizeof(struct agent_slot), compare_slots);
+    INFO("Agent shared memory %s created, %zu bytes", shm_name, agent_size);
+
+    return SUCCESS;
 }
 
 
 /**************************************************************************
  *
- *  Function:   lookup_cache
+ *  Function:   run_agent
  *
- *  Params:     address - statement address to look for
+ *  Params:     pid - pid of process being traced
+ *              signum - where to store the signal that terminated child,
+ *                       0 if child exited normally
  *
- *  Return:     found cached entry / NULL if not found
+ *  Return:     SUCCESS / FAILURE
  *
- *  Descr:      Find unit where address is located, within unit use
- *              linear approximation to find the address
+ *  Descr:      Detach from child and process steps, reported by in-process
+ *              agent, until child terminates. Memory changes and heap
+ *              events are processed at the end of every batch, when agent
+ *              waits for tracer, so memory doesn't change
  *
  **************************************************************************/
-struct cached_line *lookup_cache(uint64_t address) {
-    static int unit;   // typically addresses come from the same unit
-    int index, left, right;
+int run_agent(pid_t pid, int *signum) {
+    uint64_t seq = 0;   // last step processed
+    int exited = 0;
+    int wait_status = 0;
+    struct timespec timeout = {0, 100000000};   // check for child exit every 100 ms while waiting for steps
+
+    /* child is at displaced instruction already, breakpoints are handled by agent from now on */
+    if (-1 == ptrace(PTRACE_DETACH, pid, NULL, NULL)) {
+        ERR("Cannot detach from child: %s", strerror(errno));
+        return FAILURE;
+    }
 
-    if (instr_cache[unit].start > address || instr_cache[unit].end < address) {
-        /* unit has changed - look for unit */
-        left = 0;
-        right = unit_count;     // search interval doesn't include right bound 
-        for (index = right / 2; right > left; index = (left + right) / 2) {
-            if (address < instr_cache[index].start) {
-                right = index;
-            } else if (address > instr_cache[index].end) {
-                left = index + 1;
-            } else {
-                break;
+    for (;;) {
+        uint32_t head = __atomic_load_n(&agent->head, __ATOMIC_ACQUIRE);
+        if (head == (uint32_t)seq) {
+            if (exited) {
+                break;      // everything child reported is processed
             }
+            if (__atomic_load_n(&agent->flush, __ATOMIC_ACQUIRE)) {
+                /* child is terminating - read memory, written since last sync, while it is still there */
+                final_sync(seq);
+                __atomic_store_n(&agent->flush, 0, __ATOMIC_RELEASE);
+                agent_futex(&agent->flush, FUTEX_WAKE, 1, NULL);
+                continue;
+            }
+            pid_t res = waitpid(pid, &wait_status, WNOHANG);
+            if (res < 0) {
+                ERR("Cannot get child status: %s", strerror(errno));
+                return FAILURE;
+            }
+            if (res && (WIFEXITED(wait_status) || WIFSIGNALED(wait_status))) {
+                exited = 1;
+                continue;   // child may have reported some steps before terminating
+            }
+            /* agent wakes up tracer only if it is waiting */
+            __atomic_store_n(&agent->waiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&agent->head, __ATOMIC_SEQ_CST) == head &&
+                    !__atomic_load_n(&agent->flush, __ATOMIC_SEQ_CST)) {
+                agent_futex(&agent->head, FUTEX_WAIT, head, &timeout);
+            }
+            __atomic_store_n(&agent->waiting, 0, __ATOMIC_SEQ_CST);
+            continue;
         }
-        if (left == right) {
-            return NULL;
-        }
-        unit = index;
-    }
 
-    left = 0;
-    uint64_t left_addr = instr_cache[unit].lines[left].address;
-    right = instr_cache[unit].line_count - 1;   // search interval does include right bound
-    uint64_t right_addr = instr_cache[unit].lines[right].address;
+        struct agent_step *step = AGENT_STEPS(agent) + seq % agent->batch;
+        seq++;
+        /* wait until BPF callback finishes processing */
+        while (sem_wait(&bpf_sem)) {
+            if (EINTR != errno) {
+                ERR("Error waiting for condition: %s", strerror(errno));
+                return FAILURE;
+            }
+        }
 
-    while (right >= left) {     // because right bound is included, right and left can be equal
-        /* addresses are sequential and kinda uniformly distributed, so linear approximation
-           should do better than binary search */
-        index = left + (address - left_addr) * (right - left) / (right_addr - left_addr);
-        if (address < instr_cache[unit].lines[index].address) {
-            right = index - 1;
-            right_addr = instr_cache[unit].lines[right].address;
-        } else if (address > instr_cache[unit].lines[index].address) {
-            left = index + 1;
-            left_addr = instr_cache[unit].lines[left].address;
-        } else {
-            break;
+        /* agent waits for tracer at the end of batch, only then memory can be examined */
+        int sync = !(seq % agent->batch) && !exited;
+        int wait_reset = 0;
+        if (sync && mem_dirty) {
+            trigger_reset_dirty();
+            wait_reset = 1;
+        }
+        struct cached_line *line;
+        if (SUCCESS != process_step(&step->regs, sync, &line)) {
+            return FAILURE;
+        }
+        if (wait_reset) {
+            wait_reset_dirty();
+        }
+        if (sync) {
+            __atomic_store_n(&agent->release, (uint32_t)(seq / agent->batch), __ATOMIC_RELEASE);
+            agent_futex(&agent->release, FUTEX_WAKE, 1, NULL);
         }
     }
-    if (left > right) {
-        return NULL;
+
+    if (WIFSIGNALED(wait_status)) {
+        *signum = WTERMSIG(wait_status);
+        INFO("Child terminated - %s", strsignal(*signum));
+    } else {
+        *signum = 0;
+        INFO("child exited");
     }
 
-    return &instr_cache[unit].lines[index];
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   final_sync
+ *
+ *  Params:     seq - number of steps, reported by agent
+ *
+ *  Return:     N/A
+ *
+ *  Descr:      Process memory, written since the last sync, when agent
+ *              asks for it before child terminates. Changes are
+ *              attributed to the last step
+ *
+ *  Notes:      There is no SIGTRAP to make sure BPF callback has reported
+ *              all written pages, so all cached memory is compared
+ *
+ **************************************************************************/
+void final_sync(uint64_t seq) {
+    if (!seq) {
+        return;     // no steps to attribute changes to
+    }
+    struct agent_step *step = AGENT_STEPS(agent) + (seq - 1) % agent->batch;
+    cache_lost_pages();
+    proc_dirty_mem(step_id, cur_thread->tid, stack_diff ? SP(step->regs) : 0, NULL, -1);
+    mem_dirty = 0;
 }
 
 
@@ -480,21 +2145,27 @@ struct cached_line *lookup_cache(uint64_t address) {
  *
  *  Function:   process_breakpoint
  *
- *  Params:     pid - pid of process being traced
+ *  Params:     tid - thread that has hit the breakpoint
  *
  *  Return:     SUCCESS / FAILURE
  *
- *  Descr:      Process the breakpoint:
- *              - store program step
- *              - check for any dynamic memory ops happened since prev step
- *              - process memory changes reported since prev step
+ *  Descr:      Process the breakpoint - store the step and continue
+ *              child either from displaced instruction or by stepping over
+ *              original instruction
  *
  **************************************************************************/
-int process_breakpoint(pid_t pid) {
-    static ULONG depth = 0, func_id = 0;
+int process_breakpoint(pid_t tid) {
     REG_TYPE int3 = 0xCC;    // INT 3
     int wait_reset;
 
+    switch_thread(get_thread(tid, 1));
+    if (!cur_thread->depth_known) {
+        if (SUCCESS != set_initial_depth(tid)) {
+            return FAILURE;
+        }
+        cur_thread->depth_known = 1;
+    }
+
     DBG("mem_dirty is %d", mem_dirty);
     if (mem_dirty) {
         /* trigger reset_dirty thread to reset clear_refs. This is the slowest process so trigger it
@@ -504,53 +2175,178 @@ int process_breakpoint(pid_t pid) {
     } else {
         wait_reset = 0;
     }
-    step_id++;
 
     /* Get registers */
     struct user_regs_struct regs;
-    if (-1 == ptrace(PTRACE_GETREGS, pid, NULL, &regs)) {
+    if (-1 == ptrace(PTRACE_GETREGS, tid, NULL, &regs)) {
         ERR("Cannot read process registers - %s", strerror(errno));
         return FAILURE;
     }
 
+    struct cached_line *line;
+    if (SUCCESS != process_step(&regs, 1, &line)) {
+        return FAILURE;
+    }
+    if (lazy_arm && FUNC_FLAG_START == line->func_flag && SUCCESS != arm_function(line)) {
+        return FAILURE;
+    }
     REG_TYPE pc = IP(regs) - 1;       // program counter at breakpoint, before it processed the TRAP
 
-    struct cached_line *line = lookup_cache(pc - base_address);
-    if (!line) {
+    if (line->slot) {
+        /* displaced stepping - breakpoint stays in place, child continues from the copy of original
+           instruction, which jumps back to the next instruction */
+        IP(regs) = line->slot;
+        if (-1 == ptrace(PTRACE_SETREGS, tid, NULL, &regs)) {
+            ERR("Cannot set process registers - %s", strerror(errno));
+            return FAILURE;
+        }
+        if (wait_reset) {
+            wait_reset_dirty();
+        }
+        return SUCCESS;
+    }
+
+    /* restore original instruction, step over it */
+    REG_TYPE instr = ptrace(PTRACE_PEEKDATA, tid, (void *)pc, NULL);
+    if (errno) {
+        ERR("Cannot peek at child code - %s", strerror(errno));
+        return FAILURE;
+    }
+
+    if (-1 == ptrace(PTRACE_POKEDATA, tid, (void *)pc, (void *)(void *)((instr & ~0xFF) | line->org_instr_byte))) {
+        ERR("Cannot update child code - %s", strerror(errno));
+        return FAILURE;
+    }
+    set_ip(tid, pc);
+
+    if (wait_reset) {
+        /* wait for memory wotker threads to finish, have to do it before stepping into the program because it can
+           modify data, so all references for all pages must be cleared */
+        wait_reset_dirty();
+    }
+
+    if (bpf_running) {
+        __atomic_add_fetch(&step_traps, 1, __ATOMIC_SEQ_CST);    // let BPF callback know about extra SIGTRAP
+    }
+    if (-1 == ptrace(PTRACE_SINGLESTEP, tid, NULL, NULL)) {
+        ERR("Cannot restore original instruction - %s", strerror(errno));
+        return FAILURE;
+    }
+
+    int wait_status;
+    // wait for SIGTRAP from child, indicating the breakpoint. Single step is short so don't interrupt it
+    while (-1 == waitpid(tid, &wait_status, __WALL) && EINTR == errno);
+    if (!WIFSTOPPED(wait_status) || !(WSTOPSIG(wait_status) == SIGTRAP)) {
+        ERR("Didn't get expected SIGTRAP - got %d", WSTOPSIG(wait_status));
+        return FAILURE;
+    }
+
+    /* re-instate TRAP */
+    if (-1 == ptrace(PTRACE_POKEDATA, tid, (void *)pc, (void *)((instr & ~0xFF) | int3))) {
+        ERR("Cannot update child code - %s", strerror(errno));
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   process_step
+ *
+ *  Params:     regs - child registers at breakpoint
+ *              sync - whether child is stopped and its memory can be
+ *                     examined
+ *              line - where to store cached line for the breakpoint
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Process program step:
+ *              - store program step
+ *              - check for any dynamic memory ops happened since prev step
+ *              - process memory changes reported since prev step
+ *
+ **************************************************************************/
+int process_step(struct user_regs_struct *regs, int sync, struct cached_line **line) {
+    step_id++;
+
+    REG_TYPE pc = IP((*regs)) - 1;    // program counter at breakpoint, before it processed the TRAP
+
+    struct cached_line *cur_line = lc_lookup(pc - base_address);
+    if (!cur_line) {
         WARN("Cannot find statement for address 0x%" PRIx64, (uint64_t)pc - base_address);
         return FAILURE;
     }
+    *line = cur_line;
+    if (!cur_thread->stepped) {
+        /* name can be changed by the thread itself, so get it when thread starts doing something interesting */
+        char tmp[64];
+        snprintf(tmp, sizeof(tmp), "/proc/%d/task/%d/comm", threads[0]->tid, cur_thread->tid);
+        FILE *comm = fopen(tmp, "r");
+        if (comm) {
+            if (fgets(cur_thread->name, sizeof(cur_thread->name), comm)) {
+                cur_thread->name[strcspn(cur_thread->name, "\n")] = '\0';
+            }
+            fclose(comm);
+        }
+        cur_thread->stepped = 1;
+    }
 
-    if (line->func_id != func_id || FUNC_FLAG_START == line->func_flag) {
-        if (FUNC_FLAG_START == line->func_flag) {
+    if (cur_line->func_id != func_id || FUNC_FLAG_START == cur_line->func_flag) {
+        if (FUNC_FLAG_START == cur_line->func_flag) {
             depth++;        // got to the begining of the function - new function call
         }
         // depth for FUNC_FLAG_END will be decremented after processing the step
         // if not function call, we can get here as a result of return from function call or long jump
         // TODO handle long jump
-        func_id = line->func_id;
+        func_id = cur_line->func_id;
     }
-    if (mem_dirty && FUNC_FLAG_START != line->func_flag) {
-        proc_dirty_mem(step_id);
+    if (sync && FUNC_FLAG_START != cur_line->func_flag) {
+        collect_dirty_pages();      // pages written since last collection are reported only with PAGEMAP_SCAN
+    }
+    if (sync && (mem_dirty || stack_diff) && FUNC_FLAG_START != cur_line->func_flag) {
+        int moved = proc_dirty_mem(step_id, cur_thread->tid, stack_diff ? SP((*regs)) : 0,
+                write_count < 0 ? NULL : writes, write_count);
         mem_dirty = 0;      // important to reset it here because next instruction can cause PF and set it back to 1
+        if (moved) {
+            mem_dirty = 1;  // pages, left by stack window, may be written without notice until tracking is reset
+        }
+    }
+    if (exact_writes) {
+        /* writes of the line are all writes till next step only if no other thread runs. Memory, written by
+           function entry line, is processed together with the next line */
+        write_count = -1;
+        if (sync && FUNC_FLAG_START != cur_line->func_flag && single_thread()) {
+            write_count = line_writes(cur_line, regs, writes);
+        }
     }
 
     /* Store new step using worker */
     DBG("Step %" PRId64 " at 0x%" PRIx64, step_id, (uint64_t)pc);
     struct insert_step_msg *msg = malloc(sizeof(*msg));
     msg->step_id = step_id;
+    msg->thread_id = cur_thread->id;
     msg->depth = depth;
     msg->func_id = func_id;
     msg->address = pc - base_address;
-    msg->regs = regs;   // regs is struct, not a pointer, so it will be copied
+    msg->regs = *regs;  // regs is struct, so it will be copied
+    msg->keyframe = 0;
+    __atomic_add_fetch(&recorded_bytes, sizeof(*msg), __ATOMIC_RELAXED);
+
+    /* memory cache is in sync with child memory only if all changes are processed. Black box history starts from
+       memory keyframe, so keyframe step must have full register set */
+    if ((window_steps || window_bytes) && sync && !mem_dirty) {
+        msg->keyframe = move_window();
+    }
     ch_write(insert_step_ch, (char *)msg, sizeof(*msg));    // channel reader will free msg
 
     /* check for heap events happened in tracee. It doesn't make sense to place it in a separate thread 
        as potential gain (measured as 1.8%) will be killed by thread sync overhead */
-    int read_status;
+    int read_status = 0;
     struct heap_event event;
     // read() won't block if there is nothing to read
-    while ((read_status = read(fifo_fd, &event, sizeof(event))) > 0) {
+    while (sync && (read_status = read(fifo_fd, &event, sizeof(event))) > 0) {
         /* Store heap memory event using worker */
         struct insert_heap_msg *msg = malloc(sizeof(*msg));
         msg->step_id = step_id;
@@ -567,51 +2363,243 @@ int process_breakpoint(pid_t pid) {
         return FAILURE;
     }
 
-    if (FUNC_FLAG_END == line->func_flag) {
+    if (FUNC_FLAG_END == cur_line->func_flag) {
         depth--;
     }
-
-    /* restore original instruction, step over it */
-    REG_TYPE instr = ptrace(PTRACE_PEEKDATA, pid, (void *)pc, NULL);
-    if (errno) {
-        ERR("Cannot peek at child code - %s", strerror(errno));
-        return FAILURE;
+    if (stop_at && cur_line->address == stop_at) {
+        stop_reached = 1;
     }
 
-    if (-1 == ptrace(PTRACE_POKEDATA, pid, (void *)pc, (void *)(void *)((instr & ~0xFF) | line->org_instr_byte))) {
-        ERR("Cannot update child code - %s", strerror(errno));
-        return FAILURE;
+    return SUCCESS;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   single_thread
+ *
+ *  Params:     N/A
+ *
+ *  Return:     1 if child has single running thread / 0 otherwise
+ *
+ *  Descr:      Check if current thread is the only thread of the child
+ *
+ **************************************************************************/
+int single_thread(void) {
+    for (int i = 0; i < thread_count; i++) {
+        if (threads[i] != cur_thread && !threads[i]->exited) {
+            return 0;
+        }
     }
-    set_ip(pid, pc);
 
-    if (wait_reset) {
-        /* wait for memory wotker threads to finish, have to do it before stepping into the program because it can
-           modify data, so all references for all pages must be cleared */
-        wait_reset_dirty();
+    return 1;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   line_writes
+ *
+ *  Params:     line - line, that starts execution
+ *              regs - registers at the start of the line
+ *              ranges - where to store written memory
+ *
+ *  Return:     number of written ranges / -1 if written memory isn't
+ *              known
+ *
+ *  Descr:      Find memory, the line is going to write. Line is decoded
+ *              when it is executed for the first time
+ *
+ **************************************************************************/
+int line_writes(struct cached_line *line, const struct user_regs_struct *regs, struct mem_range *ranges) {
+    if (!line->writes) {
+        line->writes = decode_writes(line);
+    }
+    for (int i = 0; i < line->writes->count; i++) {
+        const struct x86_mem *op = line->writes->ops + i;
+        uint64_t address = op->disp;
+        if (X86_REG_NONE != op->base) {
+            address += *(const REG_TYPE *)((const char *)regs + gpr_offsets[op->base]);
+        }
+        if (X86_REG_NONE != op->index) {
+            address += *(const REG_TYPE *)((const char *)regs + gpr_offsets[op->index]) * op->scale;
+        }
+        ranges[i].start = address;
+        ranges[i].end = address + op->size;
     }
 
-    if (-1 == ptrace(PTRACE_SINGLESTEP, pid, NULL, NULL)) {
-        ERR("Cannot restore original instruction - %s", strerror(errno));
-        return FAILURE;
+    return line->writes->count;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   decode_writes
+ *
+ *  Params:     line - line to decode
+ *
+ *  Return:     memory writes of the line
+ *
+ *  Descr:      Decode line code to find memory it writes. Writes are
+ *              known only if line doesn't call anything, leaves the line
+ *              only by jump to another line with breakpoint and doesn't
+ *              change registers, used for write address, before the write
+ *
+ **************************************************************************/
+struct line_writes *decode_writes(struct cached_line *line) {
+    static struct line_writes unknown = {-1};
+
+    /* line ends where the next line of the unit starts */
+    struct cached_unit *unit;
+    for (unit = instr_cache; unit < instr_cache + cached_unit_count; unit++) {
+        if (line >= unit->lines && line < unit->lines + unit->line_count) {
+            break;
+        }
+    }
+    if (line + 1 == unit->lines + unit->line_count || !line[1].armed ||
+            line[1].address - line->address > LINE_CODE_MAX) {
+        return &unknown;
+    }
+    uint64_t start = line->address + base_address;
+    size_t size = line[1].address - line->address;
+    uint8_t code[LINE_CODE_MAX];
+    if ((ssize_t)size != pread(mem_fd, code, size, start)) {
+        WARN("Cannot peek at child code - %s", strerror(errno));
+        return &unknown;
+    }
+    if (line->armed) {
+        code[0] = line->org_instr_byte;
     }
 
-    int wait_status;
-    waitpid(pid, &wait_status, 0);      // wait for SIGTRAP from child, indicating the breakpoint
-    if (!WIFSTOPPED(wait_status) || !(WSTOPSIG(wait_status) == SIGTRAP)) {
-        ERR("Didn't get expected SIGTRAP - got %d", WSTOPSIG(wait_status));
-        return FAILURE;
+    struct line_writes *decoded = malloc(sizeof(*decoded) + sizeof(*decoded->ops) * LINE_WRITES_MAX);
+    decoded->count = 0;
+    uint16_t changed = 0;       // registers, changed by already decoded instructions
+    struct x86_instr instr;
+    for (size_t pos = 0; pos < size; pos += instr.length) {
+        struct x86_mem op;
+        uint16_t clobbers;
+        if (SUCCESS != x86_decode(code + pos, size - pos, &instr)) {
+            break;
+        }
+        int effect = x86_effects(&instr, &op, &clobbers);
+        if (X86_WRITE_UNKNOWN == effect) {
+            break;
+        }
+        uint64_t next = start + pos + instr.length;
+        if (instr.flags & X86_FLAG_BRANCH) {
+            /* jump forward within the line skips some writes, jump elsewhere must get to the breakpoint */
+            uint64_t target = next + instr.imm;
+            struct cached_line *target_line = lc_lookup(target - base_address);
+            if ((target <= start + pos || target >= start + size) && (!target_line || !target_line->armed)) {
+                break;
+            }
+        }
+        if (X86_WRITE_MEM == effect) {
+            if (decoded->count == LINE_WRITES_MAX ||
+                    (X86_REG_RIP != op.base && X86_REG_NONE != op.base && changed & 1 << op.base) ||
+                    (X86_REG_NONE != op.index && changed & 1 << op.index)) {
+                break;
+            }
+            if (X86_REG_RIP == op.base) {
+                op.base = X86_REG_NONE;
+                op.disp += next;
+            }
+            decoded->ops[decoded->count++] = op;
+        }
+        changed |= clobbers;
+        if (pos + instr.length == size) {
+            DBG("Line at 0x%" PRIx64 " writes %d operands", line->address, decoded->count);
+            return realloc(decoded, sizeof(*decoded) + sizeof(*decoded->ops) * decoded->count);
+        }
     }
+    free(decoded);
 
-    /* re-instate TRAP */
-    if (-1 == ptrace(PTRACE_POKEDATA, pid, (void *)pc, (void *)((instr & ~0xFF) | int3))) {
-        ERR("Cannot update child code - %s", strerror(errno));
+    DBG("Writes of line at 0x%" PRIx64 " cannot be found", line->address);
+    return &unknown;
+}
+
+
+/**************************************************************************
+ *
+ *  Function:   store_threads
+ *
+ *  Params:     N/A
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Store threads that have recorded steps in DB
+ *
+ **************************************************************************/
+int store_threads(void) {
+    if (DAB_OK != DAB_EXEC("CREATE TABLE thread ("
+                                "id     INTEGER PRIMARY KEY, "  // ref step.thread_id
+                                "tid    INTEGER, "
+                                "name   VARCHAR"
+                            ")")) {
         return FAILURE;
     }
+    for (int i = 0; i < thread_count; i++) {
+        if (threads[i]->stepped && DAB_OK != DAB_EXEC("INSERT INTO thread (id, tid, name) VALUES (?, ?, ?)",
+                    threads[i]->id, threads[i]->tid, threads[i]->name)) {
+            return FAILURE;
+        }
+    }
 
     return SUCCESS;
 }
 
 
+/**************************************************************************
+ *
+ *  Function:   move_window
+ *
+ *  Params:     N/A
+ *
+ *  Return:     1 if keyframe is stored / 0 if not
+ *
+ *  Descr:      In black box mode store periodic memory keyframes and let
+ *              DB workers drop records older than the newest keyframe
+ *              that is outside the window
+ *
+ **************************************************************************/
+int move_window(void) {
+    uint64_t bytes = __atomic_load_n(&recorded_bytes, __ATOMIC_RELAXED);
+    if (keyframe_count) {
+        struct keyframe *last = &keyframes[keyframe_count - 1];
+        if (window_steps ? step_id - last->step_id < window_steps / KEYFRAME_COUNT :
+                bytes - last->bytes < window_bytes / KEYFRAME_COUNT) {
+            return 0;   // too early for new keyframe
+        }
+    }
+
+    if (keyframe_count == sizeof(keyframes) / sizeof(*keyframes)) {
+        /* cannot happen unless window is tiny, the oldest keyframe isn't used anyway */
+        memmove(keyframes, keyframes + 1, sizeof(*keyframes) * --keyframe_count);
+    }
+    cache_keyframe(step_id);
+    keyframes[keyframe_count].step_id = step_id;
+    keyframes[keyframe_count].bytes = bytes;
+    keyframe_count++;
+
+    /* find the newest keyframe with at least window of history after it */
+    int index;
+    for (index = keyframe_count - 1; index >= 0; index--) {
+        if (window_steps ? step_id - keyframes[index].step_id >= window_steps :
+                bytes - keyframes[index].bytes >= window_bytes) {
+            break;
+        }
+    }
+    if (index > 0 || (0 == index && keyframes[0].step_id > prune_before)) {
+        __atomic_store_n(&prune_before, keyframes[index].step_id, __ATOMIC_RELAXED);
+        keyframe_count -= index;
+        memmove(keyframes, keyframes + index, sizeof(*keyframes) * keyframe_count);
+        DBG("Black box window starts at step %" PRIu64, prune_before);
+    }
+
+    return 1;
+}
+
+
 /**************************************************************************
  *
  *  Function:   set_ip
@@ -657,8 +2645,8 @@ void bpf_callback(void *unused, void *data, int data_size) {
     /* I assume that MMAPENTRY is always followed by MMAPEXIT, so saving size from ENTRY
        to use it when got EXIT */
     static uint64_t mapped_size = 0;
-    static int count = 0;
     static uint64_t brk_boundary = 0;
+    static struct bpf_event remap;          // same for MREMAPENTRY/MREMAPEXIT
 
     if (stop) {
         return;     // ignore events coming after child stop
@@ -668,16 +2656,13 @@ void bpf_callback(void *unused, void *data, int data_size) {
     if (BPF_EVT_SIGNAL == event->type) {
         DBG("signal %ld", event->payload);
         if (SIGTRAP == event->payload) {
-            /* two SIGTRAP signals generated for each stop, so post semaphore only on first one, second on is for
-               one instruction step within process_breakpoint() */
-            if (count) {
-                count = 0;
-            } else {
-                if (sem_post(&bpf_sem)) {
-                    ERR("Cannot post semaphore: %s", strerror(errno));
-                    return;
-                }
-                count = 1;
+            /* stepping over the breakpoint without displaced stepping generates second SIGTRAP for one
+               instruction step within process_breakpoint(), so post semaphore only for breakpoints */
+            if (__atomic_load_n(&step_traps, __ATOMIC_SEQ_CST) > 0) {
+                __atomic_sub_fetch(&step_traps, 1, __ATOMIC_SEQ_CST);
+            } else if (sem_post(&bpf_sem)) {
+                ERR("Cannot post semaphore: %s", strerror(errno));
+                return;
             }
         }
         return;
@@ -686,23 +2671,35 @@ void bpf_callback(void *unused, void *data, int data_size) {
     switch (event->type) {
         case BPF_EVT_PAGEFAULT:
             DBG("Page fault at 0x%" PRIx64, event->payload);
-            uint64_t *address = malloc(sizeof(*address));
-            *address = event->payload;
-            /* TODO: Compare what is faster - filter unknown address before sending or let workers deal with it */
-            ch_write(proc_mem_ch, (char *)address, sizeof(*address));
-            mem_dirty = 1;
+            if (check_dirty_fault(event->payload)) {
+                dirty_page(event->payload);
+            }
             break;
         case BPF_EVT_MMAPENTRY:
             DBG("Map entry");
             mapped_size = event->payload;
             break;
         case BPF_EVT_MMAPEXIT:
+            if (IS_ERR_VALUE(event->payload)) {
+                break;      // mmap failed
+            }
             DBG("New map at 0x%" PRIx64 " for %" PRId64, event->payload, mapped_size);
             cache_add_region(event->payload, mapped_size, step_id);
             break;
         case BPF_EVT_MUNMAP:
-            /* TODO: Remove memory region */
-            DBG("Unmap at 0x%" PRIx64, event->payload);
+            DBG("Unmap at 0x%" PRIx64 " for %" PRId64, event->payload, event->extra[0]);
+            cache_remove_region(event->payload, event->extra[0]);
+            break;
+        case BPF_EVT_MREMAPENTRY:
+            remap = *event;
+            break;
+        case BPF_EVT_MREMAPEXIT:
+            if (IS_ERR_VALUE(event->payload)) {
+                break;      // mremap failed, nothing has changed
+            }
+            DBG("Remap from 0x%" PRIx64 " for %" PRId64 " to 0x%" PRIx64 " for %" PRId64,
+                    remap.payload, remap.extra[0], event->payload, remap.extra[1]);
+            cache_move_region(remap.payload, remap.extra[0], event->payload, remap.extra[1], step_id);
             break;
         case BPF_EVT_BRK:
             if (!brk_boundary) {
@@ -712,9 +2709,10 @@ void bpf_callback(void *unused, void *data, int data_size) {
                 DBG("New malloc at 0x%" PRIx64 " for %" PRId64, brk_boundary, allocated);
                 cache_add_region(brk_boundary, allocated, step_id);
                 brk_boundary = event->payload;
-            } else {
-                /* TODO: Should it be processed? Can it really happen? */
-                INFO("Free");
+            } else if (event->payload < brk_boundary) {
+                DBG("Heap shrinks to 0x%" PRIx64, event->payload);
+                cache_remove_region(event->payload, brk_boundary - event->payload);
+                brk_boundary = event->payload;
             }
             break;
         default:
@@ -723,6 +2721,35 @@ void bpf_callback(void *unused, void *data, int data_size) {
 }
 
 
+/**************************************************************************
+ *
+ *  Function:   dirty_page
+ *
+ *  Params:     address - address within written page
+ *
+ *  Return:     1 if writes to the page must be tracked / 0 if not
+ *
+ *  Descr:      Pass written page to memory cache, it is processed at next
+ *              step. Called from BPF callback or from uffd thread
+ *
+ **************************************************************************/
+int dirty_page(uint64_t address) {
+    if (stack_diff && cache_in_stack(address)) {
+        return 0;   // stack window is compared on every step anyway
+    }
+    uint64_t *msg = malloc(sizeof(*msg));
+    *msg = address;
+    /* TODO: Compare what is faster - filter unknown address before sending or let workers deal with it */
+    if (CHANNEL_FULL == ch_write(proc_mem_ch, (char *)msg, sizeof(*msg))) {
+        free(msg);
+        cache_lost_pages();     // too many pages written since last step, compare all memory
+    }
+    mem_dirty = 1;
+
+    return 1;
+}
+
+
 /**************************************************************************
  *
  *  Function:   get_base_address
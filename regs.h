@@ -0,0 +1,121 @@
+/**************************************************************************
+ *
+ *  File:       regs.h
+ *
+ *  Project:    Flight recorder (https://github.com/qrdl/flightrec)
+ *
+ *  Descr:      Step register encoding
+ *
+ *  Notes:      Register encoding for step table, shared by 'record' and
+ *              'examine' components
+ *
+ **************************************************************************
+ *
+ *  Copyright (C) 2017-2020 Ilya Caramishev (flightrec@qrdl.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ **************************************************************************/
+#ifndef _REGS_H
+#define _REGS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/user.h>
+
+#include "flightrec.h"
+
+#define REGS_COUNT          (sizeof(struct user_regs_struct) / sizeof(REG_TYPE))
+/* max distance between steps with full set of registers, so restoring registers needs at most that many rows */
+#define REGS_KEYFRAME_FREQ  64
+
+/* Most registers don't change between steps, so step stores either full register set (keyframe), or bitmask of
+   changed registers, followed by changed values. Full set has the size of struct user_regs_struct, and delta with
+   all registers changed is stored as full set, so any shorter blob is a delta */
+struct regs_delta {
+    uint32_t    mask;
+    REG_TYPE    values[REGS_COUNT];
+} __attribute__((packed));
+
+/**************************************************************************
+ *
+ *  Function:   regs_encode
+ *
+ *  Params:     prev - registers at previous step
+ *              cur - registers at current step
+ *              delta - where to store the delta
+ *
+ *  Return:     delta size / 0 if full set should be stored instead
+ *
+ *  Descr:      Find changed registers
+ *
+ **************************************************************************/
+static inline size_t regs_encode(const struct user_regs_struct *prev, const struct user_regs_struct *cur,
+        struct regs_delta *delta) {
+    const REG_TYPE *old = (const REG_TYPE *)prev;
+    const REG_TYPE *new = (const REG_TYPE *)cur;
+    unsigned int count = 0;
+
+    delta->mask = 0;
+    for (unsigned int i = 0; i < REGS_COUNT; i++) {
+        if (old[i] != new[i]) {
+            delta->mask |= 1U << i;
+            delta->values[count++] = new[i];
+        }
+    }
+    size_t size = sizeof(delta->mask) + count * sizeof(REG_TYPE);
+
+    return size < sizeof(struct user_regs_struct) ? size : 0;
+}
+
+/**************************************************************************
+ *
+ *  Function:   regs_apply
+ *
+ *  Params:     regs - registers to update
+ *              blob - stored registers, either full set or delta
+ *              size - blob size
+ *
+ *  Return:     SUCCESS / FAILURE
+ *
+ *  Descr:      Update registers with stored ones
+ *
+ **************************************************************************/
+static inline int regs_apply(struct user_regs_struct *regs, const char *blob, size_t size) {
+    if (sizeof(*regs) == size) {
+        memcpy(regs, blob, size);
+        return SUCCESS;
+    }
+    struct regs_delta delta;
+    if (size < sizeof(delta.mask) || size > sizeof(delta)) {
+        return FAILURE;
+    }
+    memcpy(&delta, blob, size);
+
+    REG_TYPE *values = (REG_TYPE *)regs;
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < REGS_COUNT; i++) {
+        if (delta.mask & (1U << i)) {
+            if (sizeof(delta.mask) + count * sizeof(REG_TYPE) >= size) {
+                return FAILURE;     // mask doesn't match the size
+            }
+            values[i] = delta.values[count++];
+        }
+    }
+
+    return SUCCESS;
+}
+
+#endif
+
@@ -0,0 +1,18 @@
+#include <pthread.h>
+
+void *worker(void *arg) {
+    int *value = arg;
+    *value += 1;
+    *value += 2;
+    return NULL;
+}
+
+int main(void) {
+    int value = 0;
+    pthread_t thread;
+    pthread_create(&thread, NULL, worker, &value);
+    pthread_join(thread, NULL);
+    value += 3;
+    value += 4;
+    return 0;
+}